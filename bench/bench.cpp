@@ -0,0 +1,409 @@
+//============================================================================
+// Name        : bench.cpp
+// Author      : vincent
+// Version     :
+// Copyright   : all right reserved
+// Description : measures crunchx on a set of grammar shapes and writes the
+//               results as JSON. every measurement runs in a process of its
+//               own, so its peak RSS is its own
+//============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+
+#include "crunchx.h"
+
+using namespace std;
+
+static const char HELP_TXT[] = "Usage: bench [options]\n"
+"options:\n"
+"-h         show this help text\n"
+"-c file    the crunchx command line tool to measure the output path with, ./crunchx by default\n"
+"-e file    the example rules, ../examples/crunchx.rul by default\n"
+"-d dir     directory for the rule files and the output, /tmp by default\n"
+"-o file    write the results to the specified file instead of stdout\n"
+"-k name    run only the specified case\n"
+"-s scale   multiply the number of words of every case, 1 by default\n"
+"-r count   run every measurement count times and keep the fastest, 1 by default\n";
+
+//the words of the default rules, 8 alphanumeric characters
+static const char DEFAULT_RULES[] = "NUM:'0','1','2','3','4','5','6','7','8','9'\n"
+"LITER_LOWER:'a','b','c','d','e','f','g','h','i','j','k','l','m','n','o','p','q','r','s','t','u','v','w','x','y','z'\n"
+"LITER_UPPER:'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T','U','V','W','X','Y','Z'\n"
+"LITER:LITER_LOWER\n"
+"LITER:LITER_UPPER\n"
+"WORD:LITER,NUM\n"
+"PRODUCER: WORD WORD WORD WORD WORD WORD WORD WORD\n";
+
+static const size_t DEEP_LEVELS = 1000;
+static const size_t WIDE_TERMINALS = 65536;
+static const size_t LONG_TERMINALS = 64;
+static const size_t LONG_TERMINAL_LENGTH = 256;
+
+struct BenchCase{
+    string      name;
+    string      rules;
+    uint64_t    words;  //generated at most, before scaling
+};
+
+//one measurement: a run of the library into a null sink or of the tool into a file
+struct Measure{
+    bool        ok;
+    double      parseSeconds;   //null sink only
+    uint64_t    keyspace;       //null sink only, Generator::WORDS_OVERFLOW above 64 bits
+    uint64_t    words;
+    uint64_t    bytes;          //with one separator per word
+    double      seconds;
+    long        peakRssKb;
+};
+
+static double now()
+{
+    return chrono::duration< double >( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static bool readFile( const char* fileName, string& text )
+{
+    FILE* file = fopen( fileName, "rb" );
+    if( file == NULL )
+        return false;
+    char buffer[64*1024];
+    size_t size;
+    while( ( size = fread( buffer, 1, sizeof( buffer ), file ) ) > 0 )
+        text.append( buffer, size );
+    fclose( file );
+    return true;
+}
+
+static bool writeFile( const string& fileName, const string& text )
+{
+    FILE* file = fopen( fileName.c_str(), "wb" );
+    if( file == NULL )
+        return false;
+    bool ok = fwrite( text.data(), 1, text.size(), file ) == text.size();
+    return fclose( file ) == 0 && ok;
+}
+
+//the example rules with their PRODUCER lines replaced by the given one
+static string exampleRules( const string& example, const char* producer )
+{
+    string rules;
+    size_t pos = 0;
+    while( pos < example.size() )
+    {
+        size_t end = example.find( '\n', pos );
+        end = ( end == string::npos ) ? example.size() : end + 1;
+        if( example.compare( pos, 9, "PRODUCER:" ) != 0 )
+            rules.append( example, pos, end - pos );
+        pos = end;
+    }
+    return rules + "\n" + producer + "\n";
+}
+
+//a chain of nested producers: every level is a terminal or the next level behind one
+static string deepRules()
+{
+    string rules;
+    char line[128];
+    for( size_t i = 0; i + 1 < DEEP_LEVELS; ++i )
+    {
+        snprintf( line, sizeof( line ), "D%u:'a' D%u,'b'\n", (unsigned)i, (unsigned)( i + 1 ) );
+        rules += line;
+    }
+    snprintf( line, sizeof( line ), "D%u:'c'\n", (unsigned)( DEEP_LEVELS - 1 ) );
+    return rules + line + "PRODUCER:D0 D0 D0\n";
+}
+
+static string wideRules()
+{
+    string rules = "W:";
+    char term[32];
+    for( size_t i = 0; i < WIDE_TERMINALS; ++i )
+    {
+        snprintf( term, sizeof( term ), "%s'w%05u'", i ? "," : "", (unsigned)i );
+        rules += term;
+    }
+    return rules + "\nPRODUCER:W W\n";
+}
+
+static string longRules()
+{
+    string rules = "L:";
+    for( size_t i = 0; i < LONG_TERMINALS; ++i )
+    {
+        if( i )
+            rules += ",";
+        rules += "'" + string( LONG_TERMINAL_LENGTH - 1, (char)( 'a' + i % 26 ) ) + (char)( 'A' + i / 26 ) + "'";
+    }
+    return rules + "\nPRODUCER:L L L L\n";
+}
+
+//generates into a buffer that is thrown away, in the calling process
+static Measure runNull( const string& rulesFile, uint64_t maxWords )
+{
+    Measure m;
+    memset( &m, 0, sizeof( m ) );
+    Generator generator;
+    double start = now();
+    if( !generator.openRules( rulesFile.c_str() ) )
+    {
+        fprintf( stderr, "error:%s\n", generator.errorMessage().c_str() );
+        return m;
+    }
+    m.parseSeconds = now() - start;
+    m.keyspace = generator.words();
+
+    static const size_t BATCH_WORDS = 64*1024;
+    vector< char > buffer( max( (size_t)4*1024*1024, generator.maxLength() ) );
+    vector< size_t > offsets( BATCH_WORDS + 1 );
+    start = now();
+    while( m.words < maxWords )
+    {
+        size_t count = generator.next( buffer.data(), buffer.size(), offsets.data(),
+            (size_t)min( (uint64_t)BATCH_WORDS, maxWords - m.words ) );
+        if( count == 0 )
+            break;
+        m.words += count;
+        m.bytes += offsets[ count ] + count;
+    }
+    m.seconds = now() - start;
+    m.ok = true;
+    return m;
+}
+
+//runs runNull in a child process and takes its peak RSS
+static Measure measureNull( const string& rulesFile, uint64_t maxWords )
+{
+    Measure m;
+    memset( &m, 0, sizeof( m ) );
+    int fds[2];
+    if( pipe( fds ) != 0 )
+        return m;
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        close( fds[0] );
+        Measure result = runNull( rulesFile, maxWords );
+        ssize_t written = write( fds[1], &result, sizeof( result ) );
+        _exit( written == (ssize_t)sizeof( result ) ? 0 : 1 );
+    }
+    close( fds[1] );
+    bool received = ( pid > 0 && read( fds[0], &m, sizeof( m ) ) == (ssize_t)sizeof( m ) );
+    close( fds[0] );
+    int status = 0;
+    struct rusage usage;
+    if( pid < 0 || wait4( pid, &status, 0, &usage ) != pid || !received || !WIFEXITED( status ) ||
+        WEXITSTATUS( status ) != 0 )
+    {
+        m.ok = false;
+        return m;
+    }
+    m.peakRssKb = usage.ru_maxrss;
+    return m;
+}
+
+//runs the command line tool writing the first words into a file
+static Measure measureOutput( const string& crunchx, const string& rulesFile, const string& outputFile, uint64_t words )
+{
+    Measure m;
+    memset( &m, 0, sizeof( m ) );
+    char end[32];
+    snprintf( end, sizeof( end ), "%llu", (unsigned long long)words );
+    double start = now();
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        int null = open( "/dev/null", O_WRONLY );
+        if( null >= 0 )
+        {
+            dup2( null, STDOUT_FILENO );
+            dup2( null, STDERR_FILENO );
+        }
+        execl( crunchx.c_str(), crunchx.c_str(), "-f", rulesFile.c_str(), "--end", end,
+            "-o", outputFile.c_str(), (char*)NULL );
+        _exit( 127 );
+    }
+    int status = 0;
+    struct rusage usage;
+    if( pid < 0 || wait4( pid, &status, 0, &usage ) != pid || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+    {
+        unlink( outputFile.c_str() );
+        return m;
+    }
+    m.seconds = now() - start;
+    m.peakRssKb = usage.ru_maxrss;
+    struct stat st;
+    if( stat( outputFile.c_str(), &st ) == 0 )
+        m.bytes = st.st_size;
+    unlink( outputFile.c_str() );
+    m.words = words;
+    m.ok = true;
+    return m;
+}
+
+static void printMeasure( FILE* out, const char* name, const Measure& m )
+{
+    if( !m.ok )
+    {
+        fprintf( out, "      \"%s\": null", name );
+        return;
+    }
+    double seconds = max( m.seconds, 1e-9 );
+    fprintf( out, "      \"%s\": {\"words\": %llu, \"bytes\": %llu, \"seconds\": %.6f, "
+        "\"words_per_second\": %.0f, \"bytes_per_second\": %.0f, \"peak_rss_kb\": %ld}",
+        name, (unsigned long long)m.words, (unsigned long long)m.bytes, m.seconds,
+        m.words / seconds, m.bytes / seconds, m.peakRssKb );
+}
+
+//keeps the faster of two measurements
+static void keepFastest( Measure& best, const Measure& m )
+{
+    if( m.ok && ( !best.ok || m.seconds < best.seconds ) )
+        best = m;
+}
+
+int main( int argc, const char* argv[] )
+{
+    string crunchx = "./crunchx";
+    const char* exampleFile = "../examples/crunchx.rul";
+    string dir = "/tmp";
+    const char* outputFile = NULL;
+    const char* only = NULL;
+    double scale = 1;
+    int repeat = 1;
+    for( int i = 1; i < argc; ++i )
+    {
+        const char* value = ( i + 1 < argc ) ? argv[ i + 1 ] : NULL;
+        if( strcmp( argv[i], "-h" ) == 0 )
+        {
+            printf( HELP_TXT );
+            return 0;
+        }
+        if( value == NULL )
+        {
+            fprintf( stderr, "error:invalid argument:%s\n", argv[i] );
+            return 1;
+        }
+        if( strcmp( argv[i], "-c" ) == 0 )
+            crunchx = value;
+        else if( strcmp( argv[i], "-e" ) == 0 )
+            exampleFile = value;
+        else if( strcmp( argv[i], "-d" ) == 0 )
+            dir = value;
+        else if( strcmp( argv[i], "-o" ) == 0 )
+            outputFile = value;
+        else if( strcmp( argv[i], "-k" ) == 0 )
+            only = value;
+        else if( strcmp( argv[i], "-s" ) == 0 )
+            scale = atof( value );
+        else if( strcmp( argv[i], "-r" ) == 0 )
+            repeat = atoi( value );
+        else
+        {
+            fprintf( stderr, "error:invalid argument:%s\n", argv[i] );
+            return 1;
+        }
+        ++i;
+    }
+    if( scale <= 0 || repeat <= 0 )
+    {
+        fprintf( stderr, "error:invalid scale or repeat count\n" );
+        return 1;
+    }
+    string example;
+    if( !readFile( exampleFile, example ) )
+    {
+        fprintf( stderr, "error:can not open file:%s\n", exampleFile );
+        return 1;
+    }
+
+    vector< BenchCase > cases;
+    BenchCase c;
+    c.name = "default";
+    c.rules = DEFAULT_RULES;
+    c.words = 20000000;
+    cases.push_back( c );
+    c.name = "pinyin";
+    c.rules = exampleRules( example, "PRODUCER:PINYIN PINYIN" );
+    cases.push_back( c );
+    c.name = "pinyin_birthday";
+    c.rules = exampleRules( example, "PRODUCER:PINYIN PINYIN BIRTHDAY" );
+    cases.push_back( c );
+    c.name = "deep";
+    c.rules = deepRules();
+    c.words = 100000;
+    cases.push_back( c );
+    c.name = "wide";
+    c.rules = wideRules();
+    c.words = 20000000;
+    cases.push_back( c );
+    c.name = "long_terminals";
+    c.rules = longRules();
+    c.words = 500000;
+    cases.push_back( c );
+
+    FILE* out = outputFile ? fopen( outputFile, "w" ) : stdout;
+    if( out == NULL )
+    {
+        fprintf( stderr, "error:can not open file:%s\n", outputFile );
+        return 1;
+    }
+    fprintf( out, "{\n  \"timestamp\": %lld,\n  \"cpus\": %u,\n  \"scale\": %g,\n  \"cases\": [",
+        (long long)time( NULL ), thread::hardware_concurrency(), scale );
+    bool first = true;
+    bool ok = true;
+    for( size_t i = 0; i < cases.size(); ++i )
+    {
+        const BenchCase& bench = cases[i];
+        if( only && bench.name != only )
+            continue;
+        string rulesFile = dir + "/crunchx_bench_" + bench.name + ".rul";
+        if( !writeFile( rulesFile, bench.rules ) )
+        {
+            fprintf( stderr, "error:can not write file:%s\n", rulesFile.c_str() );
+            return 1;
+        }
+        uint64_t maxWords = (uint64_t)( bench.words * scale );
+        Measure null, output;
+        memset( &null, 0, sizeof( null ) );
+        memset( &output, 0, sizeof( output ) );
+        for( int r = 0; r < repeat; ++r )
+            keepFastest( null, measureNull( rulesFile, maxWords ) );
+        //the tool generates the same words, --end needs them below 2^64
+        uint64_t words = null.ok ? min( maxWords, null.keyspace ) : 0;
+        for( int r = 0; r < repeat && null.ok && null.keyspace != Generator::WORDS_OVERFLOW; ++r )
+            keepFastest( output, measureOutput( crunchx, rulesFile, dir + "/crunchx_bench_" + bench.name + ".out", words ) );
+        unlink( rulesFile.c_str() );
+        ok = ok && null.ok && output.ok;
+        fprintf( stderr, "%s: %s\n", bench.name.c_str(), null.ok && output.ok ? "done" : "failed" );
+
+        fprintf( out, "%s\n    {\n      \"name\": \"%s\",\n      \"rules_bytes\": %llu,\n",
+            first ? "" : ",", bench.name.c_str(), (unsigned long long)bench.rules.size() );
+        if( null.ok )
+            fprintf( out, "      \"parse_seconds\": %.6f,\n", null.parseSeconds );
+        else
+            fprintf( out, "      \"parse_seconds\": null,\n" );
+        printMeasure( out, "null_sink", null );
+        fprintf( out, ",\n" );
+        printMeasure( out, "output", output );
+        fprintf( out, "\n    }" );
+        first = false;
+    }
+    fprintf( out, "\n  ]\n}\n" );
+    if( outputFile )
+        fclose( out );
+    return ok ? 0 : 1;
+}
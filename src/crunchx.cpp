@@ -9,15 +9,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <signal.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <map>
+#include <unordered_set>
+#include <unordered_map>
 #include <list>
+#include <vector>
 #include <string>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <system_error>
+#include <new>
+
+#include "crunchx.h"
 using namespace std;
 
-static const int    MAX_FILE_SIZE               = 1024*1024*2; //2M
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static bool syncFile( int fd )
+{
+#ifdef _WIN32
+    return _commit( fd ) == 0;
+#else
+    return fsync( fd ) == 0 || errno == EINVAL; //pipes and terminals can not be synced
+#endif
+}
+
+static inline uint64_t monotonicNanos()
+{
+    return (uint64_t)chrono::duration_cast< chrono::nanoseconds >( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
 static const char   DEFAULT_RULES_FILE_NAME[]   = "crunchx.rul";
 static const char   DEFAULT_RULES[]             = "NUM:'0','1','2','3','4','5','6','7','8','9'\n"
 "LITER_LOWER:'a','b','c','d','e','f','g','h','i','j','k','l','m','n','o','p','q','r','s','t','u','v','w','x','y','z'\n"
@@ -33,7 +79,98 @@ static const char HELP_TXT[] = "Crunchx version 1.0\n"
 "options:\n"
 "-h         show this help text\n"
 "-l         create default rule file, named \"crunchx.rul\"\n"
-"-f file    use the specified rule file,if not specified will use default rule file:\"crunchx.rul\"\n";
+"-f file    use the specified rule file,if not specified will use default rule file:\"crunchx.rul\"\n"
+"-r         generate with the reference producer tree instead of the compiled plan(slow),\n"
+"           from the rules as they are written, not optimized, at most 10000 producers deep\n"
+"-o file    write the wordlist to the specified file instead of stdout\n"
+"-z         terminate every word with NUL instead of newline\n"
+"-t count   generate with the specified count of threads, at most 4 per core, not with -r\n"
+"-u         with -t, write the words of every thread as soon as they are ready, not in order\n"
+"--count    print the number of words and bytes the rules produce without generating them\n"
+"--start N  begin with the word number N, words are numbered from 0\n"
+"--end M    stop before the word number M\n"
+"--start-word word\n"
+"           begin with the first occurrence of the specified word\n"
+"--checkpoint file\n"
+"           save the position of the run to the specified file from time to time\n"
+"--checkpoint-words N\n"
+"           save a checkpoint every N words\n"
+"--checkpoint-seconds S\n"
+"           save a checkpoint every S seconds, 60 by default\n"
+"--resume file\n"
+"           continue the run saved in the specified checkpoint file, with the same --format and -z\n"
+"--shard i/N\n"
+"           generate only the i-th of N disjoint slices of the words, i from 1 to N\n"
+"--shard-weights w1,w2,...\n"
+"           with --shard, size the N slices in proportion to the specified weights\n"
+"--materialize N\n"
+"           render sub-producers of at most N bytes of words into one table, 262144 by default\n"
+"--ambiguity\n"
+"           print the producers that can produce a word more than once and the rules they repeat\n"
+"--dedup    produce every word only once, --count and the word numbers may still count some of\n"
+"           the removed duplicates\n"
+"--min-len N\n"
+"           generate only the words of at least N bytes\n"
+"--max-len M\n"
+"           generate only the words of at most M bytes. the word numbers still count the\n"
+"           words out of the range, --count prints how many are in it\n"
+"--policy clauses\n"
+"           generate only the words satisfying all the clauses, separated by ',':\n"
+"           require=digit+upper+lower+symbol  contain a character of every class listed\n"
+"           max-repeat=N  no character more than N times in a row\n"
+"           exclude=TEXT  not contain TEXT, can be given more than once\n"
+"           e.g. --policy require=digit+upper,max-repeat=2,exclude=123. the word numbers\n"
+"           still count the other words and --count does not apply the policy\n"
+"--shuffle seed\n"
+"           generate all the words in a random order given by the seed, every word once\n"
+"--sample K\n"
+"           generate K words picked at random without repeating one, with the seed of --shuffle\n"
+"--format text|blocks\n"
+"           blocks writes a compact file, every word coded against the word before, with an\n"
+"           index of its blocks. text by default\n"
+"--decode file\n"
+"           write the words of a compact file as text, --start and --end select a part of it.\n"
+"           the file is read from its start to its end, so it can be a pipe, and a file cut\n"
+"           short or damaged is an error after the words before the damage\n"
+"--splice   when the output is a pipe, hand the filled buffers to it with vmsplice instead\n"
+"           of copying them\n"
+"--shm name\n"
+"           write the words into a ring buffer in the shared memory of the specified name\n"
+"           for a local reader, the layout is RingHeader in crunchx.h. the reader removes it\n"
+"           with shm_unlink when it read all the words\n"
+"--likely   generate the words from the most likely one down by the rule weights, a rule\n"
+"           ending with @0.7 weighs 0.7 and 1 without. can not be used with -r, -t, --dedup,\n"
+"           --start, --end, --shuffle, --sample, --shard or checkpoints. the rules may nest\n"
+"           at most 10000 levels deep, after the optimizer\n"
+"--min-prob P\n"
+"           with --likely, stop at the words less likely than P\n"
+"--likely-limit N\n"
+"           with --likely, keep at most N candidate words in memory, 8388608 by default. at\n"
+"           the limit the less likely ones are dropped and the output stops where words could\n"
+"           be missing, with a note on stderr\n"
+"--progress S\n"
+"           print the words, bytes, speed, percent done and time left on stderr every S seconds.\n"
+"           the signal SIGUSR1 prints all the figures at any time, with or without it\n"
+"--summary file\n"
+"           write the figures of the run to the specified file as JSON when it ends: words,\n"
+"           bytes, seconds, speeds, seconds blocked on the output, the range and if it completed\n"
+"--emit-cpp file\n"
+"           write a C++ program generating the words of the rules to the specified file instead,\n"
+"           the rules become nested loops over constant tables. build it as its first lines tell,\n"
+"           it writes all the words in order to stdout, terminated like -z says\n"
+"--dump-rules\n"
+"           print the rules the way they are generated: producers of a single rule or making\n"
+"           up a whole rule are inlined unless --materialize renders them into a table,\n"
+"           adjacent terminals are joined and the tokens all the rules of a producer start\n"
+"           with are taken out of them\n"
+"--hash md5|sha1|ntlm\n"
+"           hash the words instead of writing them and print the ones whose digest is in the\n"
+"           --targets file as digest:word, terminated like -z says. with -t the threads hash\n"
+"           chunks of the words, the run stops when all the targets are found and the words,\n"
+"           speed and targets found are printed on stderr. ntlm is md4 of the word in utf-16le\n"
+"--targets file\n"
+"           with --hash, the digests to look for in hex, one a line. text after a blank or ':'\n"
+"           is ignored, so are empty lines and lines starting with '#'\n";
 
 static void printTab( int count )
 {
@@ -41,6 +178,7 @@ static void printTab( int count )
         printf( " " );
 }
 
+//the last error of a Crunchx, every instance has its own
 class ErrorMan{
 public:
     enum ErrorCode{ eOk, eCanNotOpenFile, eFileToLarge, eInvalidParam, eReadFileErr, eWriteFileErr, eInvalidRules, eNosuchProducer, eInvalidGrammar, eMisc };
@@ -49,228 +187,358 @@ public:
         m_code = 0;
     }
 
-    static void setError( int errCode, const string& errMesg )
+    void setError( int errCode, const string& errMesg )
     {
-        sm_errorMan.m_code = errCode;
-        sm_errorMan.m_mesg = errMesg;
+        m_code = errCode;
+        m_mesg = errMesg;
     }
 
-    static bool isErrorOccured()
+    bool isErrorOccured() const
     {
-        return ( sm_errorMan.m_code != 0 );
+        return ( m_code != 0 );
     }
 
-    static const string& errorMessage()
+    const string& errorMessage() const
     {
-        return sm_errorMan.m_mesg;
+        return m_mesg;
     }
 
-    static int errorCode()
+    int errorCode() const
     {
-        return sm_errorMan.m_code;
+        return m_code;
     }
 
 protected:
     int     m_code;
     string  m_mesg;
-    static  ErrorMan sm_errorMan;
 };
 
-class Producer;
-class Token{
+//a file mapped read only into memory, read into a buffer where mapping is not available
+class MappedFile{
 public:
-    enum Type{ eConfused, eTerminater, eProductor };
-    Token( const string& txt, Type type ) : m_token( txt ), m_type( type ), m_producer( NULL )
-    {
-    }
-    Token( Producer* producer )
+    MappedFile() : m_data( NULL ), m_size( 0 ), m_mapped( NULL )
     {
-        setProducer( producer );
     }
-    ~Token()
-    {
 
+    ~MappedFile()
+    {
+        close();
     }
 
-    string token()
+    ErrorMan::ErrorCode open( const char* fileName )
     {
-        return m_token;
+        close();
+#ifdef _WIN32
+        FILE* file = fopen( fileName, "rb" );
+        if( file == NULL )
+            return ErrorMan::eCanNotOpenFile;
+        ErrorMan::ErrorCode err = ErrorMan::eOk;
+        char buff[ 64 * 1024 ];
+        size_t readSize;
+        while( ( readSize = fread( buff, 1, sizeof( buff ), file ) ) > 0 )
+            m_buffer.append( buff, readSize );
+        if( ferror( file ) )
+            err = ErrorMan::eReadFileErr;
+        fclose( file );
+        if( err != ErrorMan::eOk )
+        {
+            m_buffer.clear();
+            return err;
+        }
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#else
+        int fd = ::open( fileName, O_RDONLY );
+        if( fd < 0 )
+            return ErrorMan::eCanNotOpenFile;
+        struct stat st;
+        if( fstat( fd, &st ) != 0 )
+        {
+            ::close( fd );
+            return ErrorMan::eReadFileErr;
+        }
+        m_data = m_buffer.data();
+        if( st.st_size > 0 )
+        {
+            void* mapped = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( mapped == MAP_FAILED )
+            {
+                ::close( fd );
+                return ErrorMan::eReadFileErr;
+            }
+            madvise( mapped, (size_t)st.st_size, MADV_SEQUENTIAL );
+            m_mapped = mapped;
+            m_data = (const char*)mapped;
+            m_size = (size_t)st.st_size;
+        }
+        ::close( fd );
+#endif
+        return ErrorMan::eOk;
     }
 
-    Type type()
+    void close()
     {
-        return m_type;
+#ifndef _WIN32
+        if( m_mapped )
+            munmap( m_mapped, m_size );
+#endif
+        m_mapped = NULL;
+        m_buffer.clear();
+        m_data = m_buffer.data();
+        m_size = 0;
     }
 
-    void setType( Type t )
+    inline const char* data() const
     {
-        m_type = t;
+        return m_data;
     }
 
-    Producer* producer()
+    inline size_t size() const
     {
-        return m_producer;
+        return m_size;
     }
-    void setProducer( Producer* p );
 
 protected:
-    string	m_token;
-    Type    m_type;
-    Producer* m_producer;
+    const char* m_data;
+    size_t      m_size;
+    void*       m_mapped;
+    string      m_buffer;
+private:
+    MappedFile( const MappedFile& );
+    MappedFile& operator = ( const MappedFile& );
 };
 
-class ProductRule{
+class Producer;
+//an item of a rule: a terminal or a producer. a terminal is an offset into the
+//text arena of its grammar while the rules are parsed, bind turns it into a
+//pointer once the arena does not grow any more
+class Token{
 public:
-    typedef list<Token> Items;
-    ProductRule()
+    enum Type{ eTerminater, eProductor };
+    Token( size_t offset, uint32_t length ) : m_type( eTerminater ), m_length( length )
+    {
+        m_offset = offset;
+    }
+    Token( Producer* producer ) : m_type( eProductor ), m_length( 0 )
     {
+        m_producer = producer;
     }
 
-    ProductRule( const ProductRule& p )
+    //the terminal text or the producer name
+    string token() const;
+
+    inline const char* data() const
     {
-        Items::const_iterator iter;
-        for( iter = p.m_items.begin(); iter != p.m_items.end(); ++iter )
-            addToken( *iter );
+        return m_text;
     }
 
-    const ProductRule& operator = ( const ProductRule& p )
+    //where the text of a terminal starts in the arena, until bind
+    inline size_t offset() const
     {
-        Items::const_iterator iter;
-        for( iter = p.m_items.begin(); iter != p.m_items.end(); ++iter )
-            addToken( *iter );
-        return *this;
+        return m_offset;
+    }
+
+    inline void bind( const char* arena )
+    {
+        if( m_type == eTerminater )
+            m_text = arena + m_offset;
+    }
+
+    inline size_t length() const
+    {
+        return m_length;
+    }
+
+    Type type() const
+    {
+        return m_type;
+    }
+
+    Producer* producer() const
+    {
+        return ( m_type == eProductor ) ? m_producer : NULL;
     }
 
-    ~ProductRule()
+protected:
+    Type        m_type;
+    uint32_t    m_length;
+    union{
+        size_t      m_offset;
+        const char* m_text;
+        Producer*   m_producer;
+    };
+};
+
+//the items of one rule, a view into the tokens of its producer
+class ProductRule{
+public:
+    ProductRule( const Token* begin, const Token* end ) : m_begin( begin ), m_end( end )
     {
     }
 
-    inline void reset()
+    inline const Token* begin() const
     {
-        m_items.clear();
+        return m_begin;
     }
 
-    inline void addToken( const Token& t )
+    inline const Token* end() const
     {
-        m_items.push_back( t );
+        return m_end;
     }
 
-    inline bool isValid() const
+    inline size_t size() const
     {
-        return ( m_items.size() != 0 );
+        return m_end - m_begin;
     }
 
-    inline Items& items()
+    inline const Token& front() const
     {
-        return m_items;
+        return *m_begin;
     }
 
 protected:
-    Items   m_items;
+    const Token*    m_begin;
+    const Token*    m_end;
 };
 
+//the tokens of all the rules of a producer are kept in one array.
+//a word file producer has no rules, its words are the lines of a mapped file
 class Producer{
 public:
-    typedef list<ProductRule> Rules;
-    Producer()
+    Producer() : m_words( NULL ), m_wordsSize( 0 ), m_wordCount( 0 ), m_defined( false )
     {
-        m_isConfused = true;
     }
 
-    Rules& rules()
+    void setWords( const char* words, size_t size, uint64_t count )
     {
-        return m_rules;
+        m_words = words;
+        m_wordsSize = size;
+        m_wordCount = count;
+        m_defined = true;
     }
 
-    inline void addRule( const ProductRule& rule )
+    inline bool isWordFile() const
     {
-        m_rules.push_back( rule );
+        return m_words != NULL;
     }
 
-    const string& name() const
+    inline uint64_t wordCount() const
     {
-        return m_name;
+        return m_wordCount;
     }
 
-    void setName( const string& name )
+    //bytes of the word file, line breaks included
+    inline size_t wordsSize() const
     {
-        m_name = name;
+        return m_wordsSize;
     }
 
-    bool isConfused()
+    //the word of the next non-empty line from pos on, without its line break.
+    //false when there is none
+    inline bool nextWord( size_t& pos, const char*& word, size_t& length ) const
     {
-        return m_isConfused;
+        return nextLine( m_words, m_wordsSize, pos, word, length );
     }
 
-    bool confusedProductors( list<Producer*>& confusedList )
+    static inline bool nextLine( const char* text, size_t size, size_t& pos, const char*& word, size_t& length )
     {
-        Rules::iterator ruleIter = m_rules.begin();
-        for ( ; ruleIter != m_rules.end(); ++ruleIter )
+        while( pos < size )
         {
-            ProductRule& rule = *ruleIter;
-            ProductRule::Items::iterator itemIter = rule.items().begin();
-            for ( ; itemIter != rule.items().end(); ++itemIter )
+            const char* line = text + pos;
+            const char* end = (const char*)memchr( line, '\n', size - pos );
+            if( end == NULL )
+                end = text + size;
+            pos = end - text + 1;
+            if( end > line && end[-1] == '\r' )
+                --end;
+            if( end > line )
             {
-                Token& token = *itemIter;
-                if( !confirmType( token, confusedList ) )
-                    return false;
+                word = line;
+                length = end - line;
+                return true;
             }
         }
-        if( confusedList.empty() )
-            m_isConfused = false;
-        else
-            confusedList.unique();
-        return true;
+        return false;
     }
 
-    static inline void updateProductorMap( const string& name, const ProductRule& rule )
+    inline size_t ruleCount() const
     {
-        ProductorMap::iterator iter = m_mapProducer.find( name );
-        if( iter != m_mapProducer.end() )
-        {
-            iter->second.addRule( rule );
-        }else
-        {
-            m_mapProducer[ name ].setName( name );
-            m_mapProducer[ name ].addRule( rule );
-        }
+        return m_ruleBegin.size();
     }
 
-protected:
-    bool confirmType( Token& t, list<Producer*>& confusedList )
+    inline ProductRule rule( size_t index ) const
     {
-        if( t.type() == Token::eTerminater )
-            return true;
-        if( t.type() == Token::eConfused ) //eConfused must be eProductor
+        size_t end = ( index + 1 < m_ruleBegin.size() ) ? m_ruleBegin[ index + 1 ] : m_tokens.size();
+        return ProductRule( m_tokens.data() + m_ruleBegin[ index ], m_tokens.data() + end );
+    }
+
+    //weight: the relative likelihood of the rule among the rules of the producer
+    inline void addRule( const vector< Token >& tokens, double weight = 1.0 )
+    {
+        //most rules have no weight, the weights are only stored once one has
+        if( weight != 1.0 || !m_weights.empty() )
         {
-            ProductorMap::iterator producerIter = m_mapProducer.find( t.token() );
-            if( producerIter == m_mapProducer.end() )
-            {
-                string err = "can not found producer:" + t.token();
-                ErrorMan::setError( ErrorMan::eNosuchProducer, err );
-                //t.setType( Token::eTerminater );
-                return false;
-            }else
-            {
-                Producer* producer = &( producerIter->second );
-                t.setProducer( producer );
-                if( producer->isConfused() )
-                {
-                    if( find( confusedList.begin(), confusedList.end(), producer ) == confusedList.end() )
-                        confusedList.push_back( producer );
-                }
-            }
+            m_weights.resize( m_ruleBegin.size(), 1.0 );
+            m_weights.push_back( weight );
         }
-        return true;
+        m_ruleBegin.push_back( (uint32_t)m_tokens.size() );
+        m_tokens.insert( m_tokens.end(), tokens.begin(), tokens.end() );
+        m_defined = true;
+    }
+
+    inline double ruleWeight( size_t index ) const
+    {
+        return m_weights.empty() ? 1.0 : m_weights[ index ];
+    }
+
+    //some rules weigh more than others
+    inline bool hasWeights() const
+    {
+        return !m_weights.empty();
+    }
+
+    //drops the rules, for rewriting them with addRule
+    void clearRules()
+    {
+        m_tokens.clear();
+        m_ruleBegin.clear();
+        m_weights.clear();
+    }
+
+    const string& name() const
+    {
+        return m_name;
+    }
+
+    void setName( const string& name )
+    {
+        m_name = name;
+    }
+
+    //false for a producer that is referenced but has no rules
+    bool isDefined() const
+    {
+        return m_defined;
+    }
+
+    //points the terminals of the rules to their text
+    void bind( const char* arena )
+    {
+        for( size_t i = 0; i < m_tokens.size(); ++i )
+            m_tokens[i].bind( arena );
     }
 
 protected:
-    string          m_name;
-    Rules           m_rules;
-    bool            m_isConfused;
+    string              m_name;
+    vector< Token >     m_tokens;
+    vector< uint32_t >  m_ruleBegin;
+    vector< double >    m_weights;      //of every rule, empty when all of them are 1
+    const char*         m_words;        //the text of a word file
+    size_t              m_wordsSize;
+    uint64_t            m_wordCount;
+    bool                m_defined;
 public:
-    typedef map< string, Producer> ProductorMap;
-    static ProductorMap m_mapProducer;
+    typedef unordered_map< string, Producer > ProductorMap;
 };
 
 
@@ -278,14 +546,14 @@ class ProducerReference;
 class TokenReference
 {
 public:
-    TokenReference( Token* token );
+    TokenReference( const Token* token );
     ~TokenReference();
 
     ProducerReference* producerReference()
     {
         return m_producer;
     }
-    Token* token()
+    const Token* token()
     {
         return m_token;
     }
@@ -295,19 +563,17 @@ public:
     void makeNextProduct();
 protected:
     bool                m_atEnd;
-    Token*              m_token;
+    const Token*        m_token;
     ProducerReference*  m_producer;
 };
 
 class RuleReference{
 public:
-    RuleReference( ProductRule* rule )
+    RuleReference( const ProductRule& rule ) : m_rule( rule )
     {
-        m_rule = rule;
-        ProductRule::Items::iterator iter = rule->items().begin();
-        for( ; iter != rule->items().end(); ++iter )
+        for( const Token* token = rule.begin(); token != rule.end(); ++token )
         {
-            TokenReference* ref = new TokenReference( &(*iter) );
+            TokenReference* ref = new TokenReference( token );
             m_tokens.push_back( ref );
         }
         m_atEnd = false;
@@ -367,7 +633,7 @@ public:
     }
     void trace( int deep );
 protected:
-    ProductRule*  m_rule;
+    ProductRule   m_rule;
     list<TokenReference*> m_tokens;
     bool m_atEnd;
 };
@@ -378,13 +644,13 @@ public:
     {
         assert( producer != NULL );
         m_producer = producer;
-        Producer::Rules::iterator iter = producer->rules().begin();
-        for ( ;iter != producer->rules().end(); ++iter )
+        for( size_t i = 0; i < producer->ruleCount(); ++i )
         {
-            RuleReference* ref = new RuleReference( &( *iter ) );
+            RuleReference* ref = new RuleReference( producer->rule( i ) );
             m_rules.push_back( ref );
         }
         m_iter = m_rules.begin();
+        resetWord();
     }
 
     ~ProducerReference()
@@ -396,6 +662,8 @@ public:
 
     inline bool atEnd()
     {
+        if( m_producer->isWordFile() )
+            return m_wordEnd;
         return ( m_iter == m_rules.end() );
     }
 
@@ -406,6 +674,11 @@ public:
 
     bool product( string & result )
     {
+        if( m_producer->isWordFile() )
+        {
+            result.append( m_word, m_wordLength );
+            return true;
+        }
         RuleReference* rule = *m_iter;
         return rule->product( result );
     }
@@ -415,6 +688,11 @@ public:
         if( atEnd() )
             return;
 
+        if( m_producer->isWordFile() )
+        {
+            m_wordEnd = !m_producer->nextWord( m_next, m_word, m_wordLength );
+            return;
+        }
         RuleReference* rule = *m_iter;
         rule->makeNextProduct();
         if( rule->atEnd() )
@@ -430,6 +708,7 @@ public:
         list<RuleReference*>::iterator iter = m_rules.begin();
         for ( ;iter != m_rules.end(); ++iter )
             (*iter)->reset();
+        resetWord();
     }
 
     void trace( int deep )
@@ -441,9 +720,19 @@ public:
             (*iter)->trace( deep + 1 );
     }
 protected:
+    void resetWord()
+    {
+        m_next = 0;
+        m_wordEnd = !m_producer->isWordFile() || !m_producer->nextWord( m_next, m_word, m_wordLength );
+    }
+
     Producer*  m_producer;
     list<RuleReference*> m_rules;
     list<RuleReference*>::iterator m_iter;
+    size_t      m_next;     //word file: offset of the line after the current word
+    const char* m_word;
+    size_t      m_wordLength;
+    bool        m_wordEnd;
 };
 
 void RuleReference::trace( int deep )
@@ -463,7 +752,7 @@ void RuleReference::trace( int deep )
     }
 }
 
-TokenReference::TokenReference( Token* token )
+TokenReference::TokenReference( const Token* token )
 {
     m_atEnd = false;
     m_token = token;
@@ -484,7 +773,7 @@ bool TokenReference::product( string & result )
 {
     if( m_producer )
         return m_producer->product( result );
-    result += m_token->token();
+    result.append( m_token->data(), m_token->length() );
     return true;
 }
 
@@ -509,345 +798,6362 @@ void TokenReference::makeNextProduct()
     m_atEnd = true;
 }
 
-ErrorMan ErrorMan::sm_errorMan;
-Producer::ProductorMap Producer::m_mapProducer;
 
-void Token::setProducer( Producer* p )
+string Token::token() const
 {
-    m_token = p->name();
-    m_type = eProductor;
-    m_producer = p;
+    if( m_type == eProductor )
+        return m_producer->name();
+    return string( data(), length() );
 }
 
-class Crunchx{
+//a policy on the characters of a word: the classes of characters it must contain,
+//the longest run of one character it may have and the substrings it must not
+//contain. it is compiled into an automaton that reads a word from its last byte
+//backwards, the way the cursor renders it, so the state of the unchanged tail of
+//a word is kept while the leading positions change
+class Policy{
 public:
-    Crunchx() : m_rules(0),m_rulesBuffSize(0),m_rulesLength(0),m_status( eIdle ),
-        m_rulesAnalysisIndex(NULL),m_lineCount(0),m_mainProductor( NULL )
+    enum CharClass{ eDigit = 1, eUpper = 2, eLower = 4, eSymbol = 8 };
+    struct State{
+        uint32_t    match;      //node of the substring automaton
+        uint32_t    run;        //length of the run of 'last' read so far
+        uint8_t     last;
+        uint8_t     classes;    //the classes of the bytes read so far
+        bool        dead;       //no word ending like this satisfies the policy
+    };
+
+    Policy() : m_required( 0 ), m_maxRepeat( 0 )
     {
+        for( unsigned c = 0; c < 256; ++c )
+            m_classOf[c] = classOf( (unsigned char)c );
+        clear();
     }
 
-    ~Crunchx()
+    void clear()
     {
-        cleanup();
+        m_required = 0;
+        m_maxRepeat = 0;
+        m_next.assign( 256, 0 );
+        m_final.assign( 1, 0 );
     }
 
-
-    ErrorMan::ErrorCode openRulesFile( const char* fileName )
+    bool isEmpty() const
     {
-        FILE* fRules = fopen( fileName, "r" );
-        if( fRules == NULL )
-            return ErrorMan::eCanNotOpenFile;
+        return m_required == 0 && m_maxRepeat == 0 && m_final.size() == 1;
+    }
 
-        m_status = eIdle;
-        ErrorMan::ErrorCode err = ErrorMan::eOk;
-        fseek( fRules, 0, SEEK_END );
-        size_t size = ftell( fRules );
-        if( size <= MAX_FILE_SIZE )
+    //parses clauses separated by ',': require=CLASS+CLASS... with the classes digit,
+    //upper, lower and symbol, max-repeat=N and exclude=TEXT, which can be repeated.
+    //false with 'error' set when the specification is invalid
+    bool parse( const char* spec, string& error )
+    {
+        clear();
+        vector< string > excluded;
+        const char* clause = spec;
+        while( *clause )
         {
-            if( size > m_rulesBuffSize )
+            const char* end = strchr( clause, ',' );
+            if( end == NULL )
+                end = clause + strlen( clause );
+            string text( clause, end );
+            clause = *end ? end + 1 : end;
+            size_t equal = text.find( '=' );
+            string name = text.substr( 0, equal );
+            string value = ( equal == string::npos ) ? string() : text.substr( equal + 1 );
+            if( equal == string::npos || value.empty() )
             {
-                delete[] m_rules;
-                m_rulesBuffSize = size + 1;
-                m_rules = new char[ m_rulesBuffSize ];
+                error = "invalid policy clause:" + text;
+                return false;
             }
-            fseek( fRules, 0, SEEK_SET );
-            size_t readSize = fread( m_rules, 1, size, fRules );
-            if( readSize > size )
+            if( name == "require" )
             {
-                m_rulesLength = 0;
-                err = ErrorMan::eReadFileErr;
-            }else
+                size_t begin = 0;
+                while( begin <= value.size() )
+                {
+                    size_t plus = value.find( '+', begin );
+                    if( plus == string::npos )
+                        plus = value.size();
+                    string cls = value.substr( begin, plus - begin );
+                    if( cls == "digit" )
+                        m_required |= eDigit;
+                    else if( cls == "upper" )
+                        m_required |= eUpper;
+                    else if( cls == "lower" )
+                        m_required |= eLower;
+                    else if( cls == "symbol" )
+                        m_required |= eSymbol;
+                    else
+                    {
+                        error = "invalid character class:" + cls;
+                        return false;
+                    }
+                    begin = plus + 1;
+                }
+            }else if( name == "max-repeat" )
+            {
+                char* last;
+                unsigned long repeat = strtoul( value.c_str(), &last, 10 );
+                if( *last || repeat == 0 || repeat > 0xffff )
+                {
+                    error = "invalid max-repeat:" + value;
+                    return false;
+                }
+                m_maxRepeat = (uint32_t)repeat;
+            }else if( name == "exclude" )
+                excluded.push_back( value );
+            else
             {
-                m_rulesLength = readSize;
-                m_rules[ readSize ] = 0;
-                m_rulesAnalysisIndex = m_rules;
-                m_status = eBuffIsSet;
+                error = "invalid policy clause:" + text;
+                return false;
             }
-        }else
-            err = ErrorMan::eFileToLarge;
-        fclose( fRules );
-
-        return err;
+        }
+        buildAutomaton( excluded );
+        return true;
     }
 
-    ErrorMan::ErrorCode saveRulesFile( const char* fileName )
+    inline State start() const
     {
-        if( m_status == eIdle )
-            return ErrorMan::eInvalidRules;
-        FILE* fRules = fopen( fileName, "w+" );
-        if( fRules == NULL )
-            return ErrorMan::eCanNotOpenFile;
-        size_t writeCount = fwrite( m_rules, 1, m_rulesLength, fRules );
-        fclose( fRules );
-        if( writeCount == m_rulesLength )
-            return ErrorMan::eOk;
-        else
-            return ErrorMan::eWriteFileErr;
+        State s = { 0, 0, 0, 0, false };
+        return s;
     }
 
-    ErrorMan::ErrorCode setRules( const char* rules, const size_t length )
+    static inline uint8_t classOf( unsigned char c )
     {
-        if( length > MAX_FILE_SIZE )
-            return ErrorMan::eFileToLarge;
+        if( c >= '0' && c <= '9' )
+            return eDigit;
+        if( c >= 'A' && c <= 'Z' )
+            return eUpper;
+        if( c >= 'a' && c <= 'z' )
+            return eLower;
+        return eSymbol;
+    }
 
-        if( length > m_rulesBuffSize )
+    //reads text from its last byte to its first one
+    inline void read( State& state, const char* text, size_t length ) const
+    {
+        //a local copy, the stores into the tables could alias it
+        State s = state;
+        const uint32_t* next = m_next.data();
+        const uint8_t* final = m_final.data();
+        uint32_t maxRun = m_maxRepeat ? m_maxRepeat : 0xffffffff;
+        for( size_t i = length; i-- > 0 && !s.dead; )
         {
-            delete[] m_rules;
-            m_rulesBuffSize = length + 1;
-            m_rules = new char[ m_rulesBuffSize ];
+            unsigned char c = (unsigned char)text[i];
+            s.classes |= m_classOf[c];
+            s.run = ( c == s.last ) ? s.run + 1 : 1;    //run is 0 at the start
+            s.last = c;
+            s.match = next[ s.match * 256 + c ];
+            s.dead = ( s.run > maxRun ) | final[ s.match ];
         }
-        memcpy( m_rules, rules, length );
-        m_rules[ length ] = 0;
-        m_rulesAnalysisIndex = m_rules;
-        m_status = eBuffIsSet;
-        m_rulesLength = length;
-        return ErrorMan::eOk;
+        state = s;
     }
 
-    void cleanup()
+    inline bool accepts( const State& s ) const
     {
-        if( m_rules )
-            delete[] m_rules;
-        m_rules = 0;
-        m_rulesBuffSize = 0;
+        return !s.dead && ( s.classes & m_required ) == m_required;
     }
 
-    bool atEnd()
+    //false when no text read in front of this state can make it acceptable, given
+    //the classes of characters that text may have
+    inline bool canAccept( const State& s, uint8_t classes ) const
     {
-        assert( m_mainProductor != NULL );
-        return ( m_mainProductor == NULL || m_mainProductor->atEnd() );
+        return !s.dead && ( ( s.classes | classes ) & m_required ) == m_required;
     }
 
-    bool analysis()
+    static uint8_t classesOf( const char* text, size_t length )
     {
-        m_lineCount = 0;
-        while ( analysisProducer() )
-            ;
+        uint8_t classes = 0;
+        for( size_t i = 0; i < length && classes != 0x0f; ++i )
+            classes |= classOf( (unsigned char)text[i] );
+        return classes;
+    }
 
-        if( ErrorMan::isErrorOccured() )
-            return false;
+protected:
+    //an Aho-Corasick automaton of the reversed excluded substrings with a complete
+    //transition table, a final node has one of them as a suffix of the text read
+    void buildAutomaton( const vector< string >& excluded )
+    {
+        m_next.assign( 256, 0 );
+        m_final.assign( 1, 0 );
+        vector< uint32_t > link( 1, 0 );
+        //the trie, 0 is the root and no other node has an edge to it
+        for( size_t i = 0; i < excluded.size(); ++i )
+        {
+            uint32_t node = 0;
+            for( size_t j = excluded[i].size(); j-- > 0; )
+            {
+                unsigned char c = (unsigned char)excluded[i][j];
+                if( m_next[ node * 256 + c ] == 0 )
+                {
+                    m_next[ node * 256 + c ] = (uint32_t)m_final.size();
+                    m_next.resize( m_next.size() + 256, 0 );
+                    m_final.push_back( 0 );
+                    link.push_back( 0 );
+                }
+                node = m_next[ node * 256 + c ];
+            }
+            m_final[ node ] = 1;
+        }
+        //breadth first, the missing edges follow the suffix links
+        vector< uint32_t > queue;
+        for( unsigned c = 0; c < 256; ++c )
+        {
+            if( m_next[c] )
+                queue.push_back( m_next[c] );
+        }
+        for( size_t head = 0; head < queue.size(); ++head )
+        {
+            uint32_t node = queue[ head ];
+            m_final[ node ] |= m_final[ link[ node ] ];
+            for( unsigned c = 0; c < 256; ++c )
+            {
+                uint32_t& target = m_next[ node * 256 + c ];
+                uint32_t fallback = m_next[ link[ node ] * 256 + c ];
+                if( target )
+                {
+                    link[ target ] = fallback;
+                    queue.push_back( target );
+                }else
+                    target = fallback;
+            }
+        }
+    }
 
-        return analysisDependence();
+protected:
+    uint8_t             m_required;
+    uint32_t            m_maxRepeat;    //0: no limit
+    uint8_t             m_classOf[256];
+    vector< uint32_t >  m_next;         //node * 256 + byte -> node
+    vector< uint8_t >   m_final;
+};
+
+//a compiled enumeration plan: the producer graph lowered into flat arrays.
+//every producer becomes one node, terminals point into the arena of the parser,
+//a mapped word file or a table rendered at build time, and shared sub-producers
+//are lowered only once
+class Plan{
+public:
+    enum NodeType{ eLeaf, eSequence, eAlternation };
+    struct Node{
+        NodeType    type;
+        uint32_t    first;  //eLeaf: first terminal, otherwise: first entry in m_children
+        uint32_t    count;  //number of terminals or children
+        size_t      minLength;
+        size_t      maxLength;
+        uint64_t    words;  //size of the keyspace, WORDS_OVERFLOW when it does not fit
+        uint64_t    bytes;  //length of all the words together, saturated like words
+        bool        deduplicate;    //the cursor skips the words this node produced before
+    };
+    static const uint64_t WORDS_OVERFLOW = 0xffffffffffffffffULL;
+    static const size_t DEFAULT_MATERIALIZE_BYTES = 256*1024; //256K
+    static const uint64_t AMBIGUITY_EXPAND_WORDS = 1024*256;  //256K
+
+    enum AmbiguityMode{ eAmbiguityIgnore, eAmbiguityReport, eAmbiguityRemove };
+    //what the ambiguity analysis found out about one producer
+    struct Ambiguity{
+        string          producer;
+        uint64_t        words;
+        bool            expanded;   //small enough to be checked word by word
+        uint64_t        duplicates; //when expanded
+        bool            unique;     //proven to produce every word once
+        bool            removed;    //rewritten into a duplicate free table
+        bool            runtime;    //duplicates are skipped while generating
+        list< string >  overlaps;   //alternatives producing the same words
+    };
+
+    struct Term{
+        const char* data;
+        uint32_t    length;
+    };
+    typedef vector< Term > Terms;
+
+    Plan() : m_root( 0 ), m_materializeBytes( DEFAULT_MATERIALIZE_BYTES ), m_ambiguityMode( eAmbiguityIgnore ),
+        m_minWordLength( 0 ), m_maxWordLength( (size_t)-1 ), m_probabilities( false ), m_rankedTerms( 0 )
+    {
     }
 
-    void makeNextProduct()
+    //keep the probability of every terminal and alternative, from the rule weights.
+    //set it before build
+    void setProbabilities( bool probabilities )
     {
-        if( atEnd() )
-            return;
-        return m_mainProductor->makeNextProduct();
+        m_probabilities = probabilities;
     }
 
-    bool product( string& str )
+    inline bool hasProbabilities() const
     {
-        if( atEnd() )
-            return false;
-        str.clear();
-        return m_mainProductor->product( str );
+        return m_probabilities;
     }
 
-protected:
-    void cutLine( char* line )
+    //natural logarithm of the probability of a terminal among the terminals of its leaf
+    inline double terminalLogProb( uint32_t index ) const
     {
-        while( *line != '\0' )
-        {
-            char c = *line;
-            if( c == '\r' || c == '\n' )
-            {
-                *line = '\0';
-                return;
-            }
-            ++line;
-        }
+        return m_termLogProb[ index ];
     }
 
-    bool analysisProducer()
+    //natural logarithm of the probability of a child of an alternation, 0 in a sequence
+    inline double childLogProb( const Node& n, uint32_t index ) const
     {
-        string name;
-        if( ErrorMan::isErrorOccured() ||
-            m_rulesAnalysisIndex == NULL || m_rulesAnalysisIndex >= m_rules + m_rulesLength )
-        {
+        return m_childLogProb[ n.first + index ];
+    }
 
-            return false;
-        }
+    inline uint32_t nodeCount() const
+    {
+        return (uint32_t)m_nodes.size();
+    }
 
-        ++m_lineCount;
-        bool invalidGrammar = false;
-        ProductRule rule;
-        Token::Type tokenType = Token::eConfused;
-        char* beginLine = m_rulesAnalysisIndex;
-        string element;
-        char c;
-        char pair = 0;
-        enum ReadStatus{ eReadName, eReadElement, eReadStringPair, eReadEndElement };
-        ReadStatus s = eReadName;
-        while( ( c = *( m_rulesAnalysisIndex++ ) ) != 0 && c != '\n')
-        {
-            if( c == '\r' || c == '\t' )
-                continue;
-            bool processRule = false;
-            if( eReadName == s )
-            {
-                if( c == ':' )
-                {
-                    s = eReadElement;
-                }else if( c == '#' )
-                {
-                    if( name.empty() )
-                    {
-                        while( ( c = *( m_rulesAnalysisIndex++ ) ) != 0 && c != '\n')
-                            ;//skip comment line
-                        return true;
-                    }
-                }else if( c != ' ' )
-                    name.push_back( c );
-            }else if( eReadElement == s )
-            {
-                if( c == '\'' || c == '"' )
-                {
-                    pair = c;
-                    s = eReadStringPair;
-                    tokenType = Token::eTerminater;
-                }else if( c == ',' )
-                {
-                    processRule = true;
-                }else
-                {
-                    if( element.empty() && c == ' ' )//skip space
-                        continue;
+    //the cursor skips the words shorter than minLength or longer than maxLength,
+    //the word numbers still count them
+    void setLengthRange( size_t minLength, size_t maxLength )
+    {
+        m_minWordLength = minLength;
+        m_maxWordLength = maxLength;
+    }
 
-                    if( c != ' ' )
-                    {
-                        element.push_back( c );
-                        continue;
-                    }
+    inline size_t minWordLength() const
+    {
+        return m_minWordLength;
+    }
+
+    inline size_t maxWordLength() const
+    {
+        return m_maxWordLength;
+    }
+
+    inline bool hasLengthRange() const
+    {
+        return m_minWordLength > 0 || m_maxWordLength != (size_t)-1;
+    }
+
+    //the cursor skips the words that do not satisfy the policy, the word numbers
+    //still count them. set it before build
+    void setPolicy( const Policy& policy )
+    {
+        m_policy = policy;
+    }
+
+    //NULL when no policy is set
+    inline const Policy* policy() const
+    {
+        return m_policy.isEmpty() ? NULL : &m_policy;
+    }
+
+    //the cursor skips some of the words
+    inline bool hasFilter() const
+    {
+        return hasLengthRange() || !m_policy.isEmpty();
+    }
+
+    //the character classes of Policy the words of a node can contain, with a policy only
+    inline uint8_t nodeClasses( uint32_t index ) const
+    {
+        return m_classes[ index ];
+    }
+
+    //eAmbiguityReport looks for producers that produce a word more than once,
+    //eAmbiguityRemove also makes the plan produce every word only once
+    void setAmbiguityMode( AmbiguityMode mode )
+    {
+        m_ambiguityMode = mode;
+    }
+
+    const list< Ambiguity >& ambiguities() const
+    {
+        return m_ambiguities;
+    }
+
+    //sub-producers whose words take at most this many bytes are rendered into one
+    //leaf at build time, 0 disables it
+    void setMaterializeBytes( size_t bytes )
+    {
+        m_materializeBytes = bytes;
+    }
+
+    size_t materializeBytes() const
+    {
+        return m_materializeBytes;
+    }
+
+    void clear()
+    {
+        m_nodes.clear();
+        m_children.clear();
+        m_termData.clear();
+        m_termLength.clear();
+        m_termLogProb.clear();
+        m_childLogProb.clear();
+        m_sortedTerms.clear();
+        m_rankedTerms = 0;
+        m_tables.clear();
+        m_root = 0;
+        m_unique.clear();
+        m_ambiguities.clear();
+        m_classes.clear();
+    }
+
+    //order: the producers in dependency order, the main producer last
+    void build( const vector< Producer* >& order )
+    {
+        clear();
+        map< Producer*, uint32_t > lowered;
+        for( size_t i = 0; i < order.size(); ++i )
+            m_root = lowerProducer( order[i], lowered );
+        if( !m_policy.isEmpty() )
+            computeClasses();
+    }
+
+    inline const Node& node( uint32_t index ) const
+    {
+        return m_nodes[ index ];
+    }
+
+    inline uint32_t child( const Node& n, uint32_t index ) const
+    {
+        return m_children[ n.first + index ];
+    }
+
+    inline const char* terminal( uint32_t index ) const
+    {
+        return m_termData[ index ];
+    }
+
+    inline uint32_t terminalLength( uint32_t index ) const
+    {
+        return m_termLength[ index ];
+    }
+
+    uint32_t root() const
+    {
+        return m_root;
+    }
+
+    //levels of nodes from the root down to the deepest leaf. the children of a node
+    //are added before it, so the nodes are measured in their order
+    size_t depth() const
+    {
+        vector< size_t > depths( m_nodes.size(), 1 );
+        for( uint32_t i = 0; i <= m_root && i < m_nodes.size(); ++i )
+        {
+            const Node& n = m_nodes[i];
+            if( n.type == eLeaf )
+                continue;
+            for( uint32_t c = 0; c < n.count; ++c )
+                depths[i] = max( depths[i], depths[ child( n, c ) ] + 1 );
+        }
+        return m_nodes.empty() ? 0 : depths[ m_root ];
+    }
+
+    //number of words of the main producer, WORDS_OVERFLOW when it exceeds 64 bits
+    uint64_t words() const
+    {
+        return m_nodes[ m_root ].words;
+    }
+
+    static inline uint64_t addWords( uint64_t a, uint64_t b )
+    {
+        return ( a > WORDS_OVERFLOW - b ) ? WORDS_OVERFLOW : a + b;
+    }
+
+    static inline uint64_t mulWords( uint64_t a, uint64_t b )
+    {
+        if( a == 0 || b == 0 )
+            return 0;
+        return ( a > WORDS_OVERFLOW / b ) ? WORDS_OVERFLOW : a * b;
+    }
+
+    //index of the first occurrence of a word in the keyspace, false when the rules
+    //can not produce it. the keyspace must fit 64 bits
+    bool rank( const string& word, uint64_t& index ) const
+    {
+        index = rank( m_root, word.data(), word.size() );
+        return index != WORDS_OVERFLOW;
+    }
+
+    //index of the first occurrence of a word among the words of a node, WORDS_OVERFLOW
+    //when the node can not produce it
+    uint64_t rank( uint32_t nodeIndex, const char* word, size_t length ) const
+    {
+        sortTerms();
+        RankMemo memo;
+        return rankNode( nodeIndex, word, 0, length, memo );
+    }
+
+protected:
+    struct RankKey{
+        uint32_t    node;
+        uint32_t    item;   //first item of a sequence, NONE for the whole node
+        size_t      begin;
+        size_t      end;
+        bool operator < ( const RankKey& k ) const
+        {
+            if( node != k.node )
+                return node < k.node;
+            if( item != k.item )
+                return item < k.item;
+            if( begin != k.begin )
+                return begin < k.begin;
+            return end < k.end;
+        }
+    };
+    typedef map< RankKey, uint64_t > RankMemo;
+
+    //orders the terminals of a leaf by text, then by index
+    struct TermLess{
+        const Plan* plan;
+
+        explicit TermLess( const Plan* p ) : plan( p )
+        {
+        }
+
+        bool operator()( uint32_t a, uint32_t b ) const
+        {
+            int diff = plan->compareTerminal( a, plan->terminal( b ), plan->terminalLength( b ) );
+            return diff < 0 || ( diff == 0 && a < b );
+        }
+    };
+
+    //sorts the terminals of the leaves added since the last call. only rank needs
+    //them, so runs that never rank do not pay for sorting large word files
+    void sortTerms() const
+    {
+        if( m_rankedTerms.load( memory_order_acquire ) == m_termLength.size() )
+            return;
+        lock_guard< mutex > lock( m_rankMutex );
+        size_t ranked = m_rankedTerms.load( memory_order_relaxed );
+        for( size_t i = 0; i < m_nodes.size(); ++i )
+        {
+            const Node& n = m_nodes[i];
+            if( n.type == eLeaf && n.first >= ranked && n.count > 1 )
+                sort( m_sortedTerms.begin() + n.first, m_sortedTerms.begin() + n.first + n.count, TermLess( this ) );
+        }
+        m_rankedTerms.store( m_termLength.size(), memory_order_release );
+    }
+
+    int compareTerminal( uint32_t term, const char* text, size_t length ) const
+    {
+        size_t termLength = m_termLength[ term ];
+        int diff = memcmp( terminal( term ), text, min( termLength, length ) );
+        if( diff != 0 || termLength == length )
+            return diff;
+        return termLength < length ? -1 : 1;
+    }
+
+    static const uint32_t WHOLE_NODE = 0xffffffff;
+
+    //a call of rankNode, or of the items [item, count) of a sequence, on the stack of
+    //rankNode. step tells where it continues when the call it made returns
+    struct RankFrame{
+        uint32_t    node;
+        uint32_t    item;   //WHOLE_NODE, or the first item of a sequence
+        size_t      begin;
+        size_t      end;
+        size_t      next;   //the child of an alternation, the end of the first item of a sequence
+        uint64_t    value;  //the words of the children before next, the best index of a sequence
+        uint64_t    rest;   //the index of the items after the first one
+        int         step;
+    };
+
+    static inline void pushRank( vector< RankFrame >& stack, uint32_t node, uint32_t item, size_t begin, size_t end )
+    {
+        RankFrame frame = { node, item, begin, end, 0, 0, 0, 0 };
+        stack.push_back( frame );
+    }
+
+    uint64_t rankLeaf( const Node& n, const char* word, size_t begin, size_t end ) const
+    {
+        //the first of the terminals with the same text has the smallest index
+        const uint32_t* sorted = &m_sortedTerms[ n.first ];
+        uint32_t low = 0, high = n.count;
+        while( low < high )
+        {
+            uint32_t mid = low + ( high - low ) / 2;
+            if( compareTerminal( sorted[ mid ], word + begin, end - begin ) < 0 )
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        if( low < n.count && compareTerminal( sorted[ low ], word + begin, end - begin ) == 0 )
+            return sorted[ low ] - n.first;
+        return WORDS_OVERFLOW;
+    }
 
-                    if( element.size() )
+    //the smallest index of word[begin, end) among the words of a node. the calls are
+    //kept on a stack of their own, so deep plans do not overflow the native one
+    uint64_t rankNode( uint32_t nodeIndex, const char* word, size_t begin, size_t end, RankMemo& memo ) const
+    {
+        vector< RankFrame > stack;
+        uint64_t result = WORDS_OVERFLOW;   //of the call that returned last
+        pushRank( stack, nodeIndex, WHOLE_NODE, begin, end );
+        while( !stack.empty() )
+        {
+            RankFrame& f = stack.back();
+            const Node& n = m_nodes[ f.node ];
+            if( f.item == WHOLE_NODE )
+            {
+                if( f.step == 0 )
+                {
+                    if( f.end - f.begin > n.maxLength || f.end - f.begin < n.minLength )
                     {
-                        rule.addToken( Token( element, tokenType ) );
-                        tokenType = Token::eConfused;
-                        element.clear();
+                        result = WORDS_OVERFLOW;
+                        stack.pop_back();
+                    }else if( n.type == eLeaf )
+                    {
+                        result = rankLeaf( n, word, f.begin, f.end );
+                        stack.pop_back();
+                    }else if( n.type == eSequence )
+                        f.item = 0;
+                    else if( n.count == 0 )
+                    {
+                        result = WORDS_OVERFLOW;
+                        stack.pop_back();
+                    }else
+                    {
+                        //the first alternative that matches has the smallest indexes
+                        f.step = 1;
+                        pushRank( stack, child( n, 0 ), WHOLE_NODE, f.begin, f.end );
                     }
+                    continue;
                 }
-            }else if( eReadStringPair == s )
-            {
-                if( c == pair )
+                if( result != WORDS_OVERFLOW )
                 {
-                    pair = 0;
-                    s = eReadEndElement;
-                }else
-                    element.push_back( c );
-            }else if( eReadEndElement == s )
-            {
-                if( c == ' ' )
+                    result += f.value;
+                    stack.pop_back();
                     continue;
-                if( c == ',' )
-                {
-                    processRule = true;
-                }else
+                }
+                f.value += m_nodes[ child( n, (uint32_t)f.next ) ].words;
+                if( ++f.next == n.count )
                 {
-                    rule.addToken( Token( element, tokenType ) );
-                    tokenType = Token::eConfused;
-                    element.clear();
-                    element.push_back( c );
+                    stack.pop_back();
+                    continue;
                 }
-                s = eReadElement;
+                pushRank( stack, child( n, (uint32_t)f.next ), WHOLE_NODE, f.begin, f.end );
+                continue;
             }
-            if( processRule )
+
+            //the items [item, count) of a sequence
+            const Node& first = m_nodes[ child( n, f.item ) ];
+            RankKey key = { f.node, f.item, f.begin, f.end };
+            if( f.step == 0 )
             {
-                if( !element.empty() )
-                    rule.addToken( Token( element, tokenType ) );
-                if( !rule.isValid() )
+                if( f.item + 1 == n.count )
                 {
-                    invalidGrammar = true;
-                    break;
+                    f.node = child( n, f.item );
+                    f.item = WHOLE_NODE;
+                    continue;
+                }
+                RankMemo::iterator found = memo.find( key );
+                if( found != memo.end() )
+                {
+                    result = found->second;
+                    stack.pop_back();
+                    continue;
+                }
+                f.value = WORDS_OVERFLOW;
+                f.next = f.begin + first.minLength;
+                f.step = 1;
+            }else if( f.step == 2 )
+            {
+                //the other items returned
+                f.step = 1;
+                if( result != WORDS_OVERFLOW )
+                {
+                    f.rest = result;
+                    f.step = 3;
+                    pushRank( stack, child( n, f.item ), WHOLE_NODE, f.begin, f.next );
+                    continue;
                 }
-                Producer::updateProductorMap( name, rule );
-                rule.reset();
-                element.clear();
-                tokenType = Token::eConfused;
+                ++f.next;
+            }else if( f.step == 3 )
+            {
+                //the first item returned
+                if( result != WORDS_OVERFLOW )
+                    f.value = min( f.value, result + first.words * f.rest );
+                ++f.next;
+                f.step = 1;
+            }
+            if( f.next > f.end || f.next - f.begin > first.maxLength )
+            {
+                result = memo[ key ] = f.value;
+                stack.pop_back();
+                continue;
             }
+            f.step = 2;
+            pushRank( stack, f.node, f.item + 1, f.next, f.end );
         }
+        return result;
+    }
 
-        if( eReadName == s && name.empty() ) //empty line
-            return true;
-        else if( ( eReadElement != s && eReadEndElement != s ) || invalidGrammar )
+    uint32_t addNode( NodeType type, uint32_t first, uint32_t count, size_t minLength, size_t maxLength,
+        uint64_t words, uint64_t bytes )
+    {
+        Node n;
+        n.type = type;
+        n.first = first;
+        n.count = count;
+        n.minLength = minLength;
+        n.maxLength = maxLength;
+        n.words = words;
+        n.bytes = bytes;
+        n.deduplicate = false;
+        m_nodes.push_back( n );
+        return (uint32_t)( m_nodes.size() - 1 );
+    }
+
+    //weights as log probabilities of the terminals, to normalize them
+    static void toLogProbs( vector< double >& weights )
+    {
+        double total = 0;
+        for( size_t i = 0; i < weights.size(); ++i )
+            total += weights[i];
+        for( size_t i = 0; i < weights.size(); ++i )
+            weights[i] = log( weights[i] / total );
+    }
+
+    //logProbs: of the terminals, every terminal is equally likely without them
+    uint32_t addLeaf( const Terms& terms, const vector< double >* logProbs = NULL )
+    {
+        if( m_probabilities )
         {
-            cutLine( beginLine );
-            string err = "invalid grammar in line:";
-            err += beginLine;
-            ErrorMan::setError( ErrorMan::eInvalidGrammar, err );
-            return false;
+            for( size_t i = 0; i < terms.size(); ++i )
+                m_termLogProb.push_back( logProbs ? (*logProbs)[i] : -log( (double)terms.size() ) );
         }
+        uint32_t first = (uint32_t)m_termData.size();
+        size_t minLength = terms.empty() ? 0 : terms.front().length;
+        size_t maxLength = 0;
+        uint64_t bytes = 0;
+        for( size_t i = 0; i < terms.size(); ++i )
+        {
+            m_termData.push_back( terms[i].data );
+            m_termLength.push_back( terms[i].length );
+            m_sortedTerms.push_back( (uint32_t)m_sortedTerms.size() );
+            minLength = min( minLength, (size_t)terms[i].length );
+            maxLength = max( maxLength, (size_t)terms[i].length );
+            bytes += terms[i].length;
+        }
+        return addNode( eLeaf, first, (uint32_t)terms.size(), minLength, maxLength, terms.size(), bytes );
+    }
 
-        if( !element.empty() )
-            rule.addToken( Token( element, tokenType ) );
-        if( rule.isValid() )
-            Producer::updateProductorMap( name, rule );
-        return true;
+    //a leaf of words rendered at build time, packed into a table of their own
+    uint32_t addTable( const vector< string >& words, const vector< double >* logProbs = NULL )
+    {
+        size_t size = 0;
+        for( size_t i = 0; i < words.size(); ++i )
+            size += words[i].size();
+        m_tables.push_back( string() );
+        string& table = m_tables.back();
+        table.reserve( size );
+        for( size_t i = 0; i < words.size(); ++i )
+            table += words[i];
+        Terms terms( words.size() );
+        size_t offset = 0;
+        for( size_t i = 0; i < words.size(); ++i )
+        {
+            terms[i].data = table.data() + offset;
+            terms[i].length = (uint32_t)words[i].size();
+            offset += words[i].size();
+        }
+        return addLeaf( terms, logProbs );
     }
 
-    bool analysisDependence()
+    //logProbs: of the children of an alternation, every one is equally likely without them
+    uint32_t addBranch( NodeType type, const vector< uint32_t >& children, const vector< double >* logProbs = NULL )
     {
-        Producer::ProductorMap::iterator iter = Producer::m_mapProducer.find( "PRODUCER" );
-        if( iter == Producer::m_mapProducer.end() )
+        if( m_probabilities )
         {
-            ErrorMan::setError( ErrorMan::eMisc, "can not find main producer:PRODUCER" );
-            return false;
+            for( size_t i = 0; i < children.size(); ++i )
+            {
+                if( type == eSequence )
+                    m_childLogProb.push_back( 0 );
+                else
+                    m_childLogProb.push_back( logProbs ? (*logProbs)[i] : -log( (double)children.size() ) );
+            }
+        }
+        uint32_t first = (uint32_t)m_children.size();
+        size_t minLength = ( type == eSequence ) ? 0 : m_nodes[ children[0] ].minLength;
+        size_t maxLength = 0;
+        uint64_t words = ( type == eSequence ) ? 1 : 0;
+        uint64_t bytes = 0;
+        for( size_t i = 0; i < children.size(); ++i )
+        {
+            const Node& n = m_nodes[ children[i] ];
+            if( type == eSequence )
+            {
+                minLength += n.minLength;
+                maxLength += n.maxLength;
+                bytes = addWords( mulWords( bytes, n.words ), mulWords( n.bytes, words ) );
+                words = mulWords( words, n.words );
+            }else
+            {
+                minLength = min( minLength, n.minLength );
+                maxLength = max( maxLength, n.maxLength );
+                bytes = addWords( bytes, n.bytes );
+                words = addWords( words, n.words );
+            }
+        }
+        m_children.insert( m_children.end(), children.begin(), children.end() );
+        return addNode( type, first, (uint32_t)children.size(), minLength, maxLength, words, bytes );
+    }
+
+    //the children of a node are added before it
+    void computeClasses()
+    {
+        m_classes.resize( m_nodes.size() );
+        for( size_t i = 0; i < m_nodes.size(); ++i )
+        {
+            const Node& n = m_nodes[i];
+            uint8_t classes = 0;
+            for( uint32_t j = 0; j < n.count && classes != 0x0f; ++j )
+            {
+                if( n.type == eLeaf )
+                    classes |= Policy::classesOf( terminal( n.first + j ), terminalLength( n.first + j ) );
+                else
+                    classes |= m_classes[ child( n, j ) ];
+            }
+            m_classes[i] = classes;
         }
+    }
 
-        list< Producer* > dependStack;
-        dependStack.push_back( &(iter->second) );
+    //a node being expanded on the stack of expand. its words go to 'words', which is
+    //the item vector of the sequence above it or the output of the alternation above it
+    struct ExpandFrame{
+        uint32_t            node;
+        uint32_t            next;       //the child to expand next
+        size_t              begin;      //the first word of the node in 'words'
+        size_t              childBegin; //the first word of the child expanded last
+        vector< string >*   words;
+        vector< double >*   logProbs;
+        vector< string >    result, item;   //of a sequence, the first item is the fastest digit
+        vector< double >    resultProbs, itemProbs;
+    };
 
-        list< Producer* > confusedList;
-        while( !dependStack.empty() )
+    static void pushExpand( list< ExpandFrame >& stack, const Node& n, uint32_t nodeIndex, vector< string >* words, vector< double >* logProbs )
+    {
+        stack.push_back( ExpandFrame() );
+        ExpandFrame& f = stack.back();
+        f.node = nodeIndex;
+        f.next = 0;
+        f.begin = f.childBegin = words->size();
+        f.words = words;
+        f.logProbs = logProbs;
+        if( n.type == eSequence )
         {
-            Producer* top = dependStack.back();
-            confusedList.clear();
-            if( !top->confusedProductors( confusedList ) )
-                return false;
-            if( confusedList.size() )
+            f.result.resize( 1 );
+            f.resultProbs.resize( 1, 0.0 );
+        }
+    }
+
+    //appends all the words of a node in enumeration order, and their log probabilities
+    //to logProbs when it is given. the nodes in progress are kept on a stack of their
+    //own, so deep plans do not overflow the native one
+    void expand( uint32_t nodeIndex, vector< string >& words, vector< double >* logProbs = NULL ) const
+    {
+        list< ExpandFrame > stack;
+        pushExpand( stack, m_nodes[ nodeIndex ], nodeIndex, &words, logProbs );
+        while( !stack.empty() )
+        {
+            ExpandFrame& f = stack.back();
+            const Node& n = m_nodes[ f.node ];
+            if( n.type == eLeaf )
+            {
+                for( uint32_t i = 0; i < n.count; ++i )
+                {
+                    f.words->push_back( string( terminal( n.first + i ), terminalLength( n.first + i ) ) );
+                    if( f.logProbs )
+                        f.logProbs->push_back( m_termLogProb[ n.first + i ] );
+                }
+            }else if( n.type == eAlternation )
             {
-                list< Producer* >::iterator iter = confusedList.begin();
-                for ( ; iter != confusedList.end(); ++iter )
+                if( f.next > 0 )
+                {
+                    for( size_t j = f.childBegin; f.logProbs && j < f.words->size(); ++j )
+                        (*f.logProbs)[j] += childLogProb( n, f.next - 1 );
+                }
+                if( f.next < n.count )
                 {
-                    if( find( dependStack.begin(), dependStack.end(), *iter) == dependStack.end() )
-                        dependStack.push_back( *iter );
+                    f.childBegin = f.words->size();
+                    uint32_t c = child( n, f.next++ );
+                    pushExpand( stack, m_nodes[c], c, f.words, f.logProbs );
+                    continue;
                 }
             }else
             {
-                dependStack.pop_back();
+                if( f.next > 0 )
+                {
+                    vector< string > next;
+                    vector< double > nextProbs;
+                    for( size_t j = 0; j < f.item.size(); ++j )
+                    {
+                        for( size_t k = 0; k < f.result.size(); ++k )
+                        {
+                            next.push_back( f.result[k] + f.item[j] );
+                            if( f.logProbs )
+                                nextProbs.push_back( f.resultProbs[k] + f.itemProbs[j] );
+                        }
+                    }
+                    f.result.swap( next );
+                    f.resultProbs.swap( nextProbs );
+                }
+                if( f.next < n.count )
+                {
+                    f.item.clear();
+                    f.itemProbs.clear();
+                    uint32_t c = child( n, f.next++ );
+                    pushExpand( stack, m_nodes[c], c, &f.item, f.logProbs ? &f.itemProbs : NULL );
+                    continue;
+                }
+                f.words->insert( f.words->end(), f.result.begin(), f.result.end() );
+                if( f.logProbs )
+                    f.logProbs->insert( f.logProbs->end(), f.resultProbs.begin(), f.resultProbs.end() );
+            }
+            if( n.deduplicate )
+                removeDuplicates( *f.words, f.begin, f.logProbs );
+            stack.pop_back();
+        }
+    }
+
+    //drops the repeated words behind 'begin', keeping the first occurrences in order.
+    //the probabilities of the repetitions are added to the first occurrence
+    static uint64_t removeDuplicates( vector< string >& words, size_t begin, vector< double >* logProbs = NULL )
+    {
+        unordered_map< string, size_t > seen;
+        size_t out = begin;
+        for( size_t i = begin; i < words.size(); ++i )
+        {
+            pair< unordered_map< string, size_t >::iterator, bool > found = seen.insert( make_pair( words[i], out ) );
+            if( !found.second )
+            {
+                if( logProbs )
+                {
+                    double& first = (*logProbs)[ found.first->second ];
+                    double other = (*logProbs)[i];
+                    first = max( first, other ) + log1p( exp( -fabs( first - other ) ) );
+                }
+                continue;
             }
-            if( dependStack.size() && top == dependStack.back() )
+            if( out != i )
             {
-                string err = "producer" + top->name() + "can not be instantiation";
-                ErrorMan::setError( ErrorMan::eMisc, err );
-                return false;
+                words[ out ].swap( words[i] );
+                if( logProbs )
+                    (*logProbs)[ out ] = (*logProbs)[i];
+            }
+            ++out;
+        }
+        uint64_t removed = words.size() - out;
+        words.resize( out );
+        if( logProbs )
+            logProbs->resize( out );
+        return removed;
+    }
+
+    //renders a small node into a single leaf: one lookup and one copy per word
+    uint32_t materialize( uint32_t nodeIndex )
+    {
+        const Node& n = m_nodes[ nodeIndex ];
+        if( n.type == eLeaf || n.bytes > m_materializeBytes || n.words > 0xffffffffULL )
+            return nodeIndex;
+        vector< string > words;
+        vector< double > logProbs;
+        expand( nodeIndex, words, m_probabilities ? &logProbs : NULL );
+        return addTable( words, m_probabilities ? &logProbs : NULL );
+    }
+
+    static inline Term term( const Token& token )
+    {
+        Term t = { token.data(), (uint32_t)token.length() };
+        return t;
+    }
+
+    uint32_t lowerToken( const Token& token, map< Producer*, uint32_t >& lowered )
+    {
+        if( token.type() == Token::eProductor )
+            return lowerProducer( token.producer(), lowered );
+        return addLeaf( Terms( 1, term( token ) ) );
+    }
+
+    //a leaf of consecutive rules made of a single terminal, its weight is the sum of
+    //theirs. clears termWeights
+    uint32_t addMergedLeaf( const Terms& terms, vector< double >& termWeights, vector< double >& weights )
+    {
+        double total = 0;
+        for( size_t i = 0; i < termWeights.size(); ++i )
+            total += termWeights[i];
+        weights.push_back( total );
+        toLogProbs( termWeights );
+        uint32_t index = addLeaf( terms, &termWeights );
+        termWeights.clear();
+        return index;
+    }
+
+    //consecutive rules made of a single terminal are merged into one leaf
+    uint32_t lowerProducer( Producer* producer, map< Producer*, uint32_t >& lowered )
+    {
+        map< Producer*, uint32_t >::iterator found = lowered.find( producer );
+        if( found != lowered.end() )
+            return found->second;
+
+        //firstRule: number of the rule each alternative starts with, a merged leaf
+        //holds one rule per terminal
+        vector< uint32_t > alternatives, firstRule;
+        if( producer->isWordFile() )
+        {
+            //the words stay in the mapping, the leaf only indexes the lines
+            Terms terms;
+            terms.reserve( (size_t)producer->wordCount() );
+            Term t;
+            size_t pos = 0, length;
+            while( producer->nextWord( pos, t.data, length ) )
+            {
+                t.length = (uint32_t)length;
+                terms.push_back( t );
+            }
+            uint32_t index = addLeaf( terms );
+            //every line counts as a rule of its own
+            if( m_ambiguityMode != eAmbiguityIgnore )
+                index = checkAmbiguity( producer, index, vector< uint32_t >( 1, index ), vector< uint32_t >( 1, 0 ),
+                    vector< bool >( 1, true ) );
+            lowered[ producer ] = index;
+            return index;
+        }
+
+        //weights: of the alternatives, the sum of the weights of their rules
+        vector< bool > merged;
+        vector< double > weights, termWeights;
+        Terms terms;
+        uint32_t rule = 0;
+        for( ; rule < producer->ruleCount(); ++rule )
+        {
+            ProductRule items = producer->rule( rule );
+            if( items.size() == 1 && items.front().type() == Token::eTerminater )
+            {
+                terms.push_back( term( items.front() ) );
+                termWeights.push_back( producer->ruleWeight( rule ) );
+                continue;
+            }
+            if( !terms.empty() )
+            {
+                alternatives.push_back( addMergedLeaf( terms, termWeights, weights ) );
+                firstRule.push_back( rule - (uint32_t)terms.size() );
+                merged.push_back( true );
+                terms.clear();
+            }
+            firstRule.push_back( rule );
+            merged.push_back( false );
+            weights.push_back( producer->ruleWeight( rule ) );
+            if( items.size() == 1 )
+            {
+                alternatives.push_back( lowerToken( items.front(), lowered ) );
+                continue;
             }
+            vector< uint32_t > sequence;
+            for( const Token* item = items.begin(); item != items.end(); ++item )
+                sequence.push_back( lowerToken( *item, lowered ) );
+            alternatives.push_back( addBranch( eSequence, sequence ) );
+        }
+        if( !terms.empty() )
+        {
+            alternatives.push_back( addMergedLeaf( terms, termWeights, weights ) );
+            firstRule.push_back( rule - (uint32_t)terms.size() );
+            merged.push_back( true );
+        }
+
+        uint32_t index;
+        if( alternatives.size() == 1 )
+            index = alternatives.front();
+        else
+        {
+            toLogProbs( weights );
+            index = addBranch( eAlternation, alternatives, &weights );
+        }
+        if( m_ambiguityMode != eAmbiguityIgnore )
+            index = checkAmbiguity( producer, index, alternatives, firstRule, merged );
+        index = materialize( index );
+        lowered[ producer ] = index;
+        return index;
+    }
+
+    //a small producer is expanded and checked word by word, a large one is proven
+    //unambiguous from the structure of the plan or left to the cursor to deduplicate
+    uint32_t checkAmbiguity( Producer* producer, uint32_t index, const vector< uint32_t >& alternatives,
+        const vector< uint32_t >& firstRule, const vector< bool >& merged )
+    {
+        Ambiguity report;
+        report.producer = producer->name();
+        report.words = m_nodes[ index ].words;
+        report.expanded = ( report.words <= AMBIGUITY_EXPAND_WORDS );
+        report.duplicates = 0;
+        report.unique = false;
+        report.removed = false;
+        report.runtime = false;
+
+        if( report.expanded )
+        {
+            //the rule every word comes from
+            vector< string > words;
+            vector< uint32_t > rules;
+            for( size_t i = 0; i < alternatives.size(); ++i )
+            {
+                size_t begin = words.size();
+                expand( alternatives[i], words );
+                for( size_t j = begin; j < words.size(); ++j )
+                    rules.push_back( firstRule[i] + ( merged[i] ? (uint32_t)( j - begin ) : 0 ) );
+            }
+
+            //first rule, second rule -> an example word and the count of the words they share
+            map< pair< uint32_t, uint32_t >, pair< string, uint64_t > > overlaps;
+            map< string, uint32_t > first;
+            for( size_t i = 0; i < words.size(); ++i )
+            {
+                map< string, uint32_t >::iterator found = first.find( words[i] );
+                if( found == first.end() )
+                {
+                    first[ words[i] ] = rules[i];
+                    continue;
+                }
+                ++report.duplicates;
+                pair< string, uint64_t >& overlap = overlaps[ make_pair( found->second, rules[i] ) ];
+                if( overlap.second++ == 0 )
+                    overlap.first = words[i];
+            }
+            map< pair< uint32_t, uint32_t >, pair< string, uint64_t > >::iterator iter = overlaps.begin();
+            for( ; iter != overlaps.end(); ++iter )
+            {
+                char text[128];
+                if( iter->first.first == iter->first.second )
+                    snprintf( text, sizeof( text ), "rule %u repeats %llu words",
+                        iter->first.first + 1, (unsigned long long)iter->second.second );
+                else
+                    snprintf( text, sizeof( text ), "rules %u and %u share %llu words",
+                        iter->first.first + 1, iter->first.second + 1, (unsigned long long)iter->second.second );
+                report.overlaps.push_back( string( text ) + ", e.g. \"" + iter->second.first + "\"" );
+            }
+            report.unique = ( report.duplicates == 0 );
+            if( report.duplicates && m_ambiguityMode == eAmbiguityRemove )
+            {
+                removeDuplicates( words, 0 );
+                index = addTable( words );
+                report.removed = true;
+            }
+        }else
+        {
+            report.unique = isUnique( index );
+            if( !report.unique && m_ambiguityMode == eAmbiguityRemove && report.words != WORDS_OVERFLOW )
+            {
+                m_nodes[ index ].deduplicate = true;
+                report.runtime = true;
+            }
+        }
+        if( report.removed || report.runtime )
+            m_unique[ index ] = true;
+        m_ambiguities.push_back( report );
+        return index;
+    }
+
+    //true when every word of a node has exactly one derivation. false means unknown
+    //for the nodes too large to be expanded
+    bool isUnique( uint32_t nodeIndex )
+    {
+        map< uint32_t, bool >::iterator found = m_unique.find( nodeIndex );
+        if( found != m_unique.end() )
+            return found->second;
+
+        const Node& n = m_nodes[ nodeIndex ];
+        bool unique = true;
+        if( n.deduplicate )
+            unique = true;
+        else if( n.type == eLeaf )
+        {
+            unordered_set< string > seen;
+            for( uint32_t i = 0; i < n.count && unique; ++i )
+                unique = seen.insert( string( terminal( n.first + i ), terminalLength( n.first + i ) ) ).second;
+        }else
+        {
+            for( uint32_t i = 0; i < n.count && unique; ++i )
+                unique = isUnique( child( n, i ) );
+            //a sequence splits in one way only when all but its last item are prefix free
+            for( uint32_t i = 0; i < n.count && unique; ++i )
+            {
+                if( n.type == eSequence )
+                    unique = ( i + 1 == n.count ) || prefixFree( child( n, i ) );
+                else
+                {
+                    for( uint32_t j = i + 1; j < n.count && unique; ++j )
+                        unique = disjoint( child( n, i ), child( n, j ) );
+                }
+            }
+        }
+        m_unique[ nodeIndex ] = unique;
+        return unique;
+    }
+
+    //no word of the node is the beginning of another one. a sequence is when all its
+    //items are, the items of nested sequences wait on a stack in their order
+    bool prefixFree( uint32_t nodeIndex ) const
+    {
+        vector< uint32_t > pending( 1, nodeIndex );
+        while( !pending.empty() )
+        {
+            const Node& n = m_nodes[ pending.back() ];
+            uint32_t index = pending.back();
+            pending.pop_back();
+            if( n.minLength == n.maxLength )
+                continue;
+            if( n.type == eSequence )
+            {
+                for( uint32_t i = n.count; i-- > 0; )
+                    pending.push_back( child( n, i ) );
+                continue;
+            }
+            if( n.words > AMBIGUITY_EXPAND_WORDS )
+                return false;
+            //in sorted order a word is followed by the words it begins
+            vector< string > words;
+            expand( index, words );
+            sort( words.begin(), words.end() );
+            for( size_t i = 1; i < words.size(); ++i )
+            {
+                if( words[i].compare( 0, words[i-1].size(), words[i-1] ) == 0 )
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    //the two nodes have no word in common
+    bool disjoint( uint32_t a, uint32_t b ) const
+    {
+        const Node& na = m_nodes[ a ];
+        const Node& nb = m_nodes[ b ];
+        if( na.maxLength < nb.minLength || nb.maxLength < na.minLength )
+            return true;
+        if( na.words > nb.words )
+            swap( a, b );
+        if( m_nodes[ a ].words > AMBIGUITY_EXPAND_WORDS )
+            return false;
+        vector< string > words;
+        expand( a, words );
+        for( size_t i = 0; i < words.size(); ++i )
+        {
+            if( rank( b, words[i].data(), words[i].size() ) != WORDS_OVERFLOW )
+                return false;
+        }
+        return true;
+    }
+
+protected:
+    vector< Node >      m_nodes;
+    vector< uint32_t >  m_children;
+    vector< const char* >   m_termData;
+    vector< uint32_t >  m_termLength;
+    vector< double >    m_termLogProb;  //with probabilities only
+    vector< double >    m_childLogProb; //of every entry in m_children, with probabilities only
+    list< string >      m_tables;       //the text of the rendered leaves
+    uint32_t            m_root;
+    size_t              m_materializeBytes;
+    AmbiguityMode       m_ambiguityMode;
+    size_t              m_minWordLength;
+    size_t              m_maxWordLength;
+    Policy              m_policy;
+    bool                m_probabilities;
+    vector< uint8_t >   m_classes;      //the character classes of every node, with a policy only
+    mutable vector< uint32_t >  m_sortedTerms;  //the terminals of every leaf sorted by text, for rank
+    mutable atomic< size_t >    m_rankedTerms;  //the terminals m_sortedTerms is sorted for
+    mutable mutex       m_rankMutex;
+    map< uint32_t, bool >   m_unique;
+    list< Ambiguity >   m_ambiguities;
+};
+
+//the enumeration state of a Plan: the active derivation kept in preorder in one
+//flat array, the first leaf is the fastest digit of the odometer.
+//only the chosen alternative of every alternation is instantiated.
+//the current word is kept right aligned in m_word, so the unchanged tail of the
+//previous word stays in place and only the changed leading positions are rewritten
+class Cursor{
+public:
+    static const uint32_t NONE = 0xffffffff;
+    static const size_t BATCH_CHUNK = 16;   //bytes of one store of the batch kernel
+    struct Slot{
+        uint32_t    node;
+        uint32_t    digit;  //eLeaf: current terminal, eAlternation: current alternative
+        uint32_t    parent;
+        uint32_t    end;    //one past the last slot of this subtree
+    };
+    struct OpenSlot{
+        uint32_t    slot;
+        uint32_t    next;   //the child to instantiate next
+        uint64_t    word;   //the word of the children not instantiated yet
+    };
+
+    Cursor() : m_plan( NULL ), m_policy( NULL ), m_atEnd( true ), m_cleanTail( 0 ), m_shared( 0 ), m_index( 0 ),
+        m_limit( Plan::WORDS_OVERFLOW ), m_batchIndex( 0 )
+    {
+    }
+
+    void reset( const Plan* plan )
+    {
+        seek( plan, 0 );
+    }
+
+    //positions the cursor on the word with the given index without generating the
+    //words before it, the index must be below plan->words(). skipping duplicates
+    //stops at the limit, the words from there on are not wanted
+    void seek( const Plan* plan, uint64_t index, uint64_t limit = Plan::WORDS_OVERFLOW )
+    {
+        assert( index == 0 || index < plan->words() );
+        m_plan = plan;
+        m_policy = plan->policy();
+        m_slots.clear();
+        instantiate( plan->root(), NONE, index, m_slots );
+        collectLeaves();
+        m_word.resize( plan->node( plan->root() ).maxLength + 1 );
+        m_cleanTail = 0;
+        m_shared = 0;
+        m_atEnd = false;
+        m_index = index;
+        m_limit = limit;
+        m_batchIndex = 0;
+        settle( m_leaves.size() );
+    }
+
+    inline bool atEnd() const
+    {
+        return m_atEnd;
+    }
+
+    //index of the current word in the keyspace, words skipped as duplicates count too
+    inline uint64_t index() const
+    {
+        return m_index;
+    }
+
+    //returns the count of leading positions that changed, 0 when the keyspace is exhausted
+    inline size_t next()
+    {
+        size_t changed = advance( 0 );
+        ++m_index;
+        if( changed && ( !m_duplicates.empty() || m_plan->hasFilter() ) )
+            changed = settle( changed );
+        return changed;
+    }
+
+    //writes the words from the current one to the last terminal of the first position
+    //into out and moves past them, when that leaf has terminals of one width and no
+    //word is skipped. they share all but their first bytes: every one is a copy of the
+    //current word in stores of BATCH_CHUNK bytes with its terminal put over the head.
+    //separator: written behind every word, NULL for none. returns the count of words,
+    //bytes takes their length. 0 when the current word must be taken with word(),
+    //at most maxWords and no byte beyond out + room is written
+    inline size_t nextBatch( char* out, size_t room, uint64_t maxWords, const char* separator, size_t& bytes )
+    {
+        //a word by word caller pays only this test while no batch is possible
+        if( m_index < m_batchIndex )
+            return 0;
+        return writeBatch( out, room, maxWords, separator, bytes );
+    }
+
+    inline size_t positions() const
+    {
+        return m_leaves.size();
+    }
+
+    //terminal currently selected at the given position
+    inline uint32_t terminalAt( size_t position ) const
+    {
+        const Slot& leaf = m_slots[ m_leaves[ position ] ];
+        return m_plan->node( leaf.node ).first + leaf.digit;
+    }
+
+    void product( string& result )
+    {
+        size_t length;
+        const char* w = word( length );
+        result.assign( w, length );
+    }
+
+    //renders the current word and returns it, the buffer is valid until the next call
+    inline const char* word( size_t& length )
+    {
+        size_t shared;
+        return word( length, shared );
+    }
+
+    //shared: count of trailing bytes the word has in common with the word returned before
+    inline const char* word( size_t& length, size_t& shared )
+    {
+        const char* result = render( length );
+        shared = m_shared;
+        m_shared = (size_t)-1;
+        return result;
+    }
+
+protected:
+    //a deduplicated producer in the current derivation and the positions it covers
+    struct Duplicate{
+        uint32_t    slot;
+        size_t      firstLeaf;
+        size_t      endLeaf;
+    };
+
+    //what the subtrees in front of a slot can produce, for skipFiltered
+    struct Before{
+        size_t      minLength;
+        size_t      maxLength;
+        uint8_t     classes;
+    };
+    typedef Policy::State State;
+
+    //the batch kernel: count copies of m_record, record bytes apart, the first width
+    //bytes of each one replaced by the next terminal from first on. a constant WIDTH
+    //makes those a single store, 0 takes width. every copy is made of whole chunks,
+    //so the last one writes up to BATCH_CHUNK - 1 bytes beyond the record
+    template< size_t WIDTH >
+    inline void fillBatch( char* out, size_t record, uint32_t first, size_t count, size_t width ) const
+    {
+        const char* source = m_record.data();
+        for( size_t i = 0; i < count; ++i, out += record )
+        {
+            for( size_t chunk = 0; chunk < record; chunk += BATCH_CHUNK )
+                memcpy( out + chunk, source + chunk, BATCH_CHUNK );
+            memcpy( out, m_plan->terminal( first + (uint32_t)i ), WIDTH ? WIDTH : width );
+        }
+    }
+
+    size_t writeBatch( char* out, size_t room, uint64_t maxWords, const char* separator, size_t& bytes )
+    {
+        if( m_atEnd || m_leaves.empty() )
+            return 0;
+        if( m_plan->hasFilter() )
+        {
+            m_batchIndex = Plan::WORDS_OVERFLOW;
+            return 0;
+        }
+        if( !m_duplicates.empty() )
+            return 0;
+        Slot& leaf = m_slots[ m_leaves[0] ];
+        const Plan::Node& n = m_plan->node( leaf.node );
+        if( n.minLength != n.maxLength )
+        {
+            //the first position keeps its leaf until it passes the last terminal
+            m_batchIndex = m_index + ( n.count - leaf.digit );
+            return 0;
+        }
+        size_t length;
+        const char* word = render( length );
+        size_t record = length + ( separator ? 1 : 0 );
+        size_t padded = ( record + BATCH_CHUNK - 1 ) / BATCH_CHUNK * BATCH_CHUNK;
+        if( room < padded || record == 0 )
+            return 0;
+        uint64_t count = min( min( (uint64_t)( n.count - leaf.digit ), maxWords ), (uint64_t)( ( room - padded ) / record + 1 ) );
+        if( count == 0 )
+            return 0;
+
+        if( m_record.size() < padded )
+            m_record.resize( padded );
+        memcpy( m_record.data(), word, length );
+        if( separator )
+            m_record[ length ] = *separator;
+        uint32_t first = n.first + leaf.digit;
+        switch( n.minLength )
+        {
+        case 1: fillBatch< 1 >( out, record, first, (size_t)count, 1 ); break;
+        case 2: fillBatch< 2 >( out, record, first, (size_t)count, 2 ); break;
+        case 3: fillBatch< 3 >( out, record, first, (size_t)count, 3 ); break;
+        case 4: fillBatch< 4 >( out, record, first, (size_t)count, 4 ); break;
+        default: fillBatch< 0 >( out, record, first, (size_t)count, n.minLength ); break;
+        }
+        bytes = (size_t)count * record;
+
+        //the last word written is the current one of the cursor, next leaves it
+        leaf.digit += (uint32_t)count - 1;
+        m_index += count - 1;
+        m_shared = (size_t)-1;
+        next();
+        return (size_t)count;
+    }
+
+    const char* render( size_t& length )
+    {
+        size_t count = m_leaves.size();
+        if( m_starts.size() != count )
+            m_starts.resize( count );
+
+        //m_starts is indexed from the last position, the tail keeps its entries.
+        //so is m_states, entry k holds the policy state after the last k positions
+        if( m_policy && m_states.size() != count + 1 )
+            m_states.resize( count + 1 );
+        size_t dirty = count - min( m_cleanTail, count );
+        size_t end = ( dirty < count ) ? m_starts[ count - 1 - dirty ] : m_word.size();
+        State state;
+        if( m_policy )
+            state = ( dirty < count ) ? m_states[ count - dirty ] : m_policy->start();
+        m_shared = min( m_shared, m_word.size() - end );
+        for( size_t i = dirty; i-- > 0; )
+        {
+            uint32_t term = terminalAt( i );
+            uint32_t termLength = m_plan->terminalLength( term );
+            end -= termLength;
+            memcpy( &m_word[ end ], m_plan->terminal( term ), termLength );
+            m_starts[ count - 1 - i ] = end;
+            if( m_policy )
+            {
+                m_policy->read( state, m_plan->terminal( term ), termLength );
+                m_states[ count - i ] = state;
+            }
+        }
+        m_cleanTail = count;
+        size_t start = m_starts[ count - 1 ];
+        length = m_word.size() - start;
+        return m_word.data() + start;
+    }
+
+    inline size_t markDirty( size_t changed )
+    {
+        m_cleanTail = min( m_cleanTail, m_leaves.size() - changed );
+        return changed;
+    }
+
+    //odometer step starting at the given position, the positions before it must be
+    //in their initial state
+    size_t advance( size_t from )
+    {
+        for( size_t i = from; i < m_leaves.size(); ++i )
+        {
+            Slot& leaf = m_slots[ m_leaves[i] ];
+            if( ++leaf.digit < m_plan->node( leaf.node ).count )
+                return markDirty( i + 1 );
+            leaf.digit = 0;
+
+            uint32_t current = m_leaves[i];
+            for( ;; )
+            {
+                uint32_t parent = m_slots[ current ].parent;
+                if( parent == NONE )
+                {
+                    m_atEnd = true;
+                    return 0;
+                }
+                const Plan::Node& n = m_plan->node( m_slots[ parent ].node );
+                if( n.type == Plan::eSequence )
+                {
+                    if( m_slots[ current ].end != m_slots[ parent ].end )
+                        break;  //carry into the next position
+                    current = parent;
+                    continue;
+                }
+
+                //the leaves behind position i are not touched by the alternation
+                size_t tail = m_leaves.size() - i - 1;
+                bool wrapped = ( ++m_slots[ parent ].digit >= n.count );
+                if( wrapped )
+                    m_slots[ parent ].digit = 0;
+                replaceAlternative( parent );
+                if( !wrapped )
+                    return markDirty( m_leaves.size() - tail );
+                i = m_leaves.size() - tail - 1;
+                current = parent;
+            }
+        }
+        m_atEnd = true;
+        return 0;
+    }
+
+    //moves on until the current word is neither a removed duplicate nor out of the
+    //length range nor against the policy, returns the count of leading positions that changed
+    size_t settle( size_t changed )
+    {
+        if( !m_plan->hasFilter() )
+            return m_duplicates.empty() ? changed : skipDuplicates( changed );
+        size_t tail = m_leaves.size() - changed;
+        while( !m_atEnd )
+        {
+            if( !m_duplicates.empty() )
+            {
+                changed = skipDuplicates( m_leaves.size() - tail );
+                tail = min( tail, m_leaves.size() - changed );
+                if( m_atEnd || ( m_limit != Plan::WORDS_OVERFLOW && m_index >= m_limit ) )
+                    break;
+            }
+            size_t length;
+            render( length );
+            if( length >= m_plan->minWordLength() && length <= m_plan->maxWordLength() &&
+                ( !m_policy || m_policy->accepts( m_states[ m_leaves.size() ] ) ) )
+                break;
+            changed = skipFiltered();
+            tail = min( tail, m_leaves.size() - changed );
+            if( !m_atEnd && m_plan->words() != Plan::WORDS_OVERFLOW )
+            {
+                m_index = stateIndex( 0 );
+                if( m_index >= m_limit )
+                    break;
+            }
+        }
+        return m_atEnd ? 0 : m_leaves.size() - tail;
+    }
+
+    //skips the largest subtree of states around the current one in which no word can
+    //pass the filters: a slot whose subtree and all the subtrees in front of it, free
+    //to change, can not make up for the length of the positions behind it, or can not
+    //lead the policy state of those positions to an acceptable word
+    size_t skipFiltered()
+    {
+        //fixed[i]: length and count of the leaves from slot i on, before[i]: what the
+        //subtrees in front of slot i that are not its ancestors can produce
+        size_t count = m_slots.size();
+        m_fixed.resize( count + 1 );
+        m_fixed[ count ] = make_pair( (size_t)0, (size_t)0 );
+        for( size_t i = count; i-- > 0; )
+        {
+            const Plan::Node& n = m_plan->node( m_slots[i].node );
+            m_fixed[i] = m_fixed[ i + 1 ];
+            if( n.type == Plan::eLeaf )
+            {
+                m_fixed[i].first += m_plan->terminalLength( n.first + m_slots[i].digit );
+                ++m_fixed[i].second;
+            }
+        }
+        m_before.resize( count );
+        uint32_t best = NONE;
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            const Slot& slot = m_slots[i];
+            const Plan::Node& n = m_plan->node( slot.node );
+            uint8_t classes = m_policy ? m_plan->nodeClasses( slot.node ) : 0;
+            if( slot.parent == NONE )
+            {
+                Before empty = { 0, 0, 0 };
+                m_before[i] = empty;
+            }else if( slot.parent + 1 == i )
+                m_before[i] = m_before[ slot.parent ];
+            //the next sibling has this subtree in front of it too
+            if( slot.parent != NONE && slot.end < count && m_slots[ slot.end ].parent == slot.parent )
+            {
+                Before next = { m_before[i].minLength + n.minLength, m_before[i].maxLength + n.maxLength,
+                    (uint8_t)( m_before[i].classes | classes ) };
+                m_before[ slot.end ] = next;
+            }
+
+            //of the slots ending at the same position the first one covers the most
+            if( best != NONE && slot.end <= m_slots[ best ].end )
+                continue;
+            size_t fixed = m_fixed[ slot.end ].first;
+            if( fixed + m_before[i].minLength + n.minLength > m_plan->maxWordLength() ||
+                fixed + m_before[i].maxLength + n.maxLength < m_plan->minWordLength() )
+                best = i;
+            else if( m_policy && !m_policy->canAccept( m_states[ m_fixed[ slot.end ].second ], m_before[i].classes | classes ) )
+                best = i;
+        }
+        //no subtree is out of range, only the current word
+        if( best == NONE )
+            return advance( 0 );
+        return skipSubtree( best );
+    }
+
+    //moves to the first state after all the states that differ from the current one
+    //only in the subtree of a slot and the subtrees in front of it
+    size_t skipSubtree( uint32_t index )
+    {
+        uint32_t i = 0;
+        while( i < index )
+        {
+            if( m_slots[i].end > index )
+            {
+                ++i;    //an ancestor
+                continue;
+            }
+            uint32_t oldEnd = m_slots[i].end;
+            setLast( i );
+            index = index - oldEnd + m_slots[i].end;
+            i = m_slots[i].end;
+        }
+        setLast( index );
+        return advance( 0 );
+    }
+
+    //puts a subtree into its last state. the slots are visited in preorder, an
+    //alternation switched to its last alternative is instantiated before its slots come
+    void setLast( uint32_t index )
+    {
+        for( uint32_t i = index; i < m_slots[ index ].end; ++i )
+        {
+            const Plan::Node& n = m_plan->node( m_slots[i].node );
+            if( n.type == Plan::eLeaf )
+                m_slots[i].digit = n.count - 1;
+            else if( n.type == Plan::eAlternation && m_slots[i].digit != n.count - 1 )
+            {
+                m_slots[i].digit = n.count - 1;
+                replaceAlternative( i );
+            }
+        }
+    }
+
+    //moves past the states in which a deduplicated producer repeats one of its
+    //earlier words. such a state is skipped with all the faster positions at once
+    size_t skipDuplicates( size_t changed )
+    {
+        size_t tail = m_leaves.size() - changed;
+        bool skipped = false;
+        for( size_t i = 0; i < m_duplicates.size() && !m_atEnd; ++i )
+        {
+            Duplicate d = m_duplicates[i];
+            if( d.firstLeaf >= m_leaves.size() - tail || isFirstOccurrence( d ) )
+                continue;
+            changed = advance( resetBefore( d.slot ) );
+            tail = min( tail, m_leaves.size() - changed );
+            skipped = true;
+            i = (size_t)-1;    //m_duplicates was rebuilt, check all of them again
+            if( m_limit != Plan::WORDS_OVERFLOW && !m_atEnd )
+            {
+                m_index = stateIndex( 0 );
+                if( m_index >= m_limit )
+                    break;
+            }
+        }
+        if( skipped && !m_atEnd && m_plan->words() != Plan::WORDS_OVERFLOW )
+            m_index = stateIndex( 0 );
+        return m_atEnd ? 0 : m_leaves.size() - tail;
+    }
+
+    bool isFirstOccurrence( const Duplicate& d )
+    {
+        size_t length;
+        render( length );
+        size_t count = m_leaves.size();
+        size_t begin = m_starts[ count - 1 - d.firstLeaf ];
+        size_t end = ( d.endLeaf < count ) ? m_starts[ count - 1 - d.endLeaf ] : m_word.size();
+        uint64_t first = m_plan->rank( m_slots[ d.slot ].node, m_word.data() + begin, end - begin );
+        return first == stateIndex( d.slot );
+    }
+
+    //puts the subtrees in front of a slot into their initial state and returns the
+    //first position of the slot. after a carry they already are, after a seek not
+    size_t resetBefore( uint32_t index )
+    {
+        uint32_t i = 0;
+        while( i < index )
+        {
+            Slot& s = m_slots[i];
+            const Plan::Node& n = m_plan->node( s.node );
+            if( n.type == Plan::eLeaf )
+                s.digit = 0;
+            if( s.end > index || n.type != Plan::eAlternation || s.digit == 0 )
+            {
+                ++i;
+                continue;
+            }
+            uint32_t oldEnd = s.end;
+            s.digit = 0;
+            replaceAlternative( i );
+            index = index - oldEnd + m_slots[i].end;
+            i = m_slots[i].end;
+        }
+        size_t leaf = 0;
+        while( leaf < m_leaves.size() && m_leaves[ leaf ] < index )
+            ++leaf;
+        return leaf;
+    }
+
+    //index of the word a subtree currently stands on. the subtrees of the slots are
+    //evaluated from the last slot back, so every child is done before its parent
+    uint64_t stateIndex( uint32_t index )
+    {
+        uint32_t end = m_slots[ index ].end;
+        m_stateIndexes.resize( end - index );
+        for( uint32_t k = end; k-- > index; )
+        {
+            const Slot& slot = m_slots[k];
+            const Plan::Node& n = m_plan->node( slot.node );
+            uint64_t result = 0;
+            if( n.type == Plan::eLeaf )
+                result = slot.digit;
+            else if( n.type == Plan::eAlternation )
+            {
+                for( uint32_t i = 0; i < slot.digit; ++i )
+                    result += m_plan->node( m_plan->child( n, i ) ).words;
+                result += m_stateIndexes[ k + 1 - index ];
+            }else
+            {
+                uint64_t radix = 1;
+                uint32_t child = k + 1;
+                for( uint32_t i = 0; i < n.count; ++i )
+                {
+                    result += m_stateIndexes[ child - index ] * radix;
+                    radix *= m_plan->node( m_plan->child( n, i ) ).words;
+                    child = m_slots[ child ].end;
+                }
+            }
+            m_stateIndexes[ k - index ] = result;
+        }
+        return m_stateIndexes[0];
+    }
+
+    //appends the state of a subtree positioned on its word number 'word' in preorder.
+    //m_open holds the slots whose subtrees are not complete yet
+    void instantiate( uint32_t nodeIndex, uint32_t parent, uint64_t word, vector< Slot >& slots )
+    {
+        m_open.clear();
+        openSlot( nodeIndex, parent, word, slots );
+        while( !m_open.empty() )
+        {
+            OpenSlot& open = m_open.back();
+            const Plan::Node& n = m_plan->node( slots[ open.slot ].node );
+            if( open.next == n.count )
+            {
+                slots[ open.slot ].end = (uint32_t)slots.size();
+                m_open.pop_back();
+                continue;
+            }
+            uint32_t child = m_plan->child( n, open.next );
+            uint64_t childWord = open.word;
+            if( n.type == Plan::eSequence )
+            {
+                uint64_t radix = m_plan->node( child ).words;
+                childWord = open.word % radix;
+                open.word /= radix;
+                ++open.next;
+            }else
+                open.next = n.count;
+            openSlot( child, open.slot, childWord, slots );
+        }
+    }
+
+    //appends the slot of a node, a leaf is complete at once. an alternation keeps
+    //only the alternative the word falls in and the word within it
+    void openSlot( uint32_t nodeIndex, uint32_t parent, uint64_t word, vector< Slot >& slots )
+    {
+        OpenSlot open;
+        open.slot = (uint32_t)slots.size();
+        open.next = 0;
+        Slot slot;
+        slot.node = nodeIndex;
+        slot.digit = 0;
+        slot.parent = parent;
+        slots.push_back( slot );
+
+        const Plan::Node& n = m_plan->node( nodeIndex );
+        if( n.type == Plan::eLeaf )
+        {
+            slots[ open.slot ].digit = (uint32_t)word;
+            slots[ open.slot ].end = (uint32_t)slots.size();
+            return;
+        }
+        if( n.type == Plan::eAlternation )
+        {
+            while( word >= m_plan->node( m_plan->child( n, open.next ) ).words )
+                word -= m_plan->node( m_plan->child( n, open.next++ ) ).words;
+            slots[ open.slot ].digit = open.next;
+        }
+        open.word = word;
+        m_open.push_back( open );
+    }
+
+    //swaps the subtree below an alternation for the initial state of its current alternative
+    void replaceAlternative( uint32_t alt )
+    {
+        uint32_t oldEnd = m_slots[ alt ].end;
+        const Plan::Node& n = m_plan->node( m_slots[ alt ].node );
+
+        m_scratch.clear();
+        m_scratch.insert( m_scratch.end(), m_slots.begin() + alt + 1, m_slots.end() );
+        m_slots.resize( alt + 1 );
+        instantiate( m_plan->child( n, m_slots[ alt ].digit ), alt, 0, m_slots );
+        uint32_t newEnd = (uint32_t)m_slots.size();
+        int delta = (int)newEnd - (int)oldEnd;
+
+        m_slots.insert( m_slots.end(), m_scratch.begin() + ( oldEnd - alt - 1 ), m_scratch.end() );
+        for( uint32_t i = 0; i < m_slots.size(); ++i )
+        {
+            if( i >= alt + 1 && i < newEnd )
+                continue;
+            Slot& s = m_slots[i];
+            if( s.end >= oldEnd )
+                s.end += delta;
+            if( s.parent != NONE && s.parent >= oldEnd )
+                s.parent += delta;
+        }
+        m_slots[ alt ].end = newEnd;
+        collectLeaves();
+    }
+
+    void collectLeaves()
+    {
+        m_leaves.clear();
+        m_duplicates.clear();
+        for( uint32_t i = 0; i < m_slots.size(); ++i )
+        {
+            const Plan::Node& n = m_plan->node( m_slots[i].node );
+            if( n.deduplicate )
+            {
+                Duplicate d;
+                d.slot = i;
+                d.firstLeaf = m_leaves.size();
+                m_duplicates.push_back( d );
+            }
+            if( n.type == Plan::eLeaf )
+                m_leaves.push_back( i );
+        }
+        //the subtree of a slot ends where the first leaf after it starts
+        for( size_t i = 0; i < m_duplicates.size(); ++i )
+        {
+            uint32_t end = m_slots[ m_duplicates[i].slot ].end;
+            size_t leaf = m_duplicates[i].firstLeaf;
+            while( leaf < m_leaves.size() && m_leaves[ leaf ] < end )
+                ++leaf;
+            m_duplicates[i].endLeaf = leaf;
+        }
+    }
+
+protected:
+    const Plan*         m_plan;
+    const Policy*       m_policy;
+    vector< Slot >      m_slots;
+    vector< Slot >      m_scratch;
+    vector< OpenSlot >  m_open;         //scratch of instantiate
+    vector< uint64_t >  m_stateIndexes; //scratch of stateIndex
+    vector< uint32_t >  m_leaves;
+    vector< Duplicate > m_duplicates;
+    bool                m_atEnd;
+    vector< char >      m_word;
+    vector< size_t >    m_starts;
+    size_t              m_cleanTail;    //trailing positions that m_word still holds
+    size_t              m_shared;       //bytes of m_word unchanged since the last word()
+    uint64_t            m_index;
+    uint64_t            m_limit;
+    vector< State >     m_states;       //the policy states of the tails of m_word
+    vector< char >      m_record;       //the word copied by the batch kernel, padded to whole chunks
+    uint64_t            m_batchIndex;   //no batch is possible before this index
+    vector< pair< size_t, size_t > >    m_fixed;    //scratch of skipFiltered
+    vector< Before >    m_before;
+};
+
+//enumerates the words of a Plan built with probabilities from the most likely one
+//down. every node of the plan is a stream of its words in non-increasing probability,
+//produced lazily: a leaf sorts its terminals, an alternation merges the streams of
+//its children and a sequence walks the products of the streams of its items with a
+//priority queue, where a candidate only steps the items from its pivot on, so every
+//combination is queued once. the streams keep the words their parents asked for,
+//the main stream only the current one. when the entries of the queues and streams
+//exceed the limit, the less likely half of the main queue is dropped and the output
+//ends where it would become incomplete
+class LikelyCursor{
+public:
+    static const size_t DEFAULT_MAX_ENTRIES = 8*1024*1024;
+    static const size_t MAX_DEPTH = 10000;  //levels of the plan, the streams are filled recursively
+
+    LikelyCursor() : m_plan( NULL ), m_atEnd( true ), m_truncated( false ), m_stoppedAtLimit( false ), m_minLogProb( -HUGE_VAL ),
+        m_dropped( -HUGE_VAL ), m_maxEntries( DEFAULT_MAX_ENTRIES ), m_entries( 0 ), m_order( 0 ), m_index( 0 )
+    {
+    }
+
+    //minLogProb: the words less likely than this are not generated
+    void reset( const Plan* plan, double minLogProb = -HUGE_VAL, size_t maxEntries = DEFAULT_MAX_ENTRIES )
+    {
+        assert( plan->hasProbabilities() );
+        m_plan = plan;
+        m_minLogProb = minLogProb;
+        m_maxEntries = maxEntries;
+        m_streams.clear();
+        m_streams.resize( plan->nodeCount() );
+        m_entries = 0;
+        m_order = 0;
+        m_index = 0;
+        m_truncated = false;
+        m_stoppedAtLimit = false;
+        m_dropped = -HUGE_VAL;
+        m_atEnd = false;
+        settle();
+    }
+
+    inline bool atEnd() const
+    {
+        return m_atEnd;
+    }
+
+    //the output stopped early at the limit of entries, the words of probability
+    //droppedBelow() and less may be missing
+    inline bool truncated() const
+    {
+        return m_truncated;
+    }
+
+    //the limit was reached with nothing left to drop, the output stopped after the
+    //words so far and any less likely one may be missing
+    inline bool stoppedAtLimit() const
+    {
+        return m_stoppedAtLimit;
+    }
+
+    inline double droppedBelow() const
+    {
+        return exp( m_dropped );
+    }
+
+    inline double logProbability() const
+    {
+        return logProbOf( m_plan->root(), m_index );
+    }
+
+    void next()
+    {
+        advance();
+        settle();
+    }
+
+    //renders the current word, the buffer is valid until the next call
+    const char* word( size_t& length )
+    {
+        m_word.clear();
+        render( m_plan->root(), m_index );
+        length = m_word.size();
+        return m_word.data();
+    }
+
+protected:
+    void advance()
+    {
+        uint32_t root = m_plan->root();
+        Stream& s = m_streams[ root ];
+        if( m_plan->node( root ).type != Plan::eLeaf )
+        {
+            //nobody else reads the words of the main stream
+            m_entries -= s.logProbs.size();
+            s.base += s.logProbs.size();
+            s.logProbs.clear();
+            s.refs.clear();
+        }
+        ++m_index;
+        if( m_entries > m_maxEntries )
+            dropCandidates();
+    }
+
+    struct Candidate{
+        double      logProb;
+        uint64_t    order;  //of the candidates with the same probability the first one queued comes first
+        uint32_t    ref;    //eAlternation: the alternative, eSequence: offset of its items in pool
+        uint32_t    index;  //eAlternation: the word of the alternative, eSequence: the pivot
+
+        bool operator < ( const Candidate& c ) const
+        {
+            return logProb < c.logProb || ( logProb == c.logProb && order > c.order );
+        }
+    };
+
+    //the words of a node produced so far, from the word number base on
+    struct Stream{
+        bool                started;
+        bool                uniform;    //eLeaf: all the terminals are equally likely
+        uint64_t            base;
+        vector< double >    logProbs;
+        vector< uint32_t >  refs;       //eLeaf: the terminal, eAlternation: the alternative and its word,
+                                        //eSequence: the word of every item
+        vector< Candidate > queue;      //a heap
+        vector< uint32_t >  pool;       //the words of the items of the queued sequence candidates
+        vector< uint32_t >  freeItems;  //unused offsets in pool
+
+        Stream() : started( false ), uniform( false ), base( 0 )
+        {
+        }
+    };
+
+    //moves to the next word that is likely enough and passes the filters of the plan
+    void settle()
+    {
+        uint32_t root = m_plan->root();
+        while( !m_atEnd )
+        {
+            bool found = fetch( root, m_index );
+            double logProb = found ? logProbOf( root, m_index ) : -HUGE_VAL;
+            if( !found || logProb < m_minLogProb || logProb < m_dropped )
+            {
+                //the dropped candidates led to words that would come now
+                m_atEnd = true;
+                m_truncated = ( m_dropped >= m_minLogProb && m_dropped > logProb );
+                break;
+            }
+            if( !m_plan->hasFilter() || passFilters() )
+                break;
+            advance();
+        }
+    }
+
+    bool passFilters()
+    {
+        size_t length;
+        const char* w = word( length );
+        if( length < m_plan->minWordLength() || length > m_plan->maxWordLength() )
+            return false;
+        const Policy* policy = m_plan->policy();
+        if( policy == NULL )
+            return true;
+        Policy::State state = policy->start();
+        policy->read( state, w, length );
+        return policy->accepts( state );
+    }
+
+    //frees the less likely half of the main queue, the words it would have led to are
+    //all as likely as the most likely dropped candidate or less
+    void dropCandidates()
+    {
+        uint32_t root = m_plan->root();
+        Stream& s = m_streams[ root ];
+        if( s.queue.size() >= 2 )
+        {
+            sort( s.queue.begin(), s.queue.end() );
+            size_t drop = s.queue.size() / 2;
+            m_dropped = max( m_dropped, s.queue[ drop - 1 ].logProb );
+            if( m_plan->node( root ).type == Plan::eSequence )
+            {
+                for( size_t i = 0; i < drop; ++i )
+                    s.freeItems.push_back( s.queue[i].ref );
+            }
+            s.queue.erase( s.queue.begin(), s.queue.begin() + drop );
+            make_heap( s.queue.begin(), s.queue.end() );
+            m_entries -= drop;
+        }
+        //the streams of the other nodes hold the rest, stop here
+        if( m_entries > m_maxEntries )
+        {
+            m_dropped = HUGE_VAL;
+            m_atEnd = true;
+            m_truncated = true;
+            m_stoppedAtLimit = true;
+        }
+    }
+
+    inline double logProbOf( uint32_t nodeIndex, uint64_t word ) const
+    {
+        const Stream& s = m_streams[ nodeIndex ];
+        if( s.uniform )
+            return m_plan->terminalLogProb( m_plan->node( nodeIndex ).first );
+        return s.logProbs[ word - s.base ];
+    }
+
+    //makes sure the stream of a node holds the word of the given number, false when
+    //the node has fewer words
+    bool fetch( uint32_t nodeIndex, uint64_t word )
+    {
+        Stream& s = m_streams[ nodeIndex ];
+        const Plan::Node& n = m_plan->node( nodeIndex );
+        if( !s.started )
+            start( nodeIndex );
+        if( n.type == Plan::eLeaf )
+            return word < n.count;
+        while( word >= s.base + s.logProbs.size() )
+        {
+            if( s.queue.empty() )
+                return false;
+            pop( nodeIndex );
+        }
+        return true;
+    }
+
+    void start( uint32_t nodeIndex )
+    {
+        Stream& s = m_streams[ nodeIndex ];
+        const Plan::Node& n = m_plan->node( nodeIndex );
+        s.started = true;
+        if( n.type == Plan::eLeaf )
+        {
+            s.uniform = true;
+            for( uint32_t i = 1; i < n.count && s.uniform; ++i )
+                s.uniform = ( m_plan->terminalLogProb( n.first + i ) == m_plan->terminalLogProb( n.first ) );
+            if( s.uniform )
+                return;
+            vector< pair< double, uint32_t > > sorted( n.count );
+            for( uint32_t i = 0; i < n.count; ++i )
+                sorted[i] = make_pair( -m_plan->terminalLogProb( n.first + i ), i );
+            sort( sorted.begin(), sorted.end() );
+            s.logProbs.resize( n.count );
+            s.refs.resize( n.count );
+            for( uint32_t i = 0; i < n.count; ++i )
+            {
+                s.logProbs[i] = -sorted[i].first;
+                s.refs[i] = sorted[i].second;
+            }
+            return;
+        }
+        if( n.type == Plan::eAlternation )
+        {
+            for( uint32_t i = 0; i < n.count; ++i )
+            {
+                if( fetch( m_plan->child( n, i ), 0 ) )
+                    push( s, m_plan->childLogProb( n, i ) + logProbOf( m_plan->child( n, i ), 0 ), i, 0 );
+            }
+            return;
+        }
+        double logProb = 0;
+        for( uint32_t i = 0; i < n.count; ++i )
+        {
+            if( !fetch( m_plan->child( n, i ), 0 ) )
+                return;
+            logProb += logProbOf( m_plan->child( n, i ), 0 );
+        }
+        uint32_t items = allocItems( s, n.count );
+        fill( s.pool.begin() + items, s.pool.begin() + items + n.count, 0 );
+        push( s, logProb, items, 0 );
+    }
+
+    inline void push( Stream& s, double logProb, uint32_t ref, uint32_t index )
+    {
+        Candidate c = { logProb, m_order++, ref, index };
+        s.queue.push_back( c );
+        push_heap( s.queue.begin(), s.queue.end() );
+        ++m_entries;
+    }
+
+    uint32_t allocItems( Stream& s, uint32_t count )
+    {
+        if( !s.freeItems.empty() )
+        {
+            uint32_t items = s.freeItems.back();
+            s.freeItems.pop_back();
+            return items;
+        }
+        s.pool.resize( s.pool.size() + count );
+        return (uint32_t)( s.pool.size() - count );
+    }
+
+    //moves the most likely candidate of a stream to its words and queues its successors
+    void pop( uint32_t nodeIndex )
+    {
+        Stream& s = m_streams[ nodeIndex ];
+        const Plan::Node& n = m_plan->node( nodeIndex );
+        pop_heap( s.queue.begin(), s.queue.end() );
+        Candidate c = s.queue.back();
+        s.queue.pop_back();
+        s.logProbs.push_back( c.logProb );
+        if( n.type == Plan::eAlternation )
+        {
+            s.refs.push_back( c.ref );
+            s.refs.push_back( c.index );
+            uint32_t alternative = m_plan->child( n, c.ref );
+            if( fetch( alternative, c.index + 1 ) )
+                push( s, m_plan->childLogProb( n, c.ref ) + logProbOf( alternative, c.index + 1 ), c.ref, c.index + 1 );
+            return;
+        }
+        s.refs.insert( s.refs.end(), s.pool.begin() + c.ref, s.pool.begin() + c.ref + n.count );
+        for( uint32_t i = c.index; i < n.count; ++i )
+        {
+            uint32_t item = m_plan->child( n, i );
+            if( !fetch( item, s.pool[ c.ref + i ] + 1 ) )
+                continue;
+            uint32_t items = allocItems( s, n.count );
+            copy( s.pool.begin() + c.ref, s.pool.begin() + c.ref + n.count, s.pool.begin() + items );
+            ++s.pool[ items + i ];
+            double logProb = 0;
+            for( uint32_t j = 0; j < n.count; ++j )
+                logProb += logProbOf( m_plan->child( n, j ), s.pool[ items + j ] );
+            push( s, logProb, items, i );
+        }
+        s.freeItems.push_back( c.ref );
+    }
+
+    //appends the text of a word of a node. the parts not rendered yet wait on
+    //m_pending, the next one on top
+    void render( uint32_t nodeIndex, uint64_t word )
+    {
+        m_pending.clear();
+        m_pending.push_back( make_pair( nodeIndex, word ) );
+        while( !m_pending.empty() )
+        {
+            nodeIndex = m_pending.back().first;
+            word = m_pending.back().second;
+            m_pending.pop_back();
+            const Stream& s = m_streams[ nodeIndex ];
+            const Plan::Node& n = m_plan->node( nodeIndex );
+            if( n.type == Plan::eLeaf )
+            {
+                uint32_t term = n.first + ( s.uniform ? (uint32_t)word : s.refs[ word ] );
+                m_word.insert( m_word.end(), m_plan->terminal( term ), m_plan->terminal( term ) + m_plan->terminalLength( term ) );
+            }else if( n.type == Plan::eAlternation )
+            {
+                size_t ref = ( word - s.base ) * 2;
+                m_pending.push_back( make_pair( m_plan->child( n, s.refs[ ref ] ), s.refs[ ref + 1 ] ) );
+            }else
+            {
+                size_t ref = ( word - s.base ) * n.count;
+                for( uint32_t i = n.count; i-- > 0; )
+                    m_pending.push_back( make_pair( m_plan->child( n, i ), s.refs[ ref + i ] ) );
+            }
+        }
+    }
+
+protected:
+    const Plan*         m_plan;
+    vector< Stream >    m_streams;      //of every node of the plan
+    bool                m_atEnd;
+    bool                m_truncated;
+    bool                m_stoppedAtLimit;
+    double              m_minLogProb;
+    double              m_dropped;      //the most likely candidate dropped at the limit
+    size_t              m_maxEntries;
+    size_t              m_entries;      //queued candidates and kept words of all the streams
+    uint64_t            m_order;
+    uint64_t            m_index;        //number of the current word in the main stream
+    vector< char >      m_word;
+    vector< pair< uint32_t, uint64_t > >    m_pending;  //scratch of render
+};
+
+//unsigned integer of arbitrary size, the keyspace of a grammar overflows 64 bits quickly
+class BigNumber{
+public:
+    BigNumber( uint64_t value = 0 )
+    {
+        while( value )
+        {
+            m_limbs.push_back( (uint32_t)value );
+            value >>= 32;
+        }
+    }
+
+    bool isZero() const
+    {
+        return m_limbs.empty();
+    }
+
+    BigNumber& operator += ( const BigNumber& other )
+    {
+        if( m_limbs.size() < other.m_limbs.size() )
+            m_limbs.resize( other.m_limbs.size(), 0 );
+        uint64_t carry = 0;
+        for( size_t i = 0; i < m_limbs.size(); ++i )
+        {
+            carry += m_limbs[i];
+            if( i < other.m_limbs.size() )
+                carry += other.m_limbs[i];
+            m_limbs[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if( carry )
+            m_limbs.push_back( (uint32_t)carry );
+        return *this;
+    }
+
+    BigNumber operator * ( const BigNumber& other ) const
+    {
+        BigNumber result;
+        if( isZero() || other.isZero() )
+            return result;
+        result.m_limbs.assign( m_limbs.size() + other.m_limbs.size(), 0 );
+        for( size_t i = 0; i < m_limbs.size(); ++i )
+        {
+            uint64_t carry = 0;
+            for( size_t j = 0; j < other.m_limbs.size(); ++j )
+            {
+                carry += (uint64_t)m_limbs[i] * other.m_limbs[j] + result.m_limbs[ i + j ];
+                result.m_limbs[ i + j ] = (uint32_t)carry;
+                carry >>= 32;
+            }
+            result.m_limbs[ i + other.m_limbs.size() ] = (uint32_t)carry;
+        }
+        result.trim();
+        return result;
+    }
+
+    bool toUint64( uint64_t& value ) const
+    {
+        if( m_limbs.size() > 2 )
+            return false;
+        value = 0;
+        for( size_t i = m_limbs.size(); i-- > 0; )
+            value = ( value << 32 ) | m_limbs[i];
+        return true;
+    }
+
+    double toDouble() const
+    {
+        double value = 0;
+        for( size_t i = m_limbs.size(); i-- > 0; )
+            value = value * 4294967296.0 + m_limbs[i];
+        return value;
+    }
+
+    string toString() const
+    {
+        if( isZero() )
+            return "0";
+        vector< uint32_t > limbs( m_limbs );
+        string text;
+        while( !limbs.empty() )
+        {
+            //divide by 10^9 and emit the remainder as 9 digits
+            uint64_t remainder = 0;
+            for( size_t i = limbs.size(); i-- > 0; )
+            {
+                uint64_t current = ( remainder << 32 ) | limbs[i];
+                limbs[i] = (uint32_t)( current / 1000000000 );
+                remainder = current % 1000000000;
+            }
+            while( !limbs.empty() && limbs.back() == 0 )
+                limbs.pop_back();
+            for( int i = 0; i < 9 && ( !limbs.empty() || remainder ); ++i )
+            {
+                text.push_back( (char)( '0' + remainder % 10 ) );
+                remainder /= 10;
+            }
+        }
+        reverse( text.begin(), text.end() );
+        return text;
+    }
+
+protected:
+    void trim()
+    {
+        while( !m_limbs.empty() && m_limbs.back() == 0 )
+            m_limbs.pop_back();
+    }
+
+protected:
+    vector< uint32_t > m_limbs; //least significant first
+};
+
+//computes the exact size of the keyspace and of the output without enumerating it.
+//every producer gets its count of words and a histogram of word lengths, memoized
+//per producer: a rule multiplies the numbers of its items, a producer sums its rules
+class KeyspaceCounter{
+public:
+    struct Stats{
+        BigNumber           words;
+        vector< BigNumber > lengths;   //count of words per word length
+    };
+    typedef map< Producer*, Stats > StatsMap;
+
+    const Stats& count( Producer* producer )
+    {
+        StatsMap::iterator found = m_stats.find( producer );
+        if( found != m_stats.end() )
+            return found->second;
+
+        Stats stats;
+        if( producer->isWordFile() )
+        {
+            stats.words = BigNumber( producer->wordCount() );
+            vector< uint64_t > lengths;
+            const char* word;
+            size_t pos = 0, length;
+            while( producer->nextWord( pos, word, length ) )
+            {
+                if( lengths.size() <= length )
+                    lengths.resize( length + 1 );
+                ++lengths[ length ];
+            }
+            stats.lengths.resize( lengths.size() );
+            for( size_t i = 0; i < lengths.size(); ++i )
+                stats.lengths[i] = BigNumber( lengths[i] );
+        }
+        for( size_t i = 0; i < producer->ruleCount(); ++i )
+        {
+            ProductRule items = producer->rule( i );
+            Stats rule;
+            rule.words = 1;
+            rule.lengths.push_back( 1 );
+            for( const Token* item = items.begin(); item != items.end(); ++item )
+            {
+                if( item->type() == Token::eProductor )
+                    combine( rule, count( item->producer() ) );
+                else
+                {
+                    Stats terminal;
+                    terminal.words = 1;
+                    terminal.lengths.resize( item->length() + 1 );
+                    terminal.lengths.back() = 1;
+                    combine( rule, terminal );
+                }
+            }
+            stats.words += rule.words;
+            if( stats.lengths.size() < rule.lengths.size() )
+                stats.lengths.resize( rule.lengths.size() );
+            for( size_t i = 0; i < rule.lengths.size(); ++i )
+                stats.lengths[i] += rule.lengths[i];
+        }
+        return m_stats[ producer ] = stats;
+    }
+
+    //bytes of output, every word followed by its separator
+    static BigNumber bytes( const Stats& stats )
+    {
+        BigNumber total;
+        for( size_t i = 0; i < stats.lengths.size(); ++i )
+        {
+            if( !stats.lengths[i].isZero() )
+                total += stats.lengths[i] * BigNumber( i + 1 );
+        }
+        return total;
+    }
+
+    const StatsMap& stats() const
+    {
+        return m_stats;
+    }
+
+protected:
+    //the histogram of a concatenation is the convolution of the histograms
+    static void combine( Stats& rule, const Stats& item )
+    {
+        vector< BigNumber > lengths( rule.lengths.size() + item.lengths.size() - 1 );
+        for( size_t i = 0; i < rule.lengths.size(); ++i )
+        {
+            if( rule.lengths[i].isZero() )
+                continue;
+            for( size_t j = 0; j < item.lengths.size(); ++j )
+            {
+                if( !item.lengths[j].isZero() )
+                    lengths[ i + j ] += rule.lengths[i] * item.lengths[j];
+            }
+        }
+        rule.lengths.swap( lengths );
+        rule.words = rule.words * item.words;
+    }
+
+protected:
+    StatsMap m_stats;
+};
+
+//rewrites the producers of a grammar into fewer levels before any engine sees them,
+//keeping the words, their order and their probabilities: a producer of a single rule
+//is inlined into the rules using it, a rule that is one producer is replaced by the
+//rules of that producer when it is used only there or is small, adjacent terminals
+//are joined and the tokens every rule of a producer starts with are hoisted in front
+//of a new producer of the rest. the first item changes fastest, so common trailing
+//tokens are hoisted only when they are terminals, which produce a single word.
+//a producer the plan renders into one table stays whole unless it is only another
+//name or only terminals. it runs before the terminals are bound, new terminal text
+//goes to the arena
+class RuleOptimizer{
+public:
+    static const size_t INLINE_RULES = 256; //a producer used more than once is inlined up to this many rules
+
+    RuleOptimizer( Producer::ProductorMap& producers, string& arena ) : m_producers( producers ), m_arena( arena ),
+        m_keepBytes( 0 )
+    {
+    }
+
+    //producers whose words take at most this many bytes are not inlined, see
+    //Plan::setMaterializeBytes
+    void setKeepBytes( size_t bytes )
+    {
+        m_keepBytes = bytes;
+    }
+
+    //order: the producers in dependency order, the main producer last. it is
+    //replaced by the producers still used, in dependency order
+    void optimize( vector< Producer* >& order )
+    {
+        //dependencies first, so every size is computed from sizes already known
+        m_sizes.clear();
+        for( size_t i = 0; i < order.size(); ++i )
+            m_sizes[ order[i] ] = measureRules( order[i] );
+        m_uses.clear();
+        m_uses[ order.back() ] = 1;
+        for( size_t i = 0; i < order.size(); ++i )
+        {
+            for( size_t r = 0; r < order[i]->ruleCount(); ++r )
+            {
+                ProductRule rule = order[i]->rule( r );
+                for( const Token* t = rule.begin(); t != rule.end(); ++t )
+                {
+                    if( t->producer() )
+                        ++m_uses[ t->producer() ];
+                }
+            }
+        }
+
+        vector< Producer* > optimized;
+        for( size_t i = 0; i < order.size(); ++i )
+        {
+            if( !order[i]->isWordFile() )
+                optimizeProducer( order[i], optimized );
+            optimized.push_back( order[i] );
+        }
+
+        //the producers that were inlined everywhere are left out
+        unordered_set< Producer* > used;
+        used.insert( optimized.back() );
+        order.clear();
+        for( size_t i = optimized.size(); i-- > 0; )
+        {
+            Producer* producer = optimized[i];
+            if( used.count( producer ) == 0 )
+                continue;
+            order.push_back( producer );
+            for( size_t r = 0; r < producer->ruleCount(); ++r )
+            {
+                ProductRule rule = producer->rule( r );
+                for( const Token* t = rule.begin(); t != rule.end(); ++t )
+                {
+                    if( t->producer() )
+                        used.insert( t->producer() );
+                }
+            }
+        }
+        reverse( order.begin(), order.end() );
+    }
+
+protected:
+    struct Rule{
+        vector< Token > tokens;
+        double          weight;
+    };
+
+    //the producers a producer uses are optimized before it
+    void optimizeProducer( Producer* producer, vector< Producer* >& order )
+    {
+        vector< Rule > rules;
+        for( size_t r = 0; r < producer->ruleCount(); ++r )
+        {
+            ProductRule items = producer->rule( r );
+            Rule rule;
+            rule.weight = producer->ruleWeight( r );
+            for( const Token* t = items.begin(); t != items.end(); ++t )
+            {
+                Producer* inner = t->producer();
+                if( inner && inner->ruleCount() == 1 && canInline( inner ) )
+                    inlineRule( inner, inner->rule( 0 ), rule.tokens );
+                else
+                    rule.tokens.push_back( *t );
+            }
+            //a rule that is one producer takes its rules, each as likely as before
+            Producer* inner = ( rule.tokens.size() == 1 ) ? rule.tokens[0].producer() : NULL;
+            if( inner && canInline( inner ) && ( m_uses[ inner ] == 1 || inner->ruleCount() <= INLINE_RULES ) )
+            {
+                double total = 0;
+                for( size_t i = 0; i < inner->ruleCount(); ++i )
+                    total += inner->ruleWeight( i );
+                for( size_t i = 0; i < inner->ruleCount(); ++i )
+                {
+                    Rule expanded;
+                    expanded.weight = rule.weight * inner->ruleWeight( i ) / total;
+                    inlineRule( inner, inner->rule( i ), expanded.tokens );
+                    rules.push_back( expanded );
+                }
+                continue;
+            }
+            rules.push_back( rule );
+        }
+        for( size_t r = 0; r < rules.size(); ++r )
+            joinTerminals( rules[r].tokens );
+        if( rules.size() > 1 )
+            hoist( producer, rules, order );
+        setRules( producer, rules );
+    }
+
+    bool canInline( Producer* producer )
+    {
+        if( producer->isWordFile() )
+            return false;
+        if( measure( producer ).second > m_keepBytes )
+            return true;
+        //another name, or terminals the plan merges into one leaf anyway
+        bool terminals = true;
+        for( size_t r = 0; r < producer->ruleCount() && terminals; ++r )
+        {
+            ProductRule rule = producer->rule( r );
+            terminals = ( rule.size() == 1 && rule.front().type() == Token::eTerminater );
+        }
+        return terminals || ( producer->ruleCount() == 1 && producer->rule( 0 ).size() == 1 );
+    }
+
+    //the words of a producer and their bytes, measured before the optimizer changed
+    //any rule. the optimizer does not change them
+    inline pair< uint64_t, uint64_t > measure( Producer* producer ) const
+    {
+        unordered_map< Producer*, pair< uint64_t, uint64_t > >::const_iterator found = m_sizes.find( producer );
+        assert( found != m_sizes.end() );
+        return found->second;
+    }
+
+    //the words and bytes of the rules of a producer, saturated like the plan counts
+    //them. the producers of the rules must be measured already
+    pair< uint64_t, uint64_t > measureRules( Producer* producer ) const
+    {
+        pair< uint64_t, uint64_t > size( producer->wordCount(), producer->wordsSize() );
+        for( size_t r = 0; r < producer->ruleCount(); ++r )
+        {
+            ProductRule rule = producer->rule( r );
+            uint64_t words = 1, bytes = 0;
+            for( const Token* t = rule.begin(); t != rule.end(); ++t )
+            {
+                pair< uint64_t, uint64_t > item( 1, t->length() );
+                if( t->producer() )
+                    item = measure( t->producer() );
+                bytes = Plan::addWords( Plan::mulWords( bytes, item.first ), Plan::mulWords( item.second, words ) );
+                words = Plan::mulWords( words, item.first );
+            }
+            size.first = Plan::addWords( size.first, words );
+            size.second = Plan::addWords( size.second, bytes );
+        }
+        return size;
+    }
+
+    //appends the tokens of a rule of another producer, which is used once less
+    void inlineRule( Producer* inner, const ProductRule& rule, vector< Token >& tokens )
+    {
+        for( const Token* t = rule.begin(); t != rule.end(); ++t )
+        {
+            tokens.push_back( *t );
+            if( t->producer() )
+                ++m_uses[ t->producer() ];
+        }
+        --m_uses[ inner ];
+    }
+
+    void joinTerminals( vector< Token >& tokens )
+    {
+        size_t out = 0;
+        for( size_t i = 0; i < tokens.size(); )
+        {
+            size_t end = i + 1;
+            if( tokens[i].type() == Token::eTerminater )
+            {
+                while( end < tokens.size() && tokens[ end ].type() == Token::eTerminater )
+                    ++end;
+            }
+            if( end - i == 1 )
+                tokens[ out++ ] = tokens[i];
+            else
+            {
+                string text;
+                for( size_t j = i; j < end; ++j )
+                    text.append( m_arena, tokens[j].offset(), tokens[j].length() );
+                tokens[ out++ ] = Token( m_arena.size(), (uint32_t)text.size() );
+                m_arena += text;
+            }
+            i = end;
+        }
+        tokens.erase( tokens.begin() + out, tokens.end() );
+    }
+
+    bool sameToken( const Token& a, const Token& b ) const
+    {
+        if( a.type() != b.type() )
+            return false;
+        if( a.type() == Token::eProductor )
+            return a.producer() == b.producer();
+        return a.length() == b.length() && m_arena.compare( a.offset(), a.length(), m_arena, b.offset(), b.length() ) == 0;
+    }
+
+    //turns the rules into prefix NEW suffix, every rule keeps at least one token in NEW
+    void hoist( Producer* producer, vector< Rule >& rules, vector< Producer* >& order )
+    {
+        size_t shortest = rules[0].tokens.size();
+        for( size_t r = 1; r < rules.size(); ++r )
+            shortest = min( shortest, rules[r].tokens.size() );
+        size_t prefix = 0, suffix = 0;
+        while( prefix + 1 < shortest && sameAt( rules, prefix, false ) )
+            ++prefix;
+        while( prefix + suffix + 1 < shortest && sameAt( rules, suffix, true ) &&
+            rules[0].tokens[ rules[0].tokens.size() - 1 - suffix ].type() == Token::eTerminater )
+            ++suffix;
+        if( prefix + suffix == 0 )
+            return;
+
+        Producer* rest = newProducer( producer->name() );
+        vector< Token > tokens( rules[0].tokens.begin(), rules[0].tokens.begin() + prefix );
+        tokens.push_back( Token( rest ) );
+        tokens.insert( tokens.end(), rules[0].tokens.end() - suffix, rules[0].tokens.end() );
+        for( size_t r = 0; r < rules.size(); ++r )
+        {
+            vector< Token >& items = rules[r].tokens;
+            for( size_t i = 0; i < items.size(); ++i )
+            {
+                if( ( i < prefix || i >= items.size() - suffix ) && items[i].producer() && r > 0 )
+                    --m_uses[ items[i].producer() ];
+            }
+            items.erase( items.end() - suffix, items.end() );
+            items.erase( items.begin(), items.begin() + prefix );
+        }
+        setRules( rest, rules );
+        m_uses[ rest ] = 1;
+        m_sizes[ rest ] = measureRules( rest );
+        order.push_back( rest );
+
+        rules.resize( 1 );
+        rules[0].tokens = tokens;
+        rules[0].weight = 1.0;
+    }
+
+    //the token at index in every rule is the same, counted from the end when fromEnd
+    bool sameAt( const vector< Rule >& rules, size_t index, bool fromEnd ) const
+    {
+        const vector< Token >& first = rules[0].tokens;
+        for( size_t r = 1; r < rules.size(); ++r )
+        {
+            const vector< Token >& items = rules[r].tokens;
+            if( fromEnd ? !sameToken( first[ first.size() - 1 - index ], items[ items.size() - 1 - index ] ) :
+                !sameToken( first[ index ], items[ index ] ) )
+                return false;
+        }
+        return true;
+    }
+
+    //the weights are scaled to a largest one of 1, rules of equal weight need none
+    void setRules( Producer* producer, const vector< Rule >& rules )
+    {
+        double largest = 0;
+        for( size_t r = 0; r < rules.size(); ++r )
+            largest = max( largest, rules[r].weight );
+        producer->clearRules();
+        for( size_t r = 0; r < rules.size(); ++r )
+            producer->addRule( rules[r].tokens, rules[r].weight / largest );
+    }
+
+    //a producer named after another one that no rule uses yet
+    Producer* newProducer( const string& base )
+    {
+        char suffix[32];
+        for( unsigned i = 1; ; ++i )
+        {
+            snprintf( suffix, sizeof( suffix ), "_%u", i );
+            string name = base + suffix;
+            if( m_producers.find( name ) != m_producers.end() )
+                continue;
+            Producer& producer = m_producers[ name ];
+            producer.setName( name );
+            return &producer;
+        }
+    }
+
+    Producer::ProductorMap&     m_producers;
+    string&                     m_arena;
+    size_t                      m_keepBytes;
+    unordered_map< Producer*, size_t >  m_uses;
+    unordered_map< Producer*, pair< uint64_t, uint64_t > >  m_sizes;
+};
+
+class Crunchx{
+public:
+    static const size_t MAX_REFERENCE_DEPTH = 10000;  //producer levels the recursive -r tree can nest
+
+    Crunchx() : m_rules(0),m_rulesLength(0),m_status( eIdle ),
+        m_rulesAnalysisIndex(NULL),m_lineCount(0),m_mainProductor( NULL ),m_mainProducer( NULL ),
+        m_useReference( false ), m_optimizeRules( true ), m_referenceIndex( 0 )
+    {
+    }
+
+    ~Crunchx()
+    {
+        cleanup();
+    }
+
+
+    //the rules file is mapped instead of read, so its size is not limited
+    ErrorMan::ErrorCode openRulesFile( const char* fileName )
+    {
+        releaseRules();
+        releaseAnalysis();
+        m_status = eIdle;
+        ErrorMan::ErrorCode err = m_rulesFile.open( fileName );
+        if( err != ErrorMan::eOk )
+            return err;
+        m_rules = m_rulesFile.data();
+        m_rulesLength = m_rulesFile.size();
+        m_rulesAnalysisIndex = m_rules;
+        m_status = eBuffIsSet;
+        return ErrorMan::eOk;
+    }
+
+    ErrorMan::ErrorCode saveRulesFile( const char* fileName )
+    {
+        if( m_status == eIdle )
+            return ErrorMan::eInvalidRules;
+        FILE* fRules = fopen( fileName, "w+" );
+        if( fRules == NULL )
+            return ErrorMan::eCanNotOpenFile;
+        size_t writeCount = fwrite( m_rules, 1, m_rulesLength, fRules );
+        fclose( fRules );
+        if( writeCount == m_rulesLength )
+            return ErrorMan::eOk;
+        else
+            return ErrorMan::eWriteFileErr;
+    }
+
+    ErrorMan::ErrorCode setRules( const char* rules, const size_t length )
+    {
+        releaseRules();
+        releaseAnalysis();
+        m_rulesBuffer.assign( rules, length );
+        m_rules = m_rulesBuffer.data();
+        m_rulesLength = length;
+        m_rulesAnalysisIndex = m_rules;
+        m_status = eBuffIsSet;
+        return ErrorMan::eOk;
+    }
+
+    void cleanup()
+    {
+        releaseRules();
+        releaseAnalysis();
+    }
+
+    //generate with the ProducerReference tree instead of the compiled plan,
+    //slow but kept as the reference implementation. it recurses once per level of
+    //producers, so rules nested deeper than MAX_REFERENCE_DEPTH are refused
+    void setUseReference( bool use )
+    {
+        m_useReference = use;
+    }
+
+    //sub-producers up to this many bytes of words become a single leaf of the plan
+    void setMaterializeBytes( size_t bytes )
+    {
+        m_plan.setMaterializeBytes( bytes );
+    }
+
+    void setAmbiguityMode( Plan::AmbiguityMode mode )
+    {
+        m_plan.setAmbiguityMode( mode );
+    }
+
+    //rewrite the producers with RuleOptimizer before generating, on by default.
+    //set it before analysis
+    void setOptimizeRules( bool optimize )
+    {
+        m_optimizeRules = optimize;
+    }
+
+    //only the words of this length range are generated, set it before analysis
+    void setLengthRange( size_t minLength, size_t maxLength )
+    {
+        m_plan.setLengthRange( minLength, maxLength );
+    }
+
+    //the plan keeps the probabilities of the words for LikelyCursor, set it before analysis
+    void setProbabilities( bool probabilities )
+    {
+        m_plan.setProbabilities( probabilities );
+    }
+
+    //only the words satisfying the policy are generated, set it before analysis
+    bool setPolicy( const char* spec )
+    {
+        Policy policy;
+        string message;
+        if( !policy.parse( spec, message ) )
+        {
+            m_error.setError( ErrorMan::eInvalidParam, message );
+            return false;
+        }
+        m_plan.setPolicy( policy );
+        return true;
+    }
+
+    bool atEnd()
+    {
+        if( !m_useReference )
+            return m_cursor.atEnd();
+        assert( m_mainProductor != NULL );
+        return ( m_mainProductor == NULL || m_mainProductor->atEnd() );
+    }
+
+    bool analysis()
+    {
+        m_lineCount = 0;
+        m_arena.reserve( m_arena.size() + m_rulesLength );
+        while ( analysisProducer() )
+            ;
+
+        if( m_error.isErrorOccured() )
+            return false;
+
+        return analysisDependence();
+    }
+
+    void makeNextProduct()
+    {
+        if( atEnd() )
+            return;
+        if( !m_useReference )
+        {
+            m_cursor.next();
+            return;
+        }
+        ++m_referenceIndex;
+        return m_mainProductor->makeNextProduct();
+    }
+
+    //index of the current word in the keyspace, it skips the duplicates removed
+    //while generating
+    uint64_t index() const
+    {
+        return m_useReference ? m_referenceIndex : m_cursor.index();
+    }
+
+    //writes the words up to the end of the first position in one go, see
+    //Cursor::nextBatch. 0 with the reference producers
+    size_t nextBatch( char* out, size_t room, uint64_t maxWords, const char* separator, size_t& bytes )
+    {
+        return m_useReference ? 0 : m_cursor.nextBatch( out, room, maxWords, separator, bytes );
+    }
+
+    //the current word without copying it, the buffer stays valid until the next call.
+    //shared counts the trailing bytes it surely has in common with the word before
+    const char* word( size_t& length, size_t& shared )
+    {
+        if( atEnd() )
+            return NULL;
+        if( !m_useReference )
+            return m_cursor.word( length, shared );
+        shared = 0;
+        m_word.clear();
+        if( !m_mainProductor->product( m_word ) )
+            return NULL;
+        length = m_word.size();
+        return m_word.data();
+    }
+
+    const Plan& plan() const
+    {
+        return m_plan;
+    }
+
+    const ErrorMan& error() const
+    {
+        return m_error;
+    }
+
+    void setError( int errCode, const string& errMesg )
+    {
+        m_error.setError( errCode, errMesg );
+    }
+
+    Producer* mainProducer()
+    {
+        return m_mainProducer;
+    }
+
+    //the producers in dependency order, the main producer last
+    const vector< Producer* >& order() const
+    {
+        return m_order;
+    }
+
+    //FNV-1a of the rules text, identifies the rules of a checkpoint
+    uint64_t rulesHash() const
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for( size_t i = 0; i < m_rulesLength; ++i )
+        {
+            hash ^= (unsigned char)m_rules[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    //continues with the word of the given index, only the compiled plan supports it.
+    //the words from limit on are not wanted
+    bool seek( uint64_t index, uint64_t limit )
+    {
+        if( m_useReference || index >= m_plan.words() )
+            return false;
+        m_cursor.seek( &m_plan, index, limit );
+        return true;
+    }
+
+    bool product( string& str )
+    {
+        if( atEnd() )
+            return false;
+        if( !m_useReference )
+        {
+            m_cursor.product( str );
+            return true;
+        }
+        str.clear();
+        return m_mainProductor->product( str );
+    }
+
+protected:
+    void releaseRules()
+    {
+        m_rulesFile.close();
+        m_rulesBuffer.clear();
+        m_rules = m_rulesBuffer.data();
+        m_rulesLength = 0;
+        m_rulesAnalysisIndex = NULL;
+    }
+
+    //drops the producers, terminals and errors of the rules analysed before, so new
+    //rules start over. the settings of the plan are kept, build replaces the rest
+    void releaseAnalysis()
+    {
+        delete m_mainProductor;
+        m_mainProductor = NULL;
+        m_mainProducer = NULL;
+        m_order.clear();
+        m_producers.clear();
+        m_arena.clear();
+        m_wordFiles.clear();
+        m_error = ErrorMan();
+        m_referenceIndex = 0;
+    }
+
+    //the producer of the given name, created when it is seen for the first time
+    Producer* internProducer( const string& name )
+    {
+        Producer& producer = m_producers[ name ];
+        if( producer.name().empty() )
+            producer.setName( name );
+        return &producer;
+    }
+
+    void addToken( bool quoted )
+    {
+        if( quoted )
+        {
+            m_ruleTokens.push_back( Token( m_arena.size(), (uint32_t)m_element.size() ) );
+            m_arena += m_element;
+        }else
+            m_ruleTokens.push_back( Token( internProducer( m_element ) ) );
+        m_element.clear();
+    }
+
+    //reads the rest of an @file("name") element and returns the producer of the
+    //words of the file, the same file is mapped only once. NULL for invalid grammar,
+    //or with the error set when the file can not be used
+    Producer* readWordFile( const char*& p, const char* endLine )
+    {
+        static const char KEYWORD[] = "file(";
+        size_t keywordLength = sizeof( KEYWORD ) - 1;
+        if( (size_t)( endLine - p ) < keywordLength || memcmp( p, KEYWORD, keywordLength ) != 0 )
+            return NULL;
+        const char* q = p + keywordLength;
+        while( q < endLine && *q == ' ' )
+            ++q;
+        if( q >= endLine || ( *q != '\'' && *q != '"' ) )
+            return NULL;
+        const char* close = (const char*)memchr( q + 1, *q, endLine - q - 1 );
+        if( close == NULL || close == q + 1 )
+            return NULL;
+        string fileName( q + 1, close );
+        q = close + 1;
+        while( q < endLine && *q == ' ' )
+            ++q;
+        if( q >= endLine || *q != ')' )
+            return NULL;
+        p = q + 1;
+
+        Producer* producer = internProducer( "@file(\"" + fileName + "\")" );
+        if( producer->isDefined() )
+            return producer;
+        m_wordFiles.emplace_back();
+        MappedFile& file = m_wordFiles.back();
+        if( file.open( fileName.c_str() ) != ErrorMan::eOk )
+        {
+            m_error.setError( ErrorMan::eCanNotOpenFile, "can not open word file:" + fileName );
+            return NULL;
+        }
+        //the plan numbers its terminals and their lengths with 32 bits
+        uint64_t count = 0;
+        size_t maxLength = 0;
+        const char* word;
+        size_t pos = 0, length;
+        while( Producer::nextLine( file.data(), file.size(), pos, word, length ) )
+        {
+            maxLength = max( maxLength, length );
+            ++count;
+        }
+        if( count == 0 || count > 0xffffffff || maxLength > 0xffffffff )
+        {
+            m_error.setError( ErrorMan::eInvalidRules, "no words or too many words in word file:" + fileName );
+            return NULL;
+        }
+        producer->setWords( file.data(), file.size(), count );
+        return producer;
+    }
+
+    //reads the number of a rule weight @0.7 behind the '@', false when it is not a
+    //positive number
+    static bool readWeight( const char*& p, const char* endLine, double& weight )
+    {
+        string number;
+        while( p < endLine && ( isdigit( (unsigned char)*p ) || strchr( ".eE+-", *p ) ) )
+            number.push_back( *( p++ ) );
+        char* last;
+        weight = strtod( number.c_str(), &last );
+        return !number.empty() && *last == 0 && weight > 0 && weight <= DBL_MAX;
+    }
+
+    //parses one line of the rules. the text is not terminated, every read is bounded
+    //by the end of the line
+    bool analysisProducer()
+    {
+        const char* rulesEnd = m_rules + m_rulesLength;
+        if( m_error.isErrorOccured() ||
+            m_rulesAnalysisIndex == NULL || m_rulesAnalysisIndex >= rulesEnd )
+        {
+
+            return false;
+        }
+
+        ++m_lineCount;
+        const char* beginLine = m_rulesAnalysisIndex;
+        const char* endLine = (const char*)memchr( beginLine, '\n', rulesEnd - beginLine );
+        if( endLine == NULL )
+            endLine = rulesEnd;
+        m_rulesAnalysisIndex = ( endLine < rulesEnd ) ? endLine + 1 : rulesEnd;
+
+        bool invalidGrammar = false;
+        bool quoted = false;
+        bool weighted = false;  //the weight ends the rule
+        double weight = 1.0;
+        Producer* producer = NULL;
+        m_name.clear();
+        m_element.clear();
+        m_ruleTokens.clear();
+        char pair = 0;
+        enum ReadStatus{ eReadName, eReadElement, eReadStringPair, eReadEndElement };
+        ReadStatus s = eReadName;
+        const char* p = beginLine;
+        while( p < endLine )
+        {
+            char c = *( p++ );
+            if( c == '\r' || c == '\t' )
+                continue;
+            bool processRule = false;
+            if( eReadName == s )
+            {
+                if( c == ':' )
+                {
+                    s = eReadElement;
+                    producer = internProducer( m_name );
+                }else if( c == '#' )
+                {
+                    if( m_name.empty() )
+                        return true;//skip comment line
+                }else if( c != ' ' )
+                    m_name.push_back( c );
+            }else if( eReadElement == s )
+            {
+                if( weighted && c != ' ' && c != ',' )
+                {
+                    invalidGrammar = true;
+                    break;
+                }
+                if( c == '\'' || c == '"' )
+                {
+                    pair = c;
+                    s = eReadStringPair;
+                    quoted = true;
+                }else if( c == ',' )
+                {
+                    processRule = true;
+                }else if( c == '@' && m_element.empty() && p < endLine && ( isdigit( (unsigned char)*p ) || *p == '.' ) )
+                {
+                    if( m_ruleTokens.empty() || !readWeight( p, endLine, weight ) )
+                    {
+                        invalidGrammar = true;
+                        break;
+                    }
+                    weighted = true;
+                }else if( c == '@' && m_element.empty() )
+                {
+                    Producer* wordFile = readWordFile( p, endLine );
+                    if( wordFile == NULL )
+                    {
+                        if( m_error.isErrorOccured() )
+                            return false;
+                        invalidGrammar = true;
+                        break;
+                    }
+                    m_ruleTokens.push_back( Token( wordFile ) );
+                }else
+                {
+                    if( m_element.empty() && c == ' ' )//skip space
+                        continue;
+
+                    if( c != ' ' )
+                    {
+                        m_element.push_back( c );
+                        continue;
+                    }
+
+                    if( m_element.size() )
+                    {
+                        addToken( quoted );
+                        quoted = false;
+                    }
+                }
+            }else if( eReadStringPair == s )
+            {
+                //copy the plain run up to the closing quote at once
+                const char* close = (const char*)memchr( p - 1, pair, endLine - ( p - 1 ) );
+                const char* run = close ? close : endLine;
+                if( memchr( p - 1, '\r', run - ( p - 1 ) ) == NULL && memchr( p - 1, '\t', run - ( p - 1 ) ) == NULL )
+                {
+                    m_element.append( p - 1, run );
+                    p = run;
+                    if( close )
+                    {
+                        ++p;
+                        pair = 0;
+                        s = eReadEndElement;
+                    }
+                }else if( c == pair )
+                {
+                    pair = 0;
+                    s = eReadEndElement;
+                }else
+                    m_element.push_back( c );
+            }else if( eReadEndElement == s )
+            {
+                if( c == ' ' )
+                    continue;
+                if( c == ',' )
+                {
+                    processRule = true;
+                }else if( c == '@' )
+                {
+                    //read it again as the start of an element
+                    addToken( quoted );
+                    quoted = false;
+                    --p;
+                }else
+                {
+                    addToken( quoted );
+                    quoted = false;
+                    m_element.push_back( c );
+                }
+                s = eReadElement;
+            }
+            if( processRule )
+            {
+                if( !m_element.empty() )
+                    addToken( quoted );
+                if( m_ruleTokens.empty() )
+                {
+                    invalidGrammar = true;
+                    break;
+                }
+                producer->addRule( m_ruleTokens, weight );
+                m_ruleTokens.clear();
+                m_element.clear();
+                quoted = false;
+                weighted = false;
+                weight = 1.0;
+            }
+        }
+
+        if( eReadName == s && m_name.empty() ) //empty line
+            return true;
+        else if( ( eReadElement != s && eReadEndElement != s ) || invalidGrammar )
+        {
+            const char* cut = beginLine;
+            while( cut < endLine && *cut != '\r' )
+                ++cut;
+            string err = "invalid grammar in line:";
+            err.append( beginLine, cut );
+            m_error.setError( ErrorMan::eInvalidGrammar, err );
+            return false;
+        }
+
+        if( !m_element.empty() )
+            addToken( quoted );
+        if( !m_ruleTokens.empty() )
+            producer->addRule( m_ruleTokens, weight );
+        return true;
+    }
+
+    //orders the producers PRODUCER depends on so that every producer comes after
+    //the producers of its rules, PRODUCER last. iterative, deep grammars do not
+    //overflow the stack
+    bool analysisDependence()
+    {
+        Producer::ProductorMap::iterator found = m_producers.find( "PRODUCER" );
+        Producer* mainProducer = ( found == m_producers.end() ) ? NULL : &found->second;
+        if( mainProducer == NULL || !mainProducer->isDefined() )
+        {
+            m_error.setError( ErrorMan::eMisc, "can not find main producer:PRODUCER" );
+            return false;
+        }
+
+        enum Color{ eWhite, eGray, eBlack };
+        struct Frame{
+            Producer*   producer;
+            size_t      rule;
+            size_t      item;
+        };
+        unordered_map< Producer*, Color > color;
+        vector< Frame > stack;
+        m_order.clear();
+        Frame root = { mainProducer, 0, 0 };
+        stack.push_back( root );
+        color[ mainProducer ] = eGray;
+        while( !stack.empty() )
+        {
+            Frame& top = stack.back();
+            Producer* next = NULL;
+            while( top.rule < top.producer->ruleCount() && next == NULL )
+            {
+                ProductRule rule = top.producer->rule( top.rule );
+                if( top.item >= rule.size() )
+                {
+                    ++top.rule;
+                    top.item = 0;
+                    continue;
+                }
+                next = rule.begin()[ top.item++ ].producer();
+            }
+            if( next == NULL )
+            {
+                color[ top.producer ] = eBlack;
+                m_order.push_back( top.producer );
+                stack.pop_back();
+                continue;
+            }
+            if( !next->isDefined() )
+            {
+                m_error.setError( ErrorMan::eNosuchProducer, "can not found producer:" + next->name() );
+                return false;
+            }
+            Color& c = color[ next ];
+            if( c == eGray )
+            {
+                string err = "producer " + next->name() + " can not be instantiation";
+                m_error.setError( ErrorMan::eMisc, err );
+                return false;
+            }
+            if( c == eWhite )
+            {
+                c = eGray;
+                Frame frame = { next, 0, 0 };
+                stack.push_back( frame );
+            }
+        }
+        if( m_optimizeRules )
+        {
+            RuleOptimizer optimizer( m_producers, m_arena );
+            optimizer.setKeepBytes( m_plan.materializeBytes() );
+            optimizer.optimize( m_order );
+        }
+        Producer::ProductorMap::iterator iter = m_producers.begin();
+        for( ; iter != m_producers.end(); ++iter )
+            iter->second.bind( m_arena.data() );
+        if( m_useReference )
+        {
+            size_t depth = referenceDepth();
+            if( depth > MAX_REFERENCE_DEPTH )
+            {
+                char err[128];
+                snprintf( err, sizeof( err ), "the producers nest %llu levels deep, the reference generates up to %llu",
+                    (unsigned long long)depth, (unsigned long long)MAX_REFERENCE_DEPTH );
+                m_error.setError( ErrorMan::eInvalidGrammar, err );
+                return false;
+            }
+            m_mainProductor = new ProducerReference( mainProducer );
+        }
+        m_mainProducer = mainProducer;
+        m_plan.build( m_order );
+        m_cursor.reset( &m_plan );
+        m_referenceIndex = 0;
+        return true;
+    }
+
+    //levels of producers from the main one down, measured along m_order, dependencies first
+    size_t referenceDepth() const
+    {
+        unordered_map< Producer*, size_t > depths;
+        for( size_t i = 0; i < m_order.size(); ++i )
+        {
+            size_t depth = 1;
+            for( size_t r = 0; r < m_order[i]->ruleCount(); ++r )
+            {
+                ProductRule rule = m_order[i]->rule( r );
+                for( const Token* t = rule.begin(); t != rule.end(); ++t )
+                {
+                    if( t->producer() )
+                        depth = max( depth, depths[ t->producer() ] + 1 );
+                }
+            }
+            depths[ m_order[i] ] = depth;
+        }
+        return m_order.empty() ? 0 : depths[ m_order.back() ];
+    }
+private:
+    enum Status{ eIdle, eBuffIsSet, eRulesIsValid };
+    const char* m_rules;    //the rules text, in m_rulesFile or m_rulesBuffer
+    size_t  m_rulesLength;
+    MappedFile  m_rulesFile;
+    string  m_rulesBuffer;
+    list< MappedFile > m_wordFiles; //the files of the @file producers
+    Producer::ProductorMap m_producers;
+    string  m_arena;    //the text of all the terminals
+    ErrorMan    m_error;
+    Status  m_status;
+    const char* m_rulesAnalysisIndex;
+    size_t  m_lineCount;
+    ProducerReference* m_mainProductor;
+    Producer*   m_mainProducer;
+    vector< Producer* > m_order;    //the producers in dependency order
+    string  m_name;                 //parser scratch
+    string  m_element;
+    vector< Token > m_ruleTokens;
+    bool    m_useReference;
+    bool    m_optimizeRules;
+    uint64_t    m_referenceIndex;
+    string  m_word;
+    Plan    m_plan;
+    Cursor  m_cursor;
+};
+
+Generator::Generator() : m_crunchx( new Crunchx ), m_ready( false )
+{
+}
+
+Generator::~Generator()
+{
+    delete m_crunchx;
+}
+
+void Generator::setDeduplicate( bool deduplicate )
+{
+    m_crunchx->setAmbiguityMode( deduplicate ? Plan::eAmbiguityRemove : Plan::eAmbiguityIgnore );
+}
+
+void Generator::setLengthRange( size_t minLength, size_t maxLength )
+{
+    m_crunchx->setLengthRange( minLength, maxLength );
+}
+
+bool Generator::setPolicy( const char* spec )
+{
+    return m_crunchx->setPolicy( spec );
+}
+
+bool Generator::setRules( const char* rules, size_t length )
+{
+    m_ready = ( m_crunchx->setRules( rules, length ) == ErrorMan::eOk && m_crunchx->analysis() );
+    return m_ready;
+}
+
+bool Generator::openRules( const char* fileName )
+{
+    ErrorMan::ErrorCode err = m_crunchx->openRulesFile( fileName );
+    if( err != ErrorMan::eOk )
+    {
+        m_crunchx->setError( err, string( "can not open file:" ) + fileName );
+        m_ready = false;
+        return false;
+    }
+    m_ready = m_crunchx->analysis();
+    return m_ready;
+}
+
+const string& Generator::errorMessage() const
+{
+    return m_crunchx->error().errorMessage();
+}
+
+int Generator::errorCode() const
+{
+    return m_crunchx->error().errorCode();
+}
+
+uint64_t Generator::words() const
+{
+    return m_ready ? m_crunchx->plan().words() : 0;
+}
+
+size_t Generator::maxLength() const
+{
+    return m_ready ? m_crunchx->plan().node( m_crunchx->plan().root() ).maxLength : 0;
+}
+
+bool Generator::seek( uint64_t index )
+{
+    return m_ready && m_crunchx->seek( index, WORDS_OVERFLOW );
+}
+
+uint64_t Generator::index() const
+{
+    return m_ready ? m_crunchx->index() : 0;
+}
+
+bool Generator::atEnd() const
+{
+    return !m_ready || m_crunchx->atEnd();
+}
+
+size_t Generator::next( char* buffer, size_t size, size_t* offsets, size_t maxWords )
+{
+    size_t count = 0;
+    size_t used = 0;
+    while( m_ready && count < maxWords && !m_crunchx->atEnd() )
+    {
+        size_t bytes;
+        size_t words = m_crunchx->nextBatch( buffer + used, size - used, maxWords - count, NULL, bytes );
+        if( words )
+        {
+            size_t length = bytes / words;
+            for( size_t i = 0; i < words; ++i )
+                offsets[ count++ ] = used + i * length;
+            used += bytes;
+            continue;
+        }
+        size_t length;
+        size_t shared;
+        const char* word = m_crunchx->word( length, shared );
+        if( word == NULL || length > size - used )
+            break;
+        memcpy( buffer + used, word, length );
+        offsets[ count++ ] = used;
+        used += length;
+        m_crunchx->makeNextProduct();
+    }
+    offsets[ count ] = used;
+    return count;
+}
+
+//the compact wordlist format. consecutive words share their tail because the first
+//position changes fastest, so every word is stored as the length of the tail it
+//shares with the word before and the bytes in front of it.
+//file:  "CRUNCHXB", u32 version, u32 words per block, blocks, index, trailer
+//block: u32 words, u32 bytes of entries, entries, the first entry holds a whole word
+//entry: a byte with the shared tail in the high and the length of the head in the low
+//nibble, a nibble of 15 is followed by a varint holding the rest of that length, head
+//index: u64 offset and u64 number of the first word of every block
+//trailer: u64 offset of the index, u64 blocks, u64 words, "CRUNCHXB"
+//integers are little endian
+class BlockFormat{
+public:
+    static const uint32_t   VERSION         = 1;
+    static const uint32_t   BLOCK_WORDS     = 4096;
+    static const size_t     HEADER_SIZE     = 16;
+    static const size_t     BLOCK_HEADER    = 8;
+    static const size_t     TRAILER_SIZE    = 32;
+    static const size_t     MAX_VARINT      = 10;
+
+    struct Block{
+        uint64_t    offset;
+        uint64_t    firstWord;
+    };
+
+    static const char* magic()
+    {
+        return "CRUNCHXB";
+    }
+
+    //the most bytes a word of the given length can take, with the header of a new block
+    static inline size_t maxEntry( size_t length )
+    {
+        return BLOCK_HEADER + 1 + 2 * MAX_VARINT + length;
+    }
+
+    static inline char* putEntry( char* out, size_t shared, const char* head, size_t headLength )
+    {
+        size_t highNibble = min( shared, (size_t)15 );
+        size_t lowNibble = min( headLength, (size_t)15 );
+        *out++ = (char)( ( highNibble << 4 ) | lowNibble );
+        if( highNibble == 15 )
+            out = putVarint( out, shared - 15 );
+        if( lowNibble == 15 )
+            out = putVarint( out, headLength - 15 );
+        memcpy( out, head, headLength );
+        return out + headLength;
+    }
+
+    //NULL when the entry runs past end, head points into the entry
+    static inline const char* getEntry( const char* in, const char* end, uint64_t& shared, uint64_t& headLength )
+    {
+        if( in >= end )
+            return NULL;
+        unsigned char nibbles = (unsigned char)*in++;
+        shared = nibbles >> 4;
+        headLength = nibbles & 15;
+        uint64_t rest;
+        if( shared == 15 && ( in = getVarint( in, end, rest ) ) != NULL )
+            shared += rest;
+        if( in != NULL && headLength == 15 && ( in = getVarint( in, end, rest ) ) != NULL )
+            headLength += rest;
+        if( in == NULL || headLength > (uint64_t)( end - in ) )
+            return NULL;
+        return in;
+    }
+
+    static inline void putU32( char* out, uint32_t value )
+    {
+        for( int i = 0; i < 4; ++i )
+            out[i] = (char)( value >> ( 8 * i ) );
+    }
+
+    static inline void putU64( char* out, uint64_t value )
+    {
+        for( int i = 0; i < 8; ++i )
+            out[i] = (char)( value >> ( 8 * i ) );
+    }
+
+    static inline uint32_t getU32( const char* in )
+    {
+        uint32_t value = 0;
+        for( int i = 3; i >= 0; --i )
+            value = ( value << 8 ) | (unsigned char)in[i];
+        return value;
+    }
+
+    static inline uint64_t getU64( const char* in )
+    {
+        uint64_t value = 0;
+        for( int i = 7; i >= 0; --i )
+            value = ( value << 8 ) | (unsigned char)in[i];
+        return value;
+    }
+
+    static inline char* putVarint( char* out, uint64_t value )
+    {
+        while( value >= 0x80 )
+        {
+            *out++ = (char)( value | 0x80 );
+            value >>= 7;
+        }
+        *out++ = (char)value;
+        return out;
+    }
+
+    //NULL when the varint runs past end
+    static inline const char* getVarint( const char* in, const char* end, uint64_t& value )
+    {
+        value = 0;
+        for( int shift = 0; in < end && shift < 64; shift += 7 )
+        {
+            unsigned char c = (unsigned char)*in++;
+            value |= (uint64_t)( c & 0x7f ) << shift;
+            if( c < 0x80 )
+                return in;
+        }
+        return NULL;
+    }
+
+    static void header( char* out )
+    {
+        memcpy( out, magic(), 8 );
+        putU32( out + 8, VERSION );
+        putU32( out + 12, BLOCK_WORDS );
+    }
+
+    static bool readAt( int fd, uint64_t offset, char* data, size_t length )
+    {
+#ifdef _WIN32
+        if( _lseeki64( fd, offset, SEEK_SET ) < 0 )
+#else
+        if( lseek( fd, offset, SEEK_SET ) < 0 )
+#endif
+            return false;
+        while( length > 0 )
+        {
+            int done = (int)::read( fd, data, (unsigned int)min( length, (size_t)0x40000000 ) );
+            if( done < 0 && errno == EINTR )
+                continue;
+            if( done <= 0 )
+                return false;
+            data += done;
+            length -= done;
+        }
+        return true;
+    }
+
+    //walks the block headers of a file up to end and returns where the last whole
+    //block ends, 0 when the file header is not valid
+    static uint64_t scanBlocks( int fd, uint64_t end, vector< Block >& index, uint64_t& words )
+    {
+        char header[ HEADER_SIZE ];
+        if( end < HEADER_SIZE || !readAt( fd, 0, header, HEADER_SIZE ) ||
+            memcmp( header, magic(), 8 ) != 0 || getU32( header + 8 ) != VERSION )
+            return 0;
+        index.clear();
+        words = 0;
+        uint64_t offset = HEADER_SIZE;
+        char blockHeader[ BLOCK_HEADER ];
+        while( offset + BLOCK_HEADER <= end && readAt( fd, offset, blockHeader, BLOCK_HEADER ) )
+        {
+            uint64_t next = offset + BLOCK_HEADER + getU32( blockHeader + 4 );
+            if( next > end )
+                break;
+            Block block = { offset, words };
+            index.push_back( block );
+            words += getU32( blockHeader );
+            offset = next;
+        }
+        return offset;
+    }
+};
+
+//encodes words into blocks in a caller provided buffer. the previous word is kept
+//right aligned like in the Cursor, so only the changed head is copied
+class BlockEncoder{
+public:
+    //a block in the buffer, offset from the base given to reset
+    struct Block{
+        size_t      offset;
+        uint32_t    words;
+    };
+
+    BlockEncoder() : m_base( NULL ), m_header( NULL ), m_blockWords( 0 ), m_lastLength( 0 )
+    {
+    }
+
+    //forgets the blocks, the next word begins a new one
+    void reset( char* base )
+    {
+        m_base = base;
+        m_header = NULL;
+        m_blocks.clear();
+    }
+
+    //shared is a count of trailing bytes the caller knows the word shares with the
+    //word before, the encoder extends it
+    inline char* add( char* out, const char* word, size_t length, size_t shared )
+    {
+        if( m_header == NULL )
+        {
+            m_header = out;
+            m_blockWords = 0;
+            out += BlockFormat::BLOCK_HEADER;
+            Block block = { (size_t)( m_header - m_base ), 0 };
+            m_blocks.push_back( block );
+            shared = 0;
+        }else
+        {
+            size_t limit = min( length, m_lastLength );
+            shared = min( shared, limit );
+            const char* last = m_last.data() + m_last.size();
+            while( shared < limit && last[ -1 - (ptrdiff_t)shared ] == word[ length - 1 - shared ] )
+                ++shared;
+        }
+        size_t head = length - shared;
+        out = BlockFormat::putEntry( out, shared, word, head );
+
+        if( m_last.size() < length )
+        {
+            //grow on the left, the tail stays aligned
+            m_last.insert( m_last.begin(), length - m_last.size() + 64, 0 );
+        }
+        memcpy( m_last.data() + m_last.size() - length, word, head );
+        m_lastLength = length;
+
+        if( ++m_blockWords == BlockFormat::BLOCK_WORDS )
+            out = close( out );
+        return out;
+    }
+
+    //ends the open block, if any
+    char* close( char* out )
+    {
+        if( m_header == NULL )
+            return out;
+        BlockFormat::putU32( m_header, m_blockWords );
+        BlockFormat::putU32( m_header + 4, (uint32_t)( out - m_header - BlockFormat::BLOCK_HEADER ) );
+        m_blocks.back().words = m_blockWords;
+        m_header = NULL;
+        return out;
+    }
+
+    const vector< Block >& blocks() const
+    {
+        return m_blocks;
+    }
+
+protected:
+    char*           m_base;
+    char*           m_header;
+    uint32_t        m_blockWords;
+    vector< char >  m_last;
+    size_t          m_lastLength;
+    vector< Block > m_blocks;
+};
+
+#ifndef _WIN32
+//the producer side of the shared memory ring of --shm, RingHeader describes the layout
+class ShmRing{
+public:
+    static const size_t RING_SIZE   = 64*1024*1024; //64M
+    static const int    WAIT_MICROSECONDS = 50;     //polling interval while the ring is full
+
+    ShmRing() : m_header( NULL ), m_data( NULL ), m_size( 0 )
+    {
+    }
+
+    ~ShmRing()
+    {
+        close();
+    }
+
+    ErrorMan::ErrorCode open( const char* name )
+    {
+        close();
+        string path = ( name[0] == '/' ) ? string( name ) : "/" + string( name );
+        int fd = shm_open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600 );
+        if( fd < 0 )
+            return ErrorMan::eCanNotOpenFile;
+        size_t size = RingHeader::DATA_OFFSET + RING_SIZE;
+        void* mapped = MAP_FAILED;
+        if( ftruncate( fd, size ) == 0 )
+            mapped = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        ::close( fd );
+        if( mapped == MAP_FAILED )
+        {
+            shm_unlink( path.c_str() );
+            return ErrorMan::eWriteFileErr;
+        }
+        m_name = path;
+        m_size = size;
+        m_header = new( mapped ) RingHeader;
+        m_data = (char*)mapped + RingHeader::DATA_OFFSET;
+        memcpy( m_header->magic, "CRUNCHXR", 8 );
+        m_header->version = 1;
+        m_header->reserved = 0;
+        m_header->capacity = RING_SIZE;
+        m_header->head.store( 0, memory_order_relaxed );
+        m_header->tail.store( 0, memory_order_relaxed );
+        m_header->state.store( RingHeader::eRingRunning, memory_order_release );
+        return ErrorMan::eOk;
+    }
+
+    //waits while the ring is full, false when the reader gave up
+    bool write( const char* data, size_t length )
+    {
+        uint64_t head = m_header->head.load( memory_order_relaxed );
+        while( length > 0 )
+        {
+            if( m_header->state.load( memory_order_acquire ) == RingHeader::eRingAborted )
+                return false;
+            size_t free = RING_SIZE - (size_t)( head - m_header->tail.load( memory_order_acquire ) );
+            if( free == 0 )
+            {
+                this_thread::sleep_for( chrono::microseconds( (int)WAIT_MICROSECONDS ) );
+                continue;
+            }
+            size_t count = min( length, free );
+            size_t at = (size_t)( head % RING_SIZE );
+            size_t first = min( count, RING_SIZE - at );
+            memcpy( m_data + at, data, first );
+            memcpy( m_data, data + first, count - first );
+            head += count;
+            data += count;
+            length -= count;
+            m_header->head.store( head, memory_order_release );
+        }
+        return true;
+    }
+
+    //a reader that gave up does not remove the ring, so it is removed here. otherwise
+    //the reader removes it when it read everything
+    void close()
+    {
+        if( m_header == NULL )
+            return;
+        uint32_t running = RingHeader::eRingRunning;
+        if( !m_header->state.compare_exchange_strong( running, RingHeader::eRingClosed, memory_order_release ) &&
+            running == RingHeader::eRingAborted )
+            shm_unlink( m_name.c_str() );
+        munmap( m_header, m_size );
+        m_header = NULL;
+        m_data = NULL;
+    }
+
+protected:
+    RingHeader* m_header;
+    char*       m_data;
+    size_t      m_size;
+    string      m_name;     //of the shared memory object, with the leading '/'
+};
+#endif
+
+//buffered output stage: words are packed with their separator into a large page
+//aligned buffer that is handed to the kernel with one write call when it is full
+class OutputWriter{
+public:
+    static const size_t BUFFER_SIZE     = 1024*1024; //1M
+    static const size_t BUFFER_ALIGN    = 4096;
+
+    enum Format{ eFormatText, eFormatBlocks };
+
+    OutputWriter() : m_fd( -1 ), m_ownFd( false ), m_memory( NULL ), m_buffer( NULL ),
+        m_used( 0 ), m_separator( '\n' ), m_written( 0 ), m_blockedNanos( 0 ), m_format( eFormatText ), m_words( 0 ),
+        m_splice( false ), m_spliceActive( false ), m_spareMemory( NULL ), m_spare( NULL ), m_ring( NULL )
+    {
+        m_memory = new char[ BUFFER_SIZE + BUFFER_ALIGN ];
+        m_buffer = m_memory + ( BUFFER_ALIGN - (size_t)m_memory % BUFFER_ALIGN ) % BUFFER_ALIGN;
+    }
+
+    ~OutputWriter()
+    {
+        close();
+        delete[] m_memory;
+        delete[] m_spareMemory;
+    }
+
+    //gift the full buffers to a pipe with vmsplice instead of copying them with
+    //write, set it before open. other outputs are written as usual
+    void setSplice( bool splice )
+    {
+        m_splice = splice;
+    }
+
+#ifndef _WIN32
+    //writes into the shared memory ring of the given name instead of a file
+    ErrorMan::ErrorCode openShm( const char* name )
+    {
+        close();
+        m_written = 0;
+        startBlocks();
+        if( m_format == eFormatBlocks )
+        {
+            BlockFormat::header( m_buffer );
+            m_used = BlockFormat::HEADER_SIZE;
+        }
+        m_ring = new ShmRing;
+        ErrorMan::ErrorCode err = m_ring->open( name );
+        if( err != ErrorMan::eOk )
+        {
+            delete m_ring;
+            m_ring = NULL;
+        }
+        return err;
+    }
+#endif
+
+    //eFormatBlocks writes the compact format of BlockFormat, set it before open
+    void setFormat( Format format )
+    {
+        m_format = format;
+    }
+
+    Format format() const
+    {
+        return m_format;
+    }
+
+    //opens the output file, writes to stdout when fileName is NULL
+    ErrorMan::ErrorCode open( const char* fileName )
+    {
+        close();
+        m_written = 0;
+        startBlocks();
+        if( m_format == eFormatBlocks )
+        {
+            BlockFormat::header( m_buffer );
+            m_used = BlockFormat::HEADER_SIZE;
+        }
+        if( fileName == NULL )
+        {
+            m_fd = 1;
+            m_ownFd = false;
+            startSplice();
+            return ErrorMan::eOk;
+        }
+        m_fd = ::open( fileName, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644 );
+        if( m_fd < 0 )
+            return ErrorMan::eCanNotOpenFile;
+        m_ownFd = true;
+        startSplice();
+        return ErrorMan::eOk;
+    }
+
+    //reopens the output of an interrupted run and drops what was written after offset
+    ErrorMan::ErrorCode resume( const char* fileName, uint64_t offset )
+    {
+        close();
+        m_written = offset;
+        startBlocks();
+        if( fileName == NULL )
+        {
+            //the index of the blocks written before can not be read back from a pipe
+            if( m_format == eFormatBlocks )
+                return ErrorMan::eInvalidParam;
+            m_fd = 1;
+            m_ownFd = false;
+            startSplice();
+            return ErrorMan::eOk;
+        }
+        int fd = ::open( fileName, ( m_format == eFormatBlocks ? O_RDWR : O_WRONLY ) | O_BINARY );
+        if( fd < 0 )
+            return ErrorMan::eCanNotOpenFile;
+        if( m_format == eFormatBlocks && BlockFormat::scanBlocks( fd, offset, m_index, m_words ) != offset )
+        {
+            ::close( fd );
+            return ErrorMan::eReadFileErr;
+        }
+        m_fd = fd;
+        m_ownFd = true;
+#ifdef _WIN32
+        bool ok = ( _chsize_s( m_fd, offset ) == 0 && _lseeki64( m_fd, offset, SEEK_SET ) >= 0 );
+#else
+        bool ok = ( ftruncate( m_fd, offset ) == 0 && lseek( m_fd, offset, SEEK_SET ) >= 0 );
+#endif
+        return ok ? ErrorMan::eOk : ErrorMan::eWriteFileErr;
+    }
+
+    //writes the pending data and waits until it is on the disk
+    bool sync()
+    {
+        if( m_ring )
+            return flush();
+        return flush() && syncFile( m_fd );
+    }
+
+    void setSeparator( char separator )
+    {
+        m_separator = separator;
+    }
+
+    char separator() const
+    {
+        return m_separator;
+    }
+
+    //the free part of the buffer, the text format only. words put there are
+    //written with commit
+    inline char* reserve( size_t& room )
+    {
+        room = BUFFER_SIZE - m_used;
+        return m_buffer + m_used;
+    }
+
+    inline void commit( size_t bytes )
+    {
+        m_used += bytes;
+    }
+
+    //writes a block of already separated words behind the pending data
+    bool writeBlock( const char* data, size_t length )
+    {
+        return flush() && writeAll( data, length );
+    }
+
+    //writes blocks encoded by a BlockEncoder behind the pending data
+    bool writeBlocks( const char* data, size_t length, const vector< BlockEncoder::Block >& blocks )
+    {
+        if( !flush() )
+            return false;
+        addBlocks( blocks, m_written );
+        return writeAll( data, length );
+    }
+
+    //shared: trailing bytes the word surely has in common with the word before,
+    //it saves comparing them in the compact format
+    inline bool write( const char* word, size_t length, size_t shared = 0 )
+    {
+        if( m_format == eFormatBlocks )
+            return encode( word, length, shared );
+        if( length < BUFFER_SIZE - m_used )
+        {
+            memcpy( m_buffer + m_used, word, length );
+            m_buffer[ m_used + length ] = m_separator;
+            m_used += length + 1;
+            return true;
+        }
+        return writeSlow( word, length );
+    }
+
+    //in the compact format it also ends the open block
+    bool flush()
+    {
+        if( m_format == eFormatBlocks )
+        {
+            m_used = m_encoder.close( m_buffer + m_used ) - m_buffer;
+            addBlocks( m_encoder.blocks(), m_written );
+        }
+        //only a buffer that covers all its pages fills the whole pipe, see startSplice
+        bool ok = ( m_spliceActive && m_used > BUFFER_SIZE - BUFFER_ALIGN ) ? spliceBuffer() : writeAll( m_buffer, m_used );
+        m_used = 0;
+        if( m_format == eFormatBlocks )
+            m_encoder.reset( m_buffer );
+        return ok;
+    }
+
+    ErrorMan::ErrorCode close()
+    {
+        if( m_fd < 0 && m_ring == NULL )
+            return ErrorMan::eOk;
+        bool ok = flush();
+        if( ok && m_format == eFormatBlocks )
+            ok = writeIndex();
+        ErrorMan::ErrorCode err = ok ? ErrorMan::eOk : ErrorMan::eWriteFileErr;
+        if( m_fd >= 0 && m_ownFd && ::close( m_fd ) != 0 )
+            err = ErrorMan::eWriteFileErr;
+        m_fd = -1;
+        m_spliceActive = false;
+#ifndef _WIN32
+        delete m_ring;
+#endif
+        m_ring = NULL;
+        return err;
+    }
+
+    //bytes handed to the kernel so far, it can be read by other threads
+    uint64_t written() const
+    {
+        return m_written.load( memory_order_relaxed );
+    }
+
+    //time spent handing the output over, most of it waiting for a slow reader
+    uint64_t blockedNanos() const
+    {
+        return m_blockedNanos.load( memory_order_relaxed );
+    }
+
+protected:
+    //vmsplice hands the pages of the buffer to the pipe, they must not change until
+    //the reader consumed them. the pipe is sized to one buffer and the buffer
+    //alternates with a spare one, so once a full buffer is in the pipe the one
+    //before it has been read
+    void startSplice()
+    {
+        m_spliceActive = false;
+#ifdef __linux__
+        struct stat st;
+        if( !m_splice || m_format != eFormatText || fstat( m_fd, &st ) != 0 || !S_ISFIFO( st.st_mode ) ||
+            sysconf( _SC_PAGESIZE ) != (long)BUFFER_ALIGN || fcntl( m_fd, F_SETPIPE_SZ, (int)BUFFER_SIZE ) != (int)BUFFER_SIZE )
+            return;
+        if( m_spareMemory == NULL )
+        {
+            m_spareMemory = new char[ BUFFER_SIZE + BUFFER_ALIGN ];
+            m_spare = m_spareMemory + ( BUFFER_ALIGN - (size_t)m_spareMemory % BUFFER_ALIGN ) % BUFFER_ALIGN;
+        }
+        m_spliceActive = true;
+#endif
+    }
+
+    bool spliceBuffer()
+    {
+#ifdef __linux__
+        struct iovec iov;
+        iov.iov_base = m_buffer;
+        iov.iov_len = m_used;
+        uint64_t start = monotonicNanos();
+        while( iov.iov_len > 0 )
+        {
+            ssize_t done = vmsplice( m_fd, &iov, 1, SPLICE_F_GIFT );
+            if( done < 0 )
+            {
+                if( errno == EINTR )
+                    continue;
+                return false;
+            }
+            iov.iov_base = (char*)iov.iov_base + done;
+            iov.iov_len -= done;
+            m_written += done;
+        }
+        m_blockedNanos += monotonicNanos() - start;
+        swap( m_buffer, m_spare );
+        return true;
+#else
+        return writeAll( m_buffer, m_used );
+#endif
+    }
+
+    void startBlocks()
+    {
+        m_encoder.reset( m_buffer );
+        m_index.clear();
+        m_words = 0;
+    }
+
+    void addBlocks( const vector< BlockEncoder::Block >& blocks, uint64_t offset )
+    {
+        for( size_t i = 0; i < blocks.size(); ++i )
+        {
+            BlockFormat::Block block = { offset + blocks[i].offset, m_words };
+            m_index.push_back( block );
+            m_words += blocks[i].words;
+        }
+    }
+
+    bool encode( const char* word, size_t length, size_t shared )
+    {
+        size_t entry = BlockFormat::maxEntry( length );
+        if( entry > BUFFER_SIZE - m_used )
+        {
+            if( !flush() )
+                return false;
+            if( entry > BUFFER_SIZE )
+            {
+                //a word longer than the buffer gets a block of its own
+                vector< char > block( entry );
+                m_encoder.reset( block.data() );
+                char* end = m_encoder.close( m_encoder.add( block.data(), word, length, 0 ) );
+                addBlocks( m_encoder.blocks(), m_written );
+                m_encoder.reset( m_buffer );
+                return writeAll( block.data(), end - block.data() );
+            }
+        }
+        m_used = m_encoder.add( m_buffer + m_used, word, length, shared ) - m_buffer;
+        return true;
+    }
+
+    bool writeIndex()
+    {
+        vector< char > index( m_index.size() * 16 + BlockFormat::TRAILER_SIZE );
+        char* out = index.data();
+        for( size_t i = 0; i < m_index.size(); ++i, out += 16 )
+        {
+            BlockFormat::putU64( out, m_index[i].offset );
+            BlockFormat::putU64( out + 8, m_index[i].firstWord );
+        }
+        BlockFormat::putU64( out, m_written );
+        BlockFormat::putU64( out + 8, m_index.size() );
+        BlockFormat::putU64( out + 16, m_words );
+        memcpy( out + 24, BlockFormat::magic(), 8 );
+        return writeAll( index.data(), index.size() );
+    }
+
+    bool writeSlow( const char* word, size_t length )
+    {
+        if( length < BUFFER_SIZE )
+        {
+            if( !flush() )
+                return false;
+            return write( word, length );
+        }
+        if( m_ring )
+            return flush() && writeAll( word, length ) && writeAll( &m_separator, 1 );
+#ifndef _WIN32
+        //a word longer than the buffer goes out together with the pending data
+        struct iovec iov[3];
+        iov[0].iov_base = m_buffer;
+        iov[0].iov_len = m_used;
+        iov[1].iov_base = (void*)word;
+        iov[1].iov_len = length;
+        iov[2].iov_base = &m_separator;
+        iov[2].iov_len = 1;
+        ssize_t done;
+        uint64_t start = monotonicNanos();
+        do
+            done = ::writev( m_fd, iov, 3 );
+        while( done < 0 && errno == EINTR );
+        m_blockedNanos += monotonicNanos() - start;
+        if( done < 0 )
+            return false;
+        m_written += done;
+        m_used = 0;
+        for( int i = 0; i < 3; ++i )
+        {
+            if( (size_t)done >= iov[i].iov_len )
+            {
+                done -= iov[i].iov_len;
+                continue;
+            }
+            if( !writeAll( (const char*)iov[i].iov_base + done, iov[i].iov_len - done ) )
+                return false;
+            done = 0;
+        }
+        return true;
+#else
+        return flush() && writeAll( word, length ) && writeAll( &m_separator, 1 );
+#endif
+    }
+
+    bool writeAll( const char* data, size_t length )
+    {
+        uint64_t start = monotonicNanos();
+#ifndef _WIN32
+        if( m_ring )
+        {
+            if( !m_ring->write( data, length ) )
+                return false;
+            m_written += length;
+            m_blockedNanos += monotonicNanos() - start;
+            return true;
+        }
+#endif
+        while( length > 0 )
+        {
+            int done = (int)::write( m_fd, data, (unsigned int)min( length, (size_t)0x40000000 ) );
+            if( done < 0 )
+            {
+                if( errno == EINTR )
+                    continue;
+                return false;
+            }
+            data += done;
+            length -= done;
+            m_written += done;
+        }
+        m_blockedNanos += monotonicNanos() - start;
+        return true;
+    }
+
+protected:
+    int         m_fd;
+    bool        m_ownFd;
+    char*       m_memory;
+    char*       m_buffer;
+    size_t      m_used;
+    char        m_separator;
+    atomic< uint64_t >  m_written;
+    atomic< uint64_t >  m_blockedNanos;
+    Format      m_format;
+    BlockEncoder    m_encoder;
+    vector< BlockFormat::Block >    m_index;
+    uint64_t    m_words;    //words in the blocks of m_index
+    bool        m_splice;
+    bool        m_spliceActive;
+    char*       m_spareMemory;
+    char*       m_spare;    //the buffer gifted to the pipe before the current one
+#ifdef _WIN32
+    void*       m_ring;
+#else
+    ShmRing*    m_ring;
+#endif
+};
+
+//reads a file in the compact format back from its start to its end, so it can be a
+//pipe. the index and the trailer both start with the offset of the first block, which
+//taken as a block header is 16 words in 0 bytes, so it ends the blocks
+class BlockReader{
+public:
+    static const size_t READ_SIZE = 64 * 1024;
+
+    BlockReader() : m_fd( -1 ), m_seekable( false ), m_offset( 0 )
+    {
+    }
+
+    ~BlockReader()
+    {
+        if( m_fd >= 0 )
+            ::close( m_fd );
+    }
+
+    const ErrorMan& error() const
+    {
+        return m_error;
+    }
+
+    ErrorMan::ErrorCode open( const char* fileName )
+    {
+        m_fd = ::open( fileName, O_RDONLY | O_BINARY );
+        if( m_fd < 0 )
+            return fail( ErrorMan::eCanNotOpenFile, "can not open file" );
+#ifndef _WIN32
+        struct stat st;
+        m_seekable = ( fstat( m_fd, &st ) == 0 && S_ISREG( st.st_mode ) );
+#endif
+        char header[ BlockFormat::HEADER_SIZE ];
+        if( !readAll( header, BlockFormat::HEADER_SIZE ) || memcmp( header, BlockFormat::magic(), 8 ) != 0 ||
+            BlockFormat::getU32( header + 8 ) != BlockFormat::VERSION )
+            return fail( ErrorMan::eInvalidParam, "not a compact wordlist" );
+        return ErrorMan::eOk;
+    }
+
+    //writes the words [first, last) as text. reading the file to its end checks the
+    //index and the trailer, a file cut short fails after the words before the cut
+    ErrorMan::ErrorCode decode( uint64_t first, uint64_t last, OutputWriter& writer )
+    {
+        vector< char > data, word;
+        uint64_t index = 0;
+        uint64_t blocks = 0;
+        while( index < last )
+        {
+            uint64_t blockOffset = m_offset;
+            char header[ BlockFormat::BLOCK_HEADER ];
+            if( !readAll( header, BlockFormat::BLOCK_HEADER ) )
+                return m_error.errorCode() ? (ErrorMan::ErrorCode)m_error.errorCode() :
+                    fail( ErrorMan::eReadFileErr, "the compact wordlist is cut short, it has no index" );
+            if( BlockFormat::getU64( header ) == BlockFormat::HEADER_SIZE )
+                return readTrailer( blockOffset, blocks, index, header );
+            uint32_t count = BlockFormat::getU32( header );
+            uint32_t size = BlockFormat::getU32( header + 4 );
+            if( count == 0 || size < count )
+                return fail( ErrorMan::eInvalidParam, "bad block in the compact wordlist" );
+            ++blocks;
+            if( index + count <= first )
+            {
+                if( !skip( size ) )
+                    return cutShort();
+                index += count;
+                continue;
+            }
+            data.resize( size );
+            if( !readAll( data.data(), size ) )
+                return cutShort();
+
+            //the word is rebuilt right aligned, the shared tail stays in place
+            const char* in = data.data();
+            const char* end = in + data.size();
+            size_t lastLength = 0;
+            for( uint32_t i = 0; i < count && index < last; ++i, ++index )
+            {
+                uint64_t shared, head;
+                in = BlockFormat::getEntry( in, end, shared, head );
+                if( in == NULL || shared > lastLength )
+                    return fail( ErrorMan::eInvalidParam, "bad word in the compact wordlist" );
+                size_t length = (size_t)( shared + head );
+                if( word.size() < length )
+                    word.insert( word.begin(), length - word.size() + 64, 0 );
+                char* w = word.data() + word.size() - length;
+                memcpy( w, in, head );
+                in += head;
+                lastLength = length;
+                if( index >= first && !writer.write( w, length ) )
+                    return fail( ErrorMan::eWriteFileErr, "can not write output" );
+            }
+        }
+        return ErrorMan::eOk;
+    }
+
+protected:
+    ErrorMan::ErrorCode fail( ErrorMan::ErrorCode code, const char* message )
+    {
+        m_error.setError( code, message );
+        return code;
+    }
+
+    ErrorMan::ErrorCode cutShort()
+    {
+        if( m_error.errorCode() )
+            return (ErrorMan::ErrorCode)m_error.errorCode();
+        return fail( ErrorMan::eReadFileErr, "the compact wordlist is cut short in its last block" );
+    }
+
+    //false at the end of the file before length bytes, or on a read error
+    bool readAll( char* data, size_t length )
+    {
+        while( length > 0 )
+        {
+            int done = (int)::read( m_fd, data, (unsigned int)min( length, (size_t)0x40000000 ) );
+            if( done < 0 && errno == EINTR )
+                continue;
+            if( done < 0 )
+                fail( ErrorMan::eReadFileErr, "can not read file" );
+            if( done <= 0 )
+                return false;
+            data += done;
+            length -= done;
+            m_offset += done;
+        }
+        return true;
+    }
+
+    bool skip( uint64_t length )
+    {
+#ifndef _WIN32
+        if( m_seekable && lseek( m_fd, length, SEEK_CUR ) >= 0 )
+        {
+            m_offset += length;
+            return true;
+        }
+#endif
+        char buffer[ READ_SIZE ];
+        while( length > 0 )
+        {
+            size_t part = (size_t)min( length, (uint64_t)READ_SIZE );
+            if( !readAll( buffer, part ) )
+                return false;
+            length -= part;
+        }
+        return true;
+    }
+
+    //reads the index after the blocks to the end of the file and checks the trailer
+    //against the blocks read, started holds the first bytes already read
+    ErrorMan::ErrorCode readTrailer( uint64_t offset, uint64_t blocks, uint64_t words, const char* started )
+    {
+        uint64_t expected = blocks * 16 + BlockFormat::TRAILER_SIZE;
+        string tail( started, BlockFormat::BLOCK_HEADER );
+        uint64_t total = BlockFormat::BLOCK_HEADER;
+        char buffer[ READ_SIZE ];
+        for( ;; )
+        {
+            int done = (int)::read( m_fd, buffer, sizeof( buffer ) );
+            if( done < 0 && errno == EINTR )
+                continue;
+            if( done < 0 )
+                return fail( ErrorMan::eReadFileErr, "can not read file" );
+            if( done == 0 )
+                break;
+            //only the last TRAILER_SIZE bytes are kept
+            size_t keep = min( (size_t)done, (size_t)BlockFormat::TRAILER_SIZE );
+            tail.append( buffer + done - keep, keep );
+            if( tail.size() > BlockFormat::TRAILER_SIZE )
+                tail.erase( 0, tail.size() - BlockFormat::TRAILER_SIZE );
+            total += done;
+        }
+        const char* trailer = tail.data();
+        if( total != expected || memcmp( trailer + 24, BlockFormat::magic(), 8 ) != 0 ||
+            BlockFormat::getU64( trailer ) != offset || BlockFormat::getU64( trailer + 8 ) != blocks ||
+            BlockFormat::getU64( trailer + 16 ) != words )
+            return fail( ErrorMan::eInvalidParam, "the index of the compact wordlist does not match its blocks" );
+        return ErrorMan::eOk;
+    }
+
+    int         m_fd;
+    bool        m_seekable;
+    uint64_t    m_offset;   //bytes read or skipped so far
+    ErrorMan    m_error;
+};
+
+//the position of a long run: the next word index, the output offset that is
+//durable and a hash of the rules. it is saved atomically by writing a temporary
+//file and renaming it over the previous state
+class Checkpoint{
+public:
+    static const uint64_t CHECK_INTERVAL = 65536;   //words between two looks at the clock
+
+    Checkpoint() : m_fileName( NULL ), m_rulesHash( 0 ), m_next( 0 ), m_end( 0 ), m_output( 0 ),
+        m_everyWords( 0 ), m_everySeconds( 60 ), m_lastNext( 0 ), m_lastSave( time( NULL ) ),
+        m_shuffled( false ), m_seed( 0 ), m_base( 0 ), m_size( 0 ),
+        m_hasOutput( false ), m_format( OutputWriter::eFormatText ), m_separator( '\n' )
+    {
+    }
+
+    void setFile( const char* fileName )
+    {
+        m_fileName = fileName;
+    }
+
+    bool isActive() const
+    {
+        return m_fileName != NULL;
+    }
+
+    //a checkpoint is due after the given count of words or seconds, 0 disables either
+    void setInterval( uint64_t words, uint64_t seconds )
+    {
+        m_everyWords = words;
+        m_everySeconds = seconds;
+    }
+
+    void setRange( uint64_t rulesHash, uint64_t next, uint64_t end )
+    {
+        m_rulesHash = rulesHash;
+        m_next = m_lastNext = next;
+        m_end = end;
+    }
+
+    uint64_t rulesHash() const { return m_rulesHash; }
+    uint64_t next() const { return m_next; }
+    uint64_t end() const { return m_end; }
+    uint64_t output() const { return m_output; }
+
+    //next and end are positions of a permutation of the words [base, base + size)
+    void setShuffle( uint64_t seed, uint64_t base, uint64_t size )
+    {
+        m_shuffled = true;
+        m_seed = seed;
+        m_base = base;
+        m_size = size;
+    }
+
+    bool shuffled() const { return m_shuffled; }
+    uint64_t seed() const { return m_seed; }
+    uint64_t base() const { return m_base; }
+    uint64_t size() const { return m_size; }
+
+    //the format and separator of the output, a run is resumed only with the same ones
+    void setOutput( OutputWriter::Format format, char separator )
+    {
+        m_hasOutput = true;
+        m_format = format;
+        m_separator = separator;
+    }
+
+    //true as well when the checkpoint does not record them
+    bool sameOutput( OutputWriter::Format format, char separator ) const
+    {
+        return !m_hasOutput || ( m_format == format && m_separator == separator );
+    }
+
+    bool load( const char* fileName )
+    {
+        FILE* f = fopen( fileName, "r" );
+        if( f == NULL )
+            return false;
+        unsigned long long hash, next, end, output;
+        int version = 0;
+        int fields = fscanf( f, "crunchx-checkpoint %d\nrules %llx\nnext %llu\nend %llu\noutput %llu\n",
+            &version, &hash, &next, &end, &output );
+        m_shuffled = false;
+        m_hasOutput = false;
+        char line[128];
+        while( fields == 5 && fgets( line, sizeof( line ), f ) != NULL )
+        {
+            unsigned long long seed, base, size;
+            char format[16];
+            int separator;
+            if( sscanf( line, "shuffle %llu %llu %llu", &seed, &base, &size ) == 3 )
+                setShuffle( seed, base, size );
+            else if( sscanf( line, "format %15s %d", format, &separator ) == 2 )
+                setOutput( strcmp( format, "blocks" ) == 0 ? OutputWriter::eFormatBlocks : OutputWriter::eFormatText,
+                    (char)separator );
+        }
+        fclose( f );
+        if( fields != 5 || version != 1 )
+            return false;
+        m_rulesHash = hash;
+        m_next = m_lastNext = next;
+        m_end = end;
+        m_output = output;
+        return true;
+    }
+
+    inline bool due( uint64_t next ) const
+    {
+        if( m_everyWords && next - m_lastNext >= m_everyWords )
+            return true;
+        return m_everySeconds && (uint64_t)( time( NULL ) - m_lastSave ) >= m_everySeconds;
+    }
+
+    //makes the output durable up to the current offset, then records the position
+    bool save( uint64_t next, OutputWriter& writer )
+    {
+        if( !writer.sync() )
+            return false;
+        m_next = m_lastNext = next;
+        m_output = writer.written();
+        m_lastSave = time( NULL );
+
+        string tempName = string( m_fileName ) + ".tmp";
+        FILE* f = fopen( tempName.c_str(), "w" );
+        if( f == NULL )
+            return false;
+        fprintf( f, "crunchx-checkpoint 1\nrules %llx\nnext %llu\nend %llu\noutput %llu\n",
+            (unsigned long long)m_rulesHash, (unsigned long long)m_next,
+            (unsigned long long)m_end, (unsigned long long)m_output );
+        if( m_shuffled )
+            fprintf( f, "shuffle %llu %llu %llu\n", (unsigned long long)m_seed,
+                (unsigned long long)m_base, (unsigned long long)m_size );
+        if( m_hasOutput )
+            fprintf( f, "format %s %d\n", m_format == OutputWriter::eFormatBlocks ? "blocks" : "text",
+                (int)(unsigned char)m_separator );
+        bool ok = ( fflush( f ) == 0 && syncFile( fileno( f ) ) );
+        ok = ( fclose( f ) == 0 ) && ok;
+#ifdef _WIN32
+        remove( m_fileName );
+#endif
+        return ok && rename( tempName.c_str(), m_fileName ) == 0;
+    }
+
+protected:
+    const char* m_fileName;
+    uint64_t    m_rulesHash;
+    uint64_t    m_next;
+    uint64_t    m_end;
+    uint64_t    m_output;
+    uint64_t    m_everyWords;
+    uint64_t    m_everySeconds;
+    uint64_t    m_lastNext;
+    time_t      m_lastSave;
+    bool        m_shuffled;
+    uint64_t    m_seed;
+    uint64_t    m_base;
+    uint64_t    m_size;
+    bool        m_hasOutput;
+    OutputWriter::Format    m_format;
+    char        m_separator;
+};
+
+//seeded bijection from positions [0, size) to the word indexes [base, base + size).
+//a balanced Feistel network permutes the smallest even count of bits covering size,
+//values outside the range are sent through it again until they fall inside.
+//any position is mapped on its own, so threads and shards can share one order
+class Permutation{
+public:
+    static const int ROUNDS = 6;
+
+    Permutation() : m_seed( 0 ), m_base( 0 ), m_size( 0 ), m_halfBits( 0 ), m_active( false )
+    {
+    }
+
+    void init( uint64_t seed, uint64_t base, uint64_t size )
+    {
+        m_seed = seed;
+        m_base = base;
+        m_size = size;
+        m_halfBits = 1;
+        while( m_halfBits < 32 && ( 1ULL << ( 2 * m_halfBits ) ) < size )
+            ++m_halfBits;
+        m_active = true;
+    }
+
+    bool isActive() const { return m_active; }
+    uint64_t seed() const { return m_seed; }
+    uint64_t base() const { return m_base; }
+    uint64_t size() const { return m_size; }
+
+    inline uint64_t index( uint64_t position ) const
+    {
+        uint64_t value = position;
+        do
+        {
+            value = permute( value );
+        }while( value >= m_size );
+        return m_base + value;
+    }
+
+protected:
+    static inline uint64_t mix( uint64_t x )
+    {
+        //the finalizer of splitmix64
+        x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+        x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+        return x ^ ( x >> 31 );
+    }
+
+    inline uint64_t permute( uint64_t value ) const
+    {
+        uint64_t mask = ( 1ULL << m_halfBits ) - 1;
+        uint64_t left = value >> m_halfBits;
+        uint64_t right = value & mask;
+        for( int round = 0; round < ROUNDS; ++round )
+        {
+            uint64_t next = left ^ ( mix( m_seed + round * 0x9e3779b97f4a7c15ULL + right ) & mask );
+            left = right;
+            right = next;
+        }
+        return ( left << m_halfBits ) | right;
+    }
+
+protected:
+    uint64_t    m_seed;
+    uint64_t    m_base;
+    uint64_t    m_size;
+    int         m_halfBits;
+    bool        m_active;
+};
+
+//the progress of a run: the generating threads count words in local variables and
+//publish them every few thousand words or every chunk, a reporter thread reads them
+//with the bytes and the blocked time of the writer. it prints a line on stderr every
+//interval and all the figures when the process gets SIGUSR1
+class Progress{
+public:
+    static const uint64_t PUBLISH_INTERVAL  = 4096; //words a thread counts before publishing them
+    static const int      POLL_MILLISECONDS = 100;  //how often the reporter looks for SIGUSR1
+
+    Progress() : m_writer( NULL ), m_first( 0 ), m_total( 0 ), m_threads( 1 ), m_interval( 0 ),
+        m_startNanos( 0 ), m_startBytes( 0 ), m_startBlocked( 0 ), m_endNanos( 0 ), m_completed( false ),
+        m_words( 0 ), m_positions( 0 ), m_stop( false ), m_running( false )
+    {
+    }
+
+    ~Progress()
+    {
+        stop( false );
+    }
+
+    //first: the first position of the run, total: its count of positions, 0 when unknown
+    void setRange( uint64_t first, uint64_t total )
+    {
+        m_first = first;
+        m_total = total;
+    }
+
+    void setThreads( int threads )
+    {
+        m_threads = threads;
+    }
+
+    //seconds between two lines on stderr, 0 for none
+    void setInterval( uint64_t seconds )
+    {
+        m_interval = seconds;
+    }
+
+    //starts the clock and the reporter, the writer must outlive stop()
+    void start( const OutputWriter& writer )
+    {
+        m_writer = &writer;
+        m_startNanos = monotonicNanos();
+        m_startBytes = writer.written();
+        m_startBlocked = writer.blockedNanos();
+        m_words = 0;
+        m_positions = 0;
+        m_stop = false;
+#ifndef _WIN32
+        struct sigaction action;
+        memset( &action, 0, sizeof( action ) );
+        action.sa_handler = onSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset( &action.sa_mask );
+        sigaction( SIGUSR1, &action, NULL );
+        m_running = true;
+#else
+        m_running = ( m_interval != 0 );
+#endif
+        if( m_running )
+            m_reporter = thread( &Progress::report, this );
+    }
+
+    //stops the clock and the reporter, with a last line when there were lines
+    void stop( bool completed )
+    {
+        if( !m_running )
+            return;
+        {
+            lock_guard< mutex > lock( m_mutex );
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        m_reporter.join();
+        m_running = false;
+        m_endNanos = monotonicNanos();
+        m_completed = completed;
+        if( m_interval )
+            printLine( snapshot() );
+    }
+
+    //for the only generating thread: the totals so far
+    inline void set( uint64_t words, uint64_t positions )
+    {
+        m_words.store( words, memory_order_relaxed );
+        m_positions.store( positions, memory_order_relaxed );
+    }
+
+    //for one of many generating threads: the words and positions since its last call
+    inline void add( uint64_t words, uint64_t positions )
+    {
+        m_words.fetch_add( words, memory_order_relaxed );
+        m_positions.fetch_add( positions, memory_order_relaxed );
+    }
+
+    inline uint64_t words() const
+    {
+        return m_words.load( memory_order_relaxed );
+    }
+
+    //since start, until stop
+    double seconds() const
+    {
+        return snapshot().seconds;
+    }
+
+    //the figures of the finished run as a JSON object
+    bool writeSummary( const char* fileName ) const
+    {
+        FILE* f = fopen( fileName, "w" );
+        if( f == NULL )
+            return false;
+        vector< pair< const char*, string > > fields = describe( snapshot() );
+        fprintf( f, "{\n" );
+        for( size_t i = 0; i < fields.size(); ++i )
+            fprintf( f, "  \"%s\": %s%s\n", fields[i].first, fields[i].second.c_str(), i + 1 < fields.size() ? "," : "" );
+        fprintf( f, "}\n" );
+        return fclose( f ) == 0;
+    }
+
+protected:
+    struct Snapshot{
+        double      seconds;
+        double      blocked;    //seconds spent handing the output over
+        uint64_t    words;
+        uint64_t    bytes;
+        uint64_t    positions;  //word indexes passed, the ones the filters skipped too
+        bool        finished;
+    };
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        uint64_t now = m_running ? monotonicNanos() : m_endNanos;
+        s.seconds = ( now - m_startNanos ) / 1e9;
+        s.blocked = m_writer ? ( m_writer->blockedNanos() - m_startBlocked ) / 1e9 : 0;
+        s.words = m_words.load( memory_order_relaxed );
+        s.bytes = m_writer ? m_writer->written() - m_startBytes : 0;
+        s.positions = min( m_positions.load( memory_order_relaxed ), m_total );
+        s.finished = !m_running;
+        return s;
+    }
+
+    static double rate( double count, double seconds )
+    {
+        return seconds > 0 ? count / seconds : 0;
+    }
+
+    //seconds left at the average speed so far, negative when unknown
+    double eta( const Snapshot& s ) const
+    {
+        if( s.finished )
+            return 0;
+        if( m_total == 0 || s.positions == 0 )
+            return -1;
+        return s.seconds * ( m_total - s.positions ) / s.positions;
+    }
+
+    double percent( const Snapshot& s ) const
+    {
+        return 100.0 * s.positions / m_total;
+    }
+
+    static string format( const char* spec, double value )
+    {
+        char text[64];
+        snprintf( text, sizeof( text ), spec, value );
+        return text;
+    }
+
+    static string formatCount( uint64_t value )
+    {
+        char text[32];
+        snprintf( text, sizeof( text ), "%llu", (unsigned long long)value );
+        return text;
+    }
+
+    static string formatTime( double seconds )
+    {
+        uint64_t s = (uint64_t)( seconds + 0.5 );
+        char text[48];
+        snprintf( text, sizeof( text ), "%llu:%02u:%02u", (unsigned long long)( s / 3600 ),
+            (unsigned)( s / 60 % 60 ), (unsigned)( s % 60 ) );
+        return text;
+    }
+
+    //the figures as names and JSON values
+    vector< pair< const char*, string > > describe( const Snapshot& s ) const
+    {
+        vector< pair< const char*, string > > fields;
+        fields.push_back( make_pair( "words", formatCount( s.words ) ) );
+        fields.push_back( make_pair( "bytes", formatCount( s.bytes ) ) );
+        fields.push_back( make_pair( "seconds", format( "%.3f", s.seconds ) ) );
+        fields.push_back( make_pair( "words_per_second", format( "%.0f", rate( (double)s.words, s.seconds ) ) ) );
+        fields.push_back( make_pair( "bytes_per_second", format( "%.0f", rate( (double)s.bytes, s.seconds ) ) ) );
+        fields.push_back( make_pair( "output_blocked_seconds", format( "%.3f", s.blocked ) ) );
+        fields.push_back( make_pair( "generating_seconds", format( "%.3f", max( 0.0, s.seconds - s.blocked ) ) ) );
+        fields.push_back( make_pair( "threads", formatCount( m_threads ) ) );
+        fields.push_back( make_pair( "first", m_total ? formatCount( m_first ) : string( "null" ) ) );
+        fields.push_back( make_pair( "end", m_total ? formatCount( m_first + m_total ) : string( "null" ) ) );
+        fields.push_back( make_pair( "position", m_total ? formatCount( m_first + s.positions ) : string( "null" ) ) );
+        fields.push_back( make_pair( "percent", m_total ? format( "%.2f", percent( s ) ) : string( "null" ) ) );
+        double left = eta( s );
+        fields.push_back( make_pair( "eta_seconds", left >= 0 ? format( "%.0f", left ) : string( "null" ) ) );
+        if( s.finished )
+            fields.push_back( make_pair( "completed", string( m_completed ? "true" : "false" ) ) );
+        return fields;
+    }
+
+    void printLine( const Snapshot& s ) const
+    {
+        string done = m_total ? format( "%.2f%% ", percent( s ) ) : string();
+        double left = eta( s );
+        fprintf( stderr, "progress:%s%llu words %llu bytes %.0f words/s %.1f MB/s eta %s output blocked %.0f%%\n",
+            done.c_str(), (unsigned long long)s.words, (unsigned long long)s.bytes, rate( (double)s.words, s.seconds ),
+            rate( s.bytes / 1e6, s.seconds ), left >= 0 ? formatTime( left ).c_str() : "unknown",
+            rate( 100.0 * s.blocked, s.seconds ) );
+    }
+
+    void printAll( const Snapshot& s ) const
+    {
+        vector< pair< const char*, string > > fields = describe( s );
+        string text = "progress:\n";
+        for( size_t i = 0; i < fields.size(); ++i )
+            text += "  " + string( fields[i].first ) + " " + fields[i].second + "\n";
+        fputs( text.c_str(), stderr );
+    }
+
+    void report()
+    {
+        uint64_t next = m_startNanos + m_interval * 1000000000ULL;
+        unique_lock< mutex > lock( m_mutex );
+        while( !m_stop )
+        {
+            m_wake.wait_for( lock, chrono::milliseconds( (int)POLL_MILLISECONDS ) );
+            if( m_stop )
+                break;
+            if( s_dump )
+            {
+                s_dump = 0;
+                printAll( snapshot() );
+            }
+            if( m_interval && monotonicNanos() >= next )
+            {
+                printLine( snapshot() );
+                next += m_interval * 1000000000ULL;
+            }
+        }
+    }
+
+#ifndef _WIN32
+    static void onSignal( int )
+    {
+        s_dump = 1;
+    }
+#endif
+
+protected:
+    static volatile sig_atomic_t s_dump;
+
+    const OutputWriter* m_writer;
+    uint64_t            m_first;
+    uint64_t            m_total;
+    int                 m_threads;
+    uint64_t            m_interval;
+    uint64_t            m_startNanos;
+    uint64_t            m_startBytes;
+    uint64_t            m_startBlocked;
+    uint64_t            m_endNanos;
+    bool                m_completed;
+    atomic< uint64_t >  m_words;
+    atomic< uint64_t >  m_positions;
+    bool                m_stop;
+    bool                m_running;
+    mutex               m_mutex;
+    condition_variable  m_wake;
+    thread              m_reporter;
+};
+
+volatile sig_atomic_t Progress::s_dump = 0;
+
+#if defined( __GNUC__ )
+//the lanes of the hashes, 32 bits each. the compiler maps the operators to the
+//vector instructions of the target, two SSE2 registers or one AVX2 register
+typedef uint32_t HashLanes __attribute__(( vector_size( 32 ) ));
+#if !defined( __clang__ )
+//they are passed by value only between inlined functions of this file
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+#else
+struct HashLanes{
+    uint32_t v[8];
+
+    inline uint32_t& operator[]( size_t i )
+    {
+        return v[i];
+    }
+
+    inline uint32_t operator[]( size_t i ) const
+    {
+        return v[i];
+    }
+
+#define CRUNCHX_LANES_OP( op ) \
+    inline HashLanes operator op( const HashLanes& o ) const \
+    { \
+        HashLanes r; \
+        for( size_t i = 0; i < 8; ++i ) \
+            r.v[i] = v[i] op o.v[i]; \
+        return r; \
+    } \
+    inline HashLanes operator op( uint32_t o ) const \
+    { \
+        HashLanes r; \
+        for( size_t i = 0; i < 8; ++i ) \
+            r.v[i] = v[i] op o; \
+        return r; \
+    }
+    CRUNCHX_LANES_OP( + )
+    CRUNCHX_LANES_OP( ^ )
+    CRUNCHX_LANES_OP( & )
+    CRUNCHX_LANES_OP( | )
+    CRUNCHX_LANES_OP( << )
+    CRUNCHX_LANES_OP( >> )
+#undef CRUNCHX_LANES_OP
+
+    inline HashLanes operator ~() const
+    {
+        HashLanes r;
+        for( size_t i = 0; i < 8; ++i )
+            r.v[i] = ~v[i];
+        return r;
+    }
+
+    inline HashLanes& operator += ( const HashLanes& o )
+    {
+        return *this = *this + o;
+    }
+};
+#endif
+
+//MD5, SHA-1 and NTLM digests of many words at a time, NTLM is MD4 of the word in
+//UTF-16LE. the words whose padded message is one 64-byte block, up to 55 bytes or
+//27 characters for NTLM, are hashed LANES at a time: the compressions are written
+//once for a type T, HashLanes runs them on all the lanes at once. longer words go
+//through the same code with T a single uint32_t
+class Hasher{
+public:
+    enum Type{ eMd5, eSha1, eNtlm };
+    static const size_t LANES       = sizeof( HashLanes ) / sizeof( uint32_t );
+    static const size_t MAX_DIGEST  = 20;
+    static const size_t BLOCK_SIZE  = 64;
+
+    static bool parseType( const char* name, Type& type )
+    {
+        if( strcmp( name, "md5" ) == 0 )
+            type = eMd5;
+        else if( strcmp( name, "sha1" ) == 0 )
+            type = eSha1;
+        else if( strcmp( name, "ntlm" ) == 0 )
+            type = eNtlm;
+        else
+            return false;
+        return true;
+    }
+
+    static size_t digestSize( Type type )
+    {
+        return type == eSha1 ? 20 : 16;
+    }
+
+    explicit Hasher( Type type ) : m_type( type )
+    {
+    }
+
+    inline size_t digestSize() const
+    {
+        return digestSize( m_type );
+    }
+
+    //the digests of count words, at most LANES of them, into digests one after another
+    void hash( const char* const* words, const size_t* lengths, size_t count, uint8_t* digests )
+    {
+        assert( count <= LANES );
+        uint32_t block[16][ LANES ];
+        size_t lane[ LANES ];   //the word of every lane
+        size_t lanes = 0;
+        memset( block, 0, sizeof( block ) );
+        for( size_t w = 0; w < count; ++w )
+        {
+            const uint8_t* message = (const uint8_t*)words[w];
+            size_t length = lengths[w];
+            if( m_type == eNtlm )
+            {
+                toUtf16( words[w], lengths[w], m_utf16 );
+                message = m_utf16.data();
+                length = m_utf16.size();
+            }
+            if( length > BLOCK_SIZE - 9 )
+            {
+                hashLong( message, length, digests + w * digestSize() );
+                continue;
+            }
+            if( m_type == eSha1 )
+                pack< true >( message, length, block, lanes );
+            else
+                pack< false >( message, length, block, lanes );
+            lane[ lanes++ ] = w;
+        }
+        if( lanes == 0 )
+            return;
+        HashLanes blocks[16];
+        HashLanes state[5];
+        memcpy( blocks, block, sizeof( blocks ) );
+        init( state );
+        compress( state, blocks );
+        for( size_t i = 0; i < lanes; ++i )
+        {
+            uint32_t words[5];
+            for( size_t j = 0; j < 5; ++j )
+                words[j] = state[j][i];
+            store( words, digests + lane[i] * digestSize() );
+        }
+    }
+
+protected:
+    //UTF-8 to UTF-16LE, a byte that does not start a valid sequence is taken as Latin-1
+    static void toUtf16( const char* word, size_t length, vector< uint8_t >& out )
+    {
+        //never more than 2 bytes for every byte of UTF-8
+        out.resize( length * 2 );
+        uint8_t* o = out.data();
+        const uint8_t* s = (const uint8_t*)word;
+        for( size_t i = 0; i < length; )
+        {
+            uint32_t c = s[i];
+            if( c < 0x80 )
+            {
+                *o++ = (uint8_t)c;
+                *o++ = 0;
+                ++i;
+                continue;
+            }
+            size_t extra = ( c >= 0xf0 && c < 0xf5 ) ? 3 : ( c >= 0xe0 && c < 0xf0 ) ? 2 : ( c >= 0xc2 && c < 0xe0 ) ? 1 : 0;
+            size_t k = 1;
+            if( extra && i + extra < length )
+            {
+                uint32_t code = c & ( 0x3f >> extra );
+                for( ; k <= extra && ( s[ i + k ] & 0xc0 ) == 0x80; ++k )
+                    code = ( code << 6 ) | ( s[ i + k ] & 0x3f );
+                if( k > extra && !( extra == 2 && ( code < 0x800 || ( code >= 0xd800 && code < 0xe000 ) ) ) &&
+                    !( extra == 3 && ( code < 0x10000 || code > 0x10ffff ) ) )
+                    c = code;
+                else
+                    k = 1;
+            }
+            i += k;
+            if( c >= 0x10000 )
+            {
+                c -= 0x10000;
+                uint32_t high = 0xd800 + ( c >> 10 ), low = 0xdc00 + ( c & 0x3ff );
+                *o++ = (uint8_t)high;
+                *o++ = (uint8_t)( high >> 8 );
+                c = low;
+            }
+            *o++ = (uint8_t)c;
+            *o++ = (uint8_t)( c >> 8 );
+        }
+        out.resize( o - out.data() );
+    }
+
+    //the tail of a message of total bytes with its padding and length, one block
+    //when tail is up to 55 bytes, two from there on
+    void pad( const uint8_t* tail, size_t length, uint64_t total, uint8_t* out ) const
+    {
+        size_t size = ( length > BLOCK_SIZE - 9 ) ? 2 * BLOCK_SIZE : BLOCK_SIZE;
+        memset( out, 0, size );
+        memcpy( out, tail, length );
+        out[ length ] = 0x80;
+        uint64_t bits = total * 8;
+        for( size_t i = 0; i < 8; ++i )
+            out[ size - 8 + i ] = (uint8_t)( m_type == eSha1 ? bits >> ( 56 - 8 * i ) : bits >> ( 8 * i ) );
+    }
+
+    template< bool BIG >
+    static inline uint32_t load( const uint8_t* p )
+    {
+        if( BIG )
+            return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 ) | ( (uint32_t)p[2] << 8 ) | p[3];
+        return p[0] | ( (uint32_t)p[1] << 8 ) | ( (uint32_t)p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+    }
+
+    //puts a message of up to 55 bytes with its padding into one lane of the zeroed
+    //blocks, its length in bits fits the last word
+    template< bool BIG >
+    static inline void pack( const uint8_t* message, size_t length, uint32_t ( *block )[ LANES ], size_t lane )
+    {
+        size_t full = length / 4;
+        for( size_t i = 0; i < full; ++i )
+            block[i][ lane ] = load< BIG >( message + i * 4 );
+        uint8_t tail[4] = { 0, 0, 0, 0 };
+        for( size_t i = 0; i < length % 4; ++i )
+            tail[i] = message[ full * 4 + i ];
+        tail[ length % 4 ] = 0x80;
+        block[ full ][ lane ] = load< BIG >( tail );
+        block[ BIG ? 15 : 14 ][ lane ] = (uint32_t)( length * 8 );
+    }
+
+    void hashLong( const uint8_t* message, size_t length, uint8_t* digest ) const
+    {
+        uint32_t state[5];
+        uint32_t block[16];
+        init( state );
+        size_t done = 0;
+        for( ; length - done >= BLOCK_SIZE; done += BLOCK_SIZE )
+            compress( state, loadBlock( message + done, block ) );
+        uint8_t padded[ 2 * BLOCK_SIZE ];
+        pad( message + done, length - done, length, padded );
+        compress( state, loadBlock( padded, block ) );
+        if( length - done > BLOCK_SIZE - 9 )
+            compress( state, loadBlock( padded + BLOCK_SIZE, block ) );
+        store( state, digest );
+    }
+
+    const uint32_t* loadBlock( const uint8_t* data, uint32_t* block ) const
+    {
+        for( size_t i = 0; i < 16; ++i )
+            block[i] = ( m_type == eSha1 ) ? load< true >( data + i * 4 ) : load< false >( data + i * 4 );
+        return block;
+    }
+
+    template< class T >
+    static void init( T* state )
+    {
+        static const uint32_t initial[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+        for( size_t i = 0; i < 5; ++i )
+        {
+            state[i] = T();
+            state[i] = state[i] + initial[i];
+        }
+    }
+
+    void store( const uint32_t* state, uint8_t* digest ) const
+    {
+        for( size_t i = 0; i < digestSize() / 4; ++i )
+        {
+            for( size_t b = 0; b < 4; ++b )
+                digest[ i * 4 + b ] = (uint8_t)( m_type == eSha1 ? state[i] >> ( 24 - 8 * b ) : state[i] >> ( 8 * b ) );
+        }
+    }
+
+    template< class T >
+    void compress( T* state, const T* block ) const
+    {
+        if( m_type == eMd5 )
+            md5( state, block );
+        else if( m_type == eSha1 )
+            sha1( state, block );
+        else
+            md4( state, block );
+    }
+
+    template< class T >
+    static inline T rotl( const T& v, unsigned s )
+    {
+        return ( v << s ) | ( v >> ( 32 - s ) );
+    }
+
+    //the round functions
+    struct Choose{
+        template< class T >
+        inline T operator()( const T& b, const T& c, const T& d ) const
+        {
+            return d ^ ( b & ( c ^ d ) );
+        }
+    };
+
+    struct Majority{
+        template< class T >
+        inline T operator()( const T& b, const T& c, const T& d ) const
+        {
+            return ( b & c ) | ( d & ( b | c ) );
+        }
+    };
+
+    struct Parity{
+        template< class T >
+        inline T operator()( const T& b, const T& c, const T& d ) const
+        {
+            return b ^ c ^ d;
+        }
+    };
+
+    struct Md5G{
+        template< class T >
+        inline T operator()( const T& b, const T& c, const T& d ) const
+        {
+            return c ^ ( d & ( b ^ c ) );
+        }
+    };
+
+    struct Md5I{
+        template< class T >
+        inline T operator()( const T& b, const T& c, const T& d ) const
+        {
+            return c ^ ( b | ~d );
+        }
+    };
+
+    //one step, the callers rotate the variables they pass instead of moving the values
+    template< class F, class T >
+    static inline void md5Step( T& a, const T& b, const T& c, const T& d, const T& m, uint32_t k, unsigned s )
+    {
+        a = b + rotl( a + F()( b, c, d ) + m + k, s );
+    }
+
+    template< class F, class T >
+    static inline void md4Step( T& a, const T& b, const T& c, const T& d, const T& m, uint32_t k, unsigned s )
+    {
+        a = rotl( a + F()( b, c, d ) + m + k, s );
+    }
+
+    template< class F, class T >
+    static inline void sha1Step( const T& a, T& b, const T& c, const T& d, T& e, const T& w, uint32_t k )
+    {
+        e = e + rotl( a, 5 ) + F()( b, c, d ) + w + k;
+        b = rotl( b, 30 );
+    }
+
+    template< class T >
+    static void md5( T* state, const T* x )
+    {
+        static const uint32_t K[64] = {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+            0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+            0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+            0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+            0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+            0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+        T a = state[0], b = state[1], c = state[2], d = state[3];
+        for( size_t i = 0; i < 16; i += 4 )
+        {
+            md5Step< Choose >( a, b, c, d, x[i], K[i], 7 );
+            md5Step< Choose >( d, a, b, c, x[ i + 1 ], K[ i + 1 ], 12 );
+            md5Step< Choose >( c, d, a, b, x[ i + 2 ], K[ i + 2 ], 17 );
+            md5Step< Choose >( b, c, d, a, x[ i + 3 ], K[ i + 3 ], 22 );
+        }
+        for( size_t i = 16; i < 32; i += 4 )
+        {
+            md5Step< Md5G >( a, b, c, d, x[ ( 5 * i + 1 ) % 16 ], K[i], 5 );
+            md5Step< Md5G >( d, a, b, c, x[ ( 5 * i + 6 ) % 16 ], K[ i + 1 ], 9 );
+            md5Step< Md5G >( c, d, a, b, x[ ( 5 * i + 11 ) % 16 ], K[ i + 2 ], 14 );
+            md5Step< Md5G >( b, c, d, a, x[ ( 5 * i + 16 ) % 16 ], K[ i + 3 ], 20 );
+        }
+        for( size_t i = 32; i < 48; i += 4 )
+        {
+            md5Step< Parity >( a, b, c, d, x[ ( 3 * i + 5 ) % 16 ], K[i], 4 );
+            md5Step< Parity >( d, a, b, c, x[ ( 3 * i + 8 ) % 16 ], K[ i + 1 ], 11 );
+            md5Step< Parity >( c, d, a, b, x[ ( 3 * i + 11 ) % 16 ], K[ i + 2 ], 16 );
+            md5Step< Parity >( b, c, d, a, x[ ( 3 * i + 14 ) % 16 ], K[ i + 3 ], 23 );
+        }
+        for( size_t i = 48; i < 64; i += 4 )
+        {
+            md5Step< Md5I >( a, b, c, d, x[ ( 7 * i ) % 16 ], K[i], 6 );
+            md5Step< Md5I >( d, a, b, c, x[ ( 7 * i + 7 ) % 16 ], K[ i + 1 ], 10 );
+            md5Step< Md5I >( c, d, a, b, x[ ( 7 * i + 14 ) % 16 ], K[ i + 2 ], 15 );
+            md5Step< Md5I >( b, c, d, a, x[ ( 7 * i + 21 ) % 16 ], K[ i + 3 ], 21 );
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    template< class T >
+    static void md4( T* state, const T* x )
+    {
+        T a = state[0], b = state[1], c = state[2], d = state[3];
+        for( size_t i = 0; i < 16; i += 4 )
+        {
+            md4Step< Choose >( a, b, c, d, x[i], 0, 3 );
+            md4Step< Choose >( d, a, b, c, x[ i + 1 ], 0, 7 );
+            md4Step< Choose >( c, d, a, b, x[ i + 2 ], 0, 11 );
+            md4Step< Choose >( b, c, d, a, x[ i + 3 ], 0, 19 );
+        }
+        for( size_t i = 0; i < 4; ++i )
+        {
+            md4Step< Majority >( a, b, c, d, x[i], 0x5a827999, 3 );
+            md4Step< Majority >( d, a, b, c, x[ i + 4 ], 0x5a827999, 5 );
+            md4Step< Majority >( c, d, a, b, x[ i + 8 ], 0x5a827999, 9 );
+            md4Step< Majority >( b, c, d, a, x[ i + 12 ], 0x5a827999, 13 );
+        }
+        for( size_t i = 0; i < 4; ++i )
+        {
+            size_t j = ( i & 1 ) * 2 + ( i >> 1 );  //0, 2, 1, 3
+            md4Step< Parity >( a, b, c, d, x[j], 0x6ed9eba1, 3 );
+            md4Step< Parity >( d, a, b, c, x[ j + 8 ], 0x6ed9eba1, 9 );
+            md4Step< Parity >( c, d, a, b, x[ j + 4 ], 0x6ed9eba1, 11 );
+            md4Step< Parity >( b, c, d, a, x[ j + 12 ], 0x6ed9eba1, 15 );
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    template< class T >
+    static void sha1( T* state, const T* x )
+    {
+        T w[80];
+        for( size_t i = 0; i < 16; ++i )
+            w[i] = x[i];
+        for( size_t i = 16; i < 80; i += 4 )
+        {
+            w[i] = rotl( w[ i - 3 ] ^ w[ i - 8 ] ^ w[ i - 14 ] ^ w[ i - 16 ], 1 );
+            w[ i + 1 ] = rotl( w[ i - 2 ] ^ w[ i - 7 ] ^ w[ i - 13 ] ^ w[ i - 15 ], 1 );
+            w[ i + 2 ] = rotl( w[ i - 1 ] ^ w[ i - 6 ] ^ w[ i - 12 ] ^ w[ i - 14 ], 1 );
+            w[ i + 3 ] = rotl( w[i] ^ w[ i - 5 ] ^ w[ i - 11 ] ^ w[ i - 13 ], 1 );
+        }
+        T a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for( size_t i = 0; i < 20; i += 5 )
+        {
+            sha1Step< Choose >( a, b, c, d, e, w[i], 0x5a827999 );
+            sha1Step< Choose >( e, a, b, c, d, w[ i + 1 ], 0x5a827999 );
+            sha1Step< Choose >( d, e, a, b, c, w[ i + 2 ], 0x5a827999 );
+            sha1Step< Choose >( c, d, e, a, b, w[ i + 3 ], 0x5a827999 );
+            sha1Step< Choose >( b, c, d, e, a, w[ i + 4 ], 0x5a827999 );
+        }
+        for( size_t i = 20; i < 40; i += 5 )
+        {
+            sha1Step< Parity >( a, b, c, d, e, w[i], 0x6ed9eba1 );
+            sha1Step< Parity >( e, a, b, c, d, w[ i + 1 ], 0x6ed9eba1 );
+            sha1Step< Parity >( d, e, a, b, c, w[ i + 2 ], 0x6ed9eba1 );
+            sha1Step< Parity >( c, d, e, a, b, w[ i + 3 ], 0x6ed9eba1 );
+            sha1Step< Parity >( b, c, d, e, a, w[ i + 4 ], 0x6ed9eba1 );
+        }
+        for( size_t i = 40; i < 60; i += 5 )
+        {
+            sha1Step< Majority >( a, b, c, d, e, w[i], 0x8f1bbcdc );
+            sha1Step< Majority >( e, a, b, c, d, w[ i + 1 ], 0x8f1bbcdc );
+            sha1Step< Majority >( d, e, a, b, c, w[ i + 2 ], 0x8f1bbcdc );
+            sha1Step< Majority >( c, d, e, a, b, w[ i + 3 ], 0x8f1bbcdc );
+            sha1Step< Majority >( b, c, d, e, a, w[ i + 4 ], 0x8f1bbcdc );
+        }
+        for( size_t i = 60; i < 80; i += 5 )
+        {
+            sha1Step< Parity >( a, b, c, d, e, w[i], 0xca62c1d6 );
+            sha1Step< Parity >( e, a, b, c, d, w[ i + 1 ], 0xca62c1d6 );
+            sha1Step< Parity >( d, e, a, b, c, w[ i + 2 ], 0xca62c1d6 );
+            sha1Step< Parity >( c, d, e, a, b, w[ i + 3 ], 0xca62c1d6 );
+            sha1Step< Parity >( b, c, d, e, a, w[ i + 4 ], 0xca62c1d6 );
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+protected:
+    Type                m_type;
+    vector< uint8_t >   m_utf16;    //scratch of NTLM
+};
+
+//the digests to look for, loaded from a file of one hex digest per line. anything
+//after the digest from a ':' or a blank on is ignored, so are empty lines and the
+//ones starting with '#'. the digests sit in an open addressing table of their first
+//8 bytes: a lookup reads one or two neighbouring slots of 16 bytes and compares the
+//whole digest only when a key matches
+class HashTargets{
+public:
+    HashTargets() : m_digestSize( 0 ), m_mask( 0 ), m_found( 0 )
+    {
+    }
+
+    //badLine: the number of the first line that is not a digest of digestSize bytes
+    ErrorMan::ErrorCode load( const char* fileName, size_t digestSize, size_t& badLine )
+    {
+        MappedFile file;
+        ErrorMan::ErrorCode err = file.open( fileName );
+        if( err != ErrorMan::eOk )
+            return err;
+        m_digestSize = digestSize;
+        m_digests.clear();
+        badLine = 0;
+        const char* p = file.data();
+        const char* end = p + file.size();
+        uint8_t digest[ Hasher::MAX_DIGEST ];
+        unordered_set< string > seen;
+        for( size_t line = 1; p < end; ++line )
+        {
+            const char* eol = (const char*)memchr( p, '\n', end - p );
+            if( eol == NULL )
+                eol = end;
+            const char* s = p;
+            p = eol + 1;
+            while( s < eol && ( *s == ' ' || *s == '\t' ) )
+                ++s;
+            if( s == eol || *s == '\r' || *s == '#' )
+                continue;
+            size_t i = 0;
+            for( ; i < digestSize * 2 && s + i < eol && isxdigit( (unsigned char)s[i] ); ++i )
+            {
+                uint8_t v = (uint8_t)( isdigit( (unsigned char)s[i] ) ? s[i] - '0' : ( tolower( (unsigned char)s[i] ) - 'a' + 10 ) );
+                digest[ i / 2 ] = ( i % 2 ) ? (uint8_t)( digest[ i / 2 ] | v ) : (uint8_t)( v << 4 );
+            }
+            if( i != digestSize * 2 || ( s + i < eol && !strchr( ": \t\r", s[i] ) ) )
+            {
+                badLine = line;
+                return ErrorMan::eInvalidParam;
+            }
+            if( seen.insert( string( (const char*)digest, digestSize ) ).second )
+                m_digests.insert( m_digests.end(), digest, digest + digestSize );
+        }
+        build();
+        return ErrorMan::eOk;
+    }
+
+    inline size_t size() const
+    {
+        return m_digestSize ? m_digests.size() / m_digestSize : 0;
+    }
+
+    //index: the number of the digest found
+    inline bool find( const uint8_t* digest, uint32_t& index ) const
+    {
+        uint64_t key = keyOf( digest );
+        for( size_t slot = key & m_mask; m_slots[ slot ].index; slot = ( slot + 1 ) & m_mask )
+        {
+            const Slot& s = m_slots[ slot ];
+            if( s.key == key && memcmp( &m_digests[ ( s.index - 1 ) * (size_t)m_digestSize ], digest, m_digestSize ) == 0 )
+            {
+                index = s.index - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //true the first time a digest is found
+    bool markFound( uint32_t index )
+    {
+        lock_guard< mutex > lock( m_mutex );
+        if( m_isFound[ index ] )
+            return false;
+        m_isFound[ index ] = true;
+        ++m_found;
+        return true;
+    }
+
+    inline size_t found() const
+    {
+        return m_found.load( memory_order_relaxed );
+    }
+
+    inline bool allFound() const
+    {
+        return found() == size();
+    }
+
+protected:
+    struct Slot{
+        uint64_t    key;
+        uint64_t    index;  //of the digest plus 1, 0 for an empty slot
+    };
+
+    //digests are uniform, their first bytes need no more hashing
+    static inline uint64_t keyOf( const uint8_t* digest )
+    {
+        uint64_t key;
+        memcpy( &key, digest, sizeof( key ) );
+        return key;
+    }
+
+    //at most half of the slots are used
+    void build()
+    {
+        size_t count = size();
+        size_t slots = 16;
+        while( slots < count * 2 )
+            slots *= 2;
+        m_mask = slots - 1;
+        Slot empty = { 0, 0 };
+        m_slots.assign( slots, empty );
+        for( size_t i = 0; i < count; ++i )
+        {
+            uint64_t key = keyOf( &m_digests[ i * m_digestSize ] );
+            size_t slot = key & m_mask;
+            while( m_slots[ slot ].index )
+                slot = ( slot + 1 ) & m_mask;
+            m_slots[ slot ].key = key;
+            m_slots[ slot ].index = i + 1;
+        }
+        m_isFound.assign( count, false );
+        m_found = 0;
+    }
+
+    size_t              m_digestSize;
+    size_t              m_mask;
+    vector< Slot >      m_slots;
+    vector< uint8_t >   m_digests;
+    vector< bool >      m_isFound;
+    atomic< size_t >    m_found;
+    mutex               m_mutex;
+};
+
+//hashes the words given to it LANES at a time and looks their digests up in the
+//targets. every match appends the line digest:word to matches. one per thread
+class HashMatcher{
+public:
+    HashMatcher( Hasher::Type type, HashTargets& targets, char separator ) : m_hasher( type ), m_targets( targets ),
+        m_separator( separator ), m_count( 0 )
+    {
+    }
+
+    inline void add( const char* word, size_t length )
+    {
+        m_words[ m_count++ ].assign( word, length );
+        if( m_count == Hasher::LANES )
+            flush();
+    }
+
+    void flush()
+    {
+        if( m_count == 0 )
+            return;
+        const char* words[ Hasher::LANES ];
+        size_t lengths[ Hasher::LANES ];
+        for( size_t i = 0; i < m_count; ++i )
+        {
+            words[i] = m_words[i].data();
+            lengths[i] = m_words[i].size();
+        }
+        size_t size = m_hasher.digestSize();
+        m_hasher.hash( words, lengths, m_count, m_digests );
+        for( size_t i = 0; i < m_count; ++i )
+        {
+            uint32_t index;
+            if( !m_targets.find( m_digests + i * size, index ) )
+                continue;
+            m_targets.markFound( index );
+            addMatch( m_digests + i * size, m_words[i] );
+        }
+        m_count = 0;
+    }
+
+    //the lines of the matches so far, the caller takes and clears them
+    inline string& matches()
+    {
+        return m_matches;
+    }
+
+protected:
+    void addMatch( const uint8_t* digest, const string& word )
+    {
+        static const char HEX[] = "0123456789abcdef";
+        for( size_t i = 0; i < m_hasher.digestSize(); ++i )
+        {
+            m_matches += HEX[ digest[i] >> 4 ];
+            m_matches += HEX[ digest[i] & 15 ];
+        }
+        m_matches += ':';
+        m_matches += word;
+        m_matches += m_separator;
+    }
+
+    Hasher          m_hasher;
+    HashTargets&    m_targets;
+    char            m_separator;
+    size_t          m_count;
+    string          m_words[ Hasher::LANES ];
+    uint8_t         m_digests[ Hasher::LANES * Hasher::MAX_DIGEST ];
+    string          m_matches;
+};
+
+//splits the keyspace of the main producer into chunks of consecutive word indexes.
+//every worker thread positions its own cursor on a chunk, renders it into its own
+//buffer and hands the buffer to the writer, either in chunk order or as soon as it is full
+class ParallelGenerator{
+public:
+    static const size_t CHUNK_SIZE = 1024*1024*4; //4M
+    static const size_t BATCH_BYTES = 4096;         //of the words hashed from one batch
+
+    ParallelGenerator( const Plan& plan, OutputWriter& writer ) : m_plan( plan ), m_writer( writer ),
+        m_begin( 0 ), m_end( 0 ), m_chunkWords( 1 ), m_chunks( 0 ), m_nextChunk( 0 ),
+        m_nextWrite( 0 ), m_ordered( true ), m_failed( false ), m_startFailed( false ), m_checkpoint( NULL ), m_permutation( NULL ),
+        m_progress( NULL ), m_hashType( Hasher::eMd5 ), m_targets( NULL )
+    {
+    }
+
+    //hashes the words instead of writing them and writes the lines of the matches,
+    //the threads stop when every target was found
+    void setTargets( Hasher::Type type, HashTargets* targets )
+    {
+        m_hashType = type;
+        m_targets = targets;
+    }
+
+    //counts the words and positions of every chunk written
+    void setProgress( Progress* progress )
+    {
+        m_progress = progress;
+    }
+
+    //run() takes positions of the permutation instead of word indexes
+    void setPermutation( const Permutation* permutation )
+    {
+        m_permutation = permutation;
+    }
+
+    void setOrdered( bool ordered )
+    {
+        m_ordered = ordered;
+    }
+
+    //saves the position after the chunks written in order, needs ordered output
+    void setCheckpoint( Checkpoint* checkpoint )
+    {
+        m_checkpoint = checkpoint;
+    }
+
+    //generates the words [begin, end) with the given count of threads, false when
+    //the output failed or a thread could not be started
+    bool run( uint64_t begin, uint64_t end, int threads )
+    {
+        m_begin = begin;
+        m_end = end;
+        m_chunkWords = max( (size_t)1, CHUNK_SIZE / ( m_plan.node( m_plan.root() ).maxLength + 1 ) );
+        m_chunks = ( end - begin + m_chunkWords - 1 ) / m_chunkWords;
+        m_nextChunk = 0;
+        m_nextWrite = 0;
+        m_failed = false;
+        m_startFailed = false;
+
+        vector< thread > workers;
+        try
+        {
+            for( int i = 0; i < threads; ++i )
+                workers.push_back( thread( &ParallelGenerator::work, this ) );
+        }catch( const system_error& )
+        {
+            //the threads started already see m_failed and stop
+            m_startFailed = true;
+            m_failed = true;
+        }
+        for( size_t i = 0; i < workers.size(); ++i )
+            workers[i].join();
+        return !m_failed;
+    }
+
+    //the last run failed because a thread could not be started
+    bool startFailed() const
+    {
+        return m_startFailed;
+    }
+
+protected:
+    void work()
+    {
+        Cursor cursor;
+        BlockEncoder encoder;
+        BlockEncoder* blocks = ( m_writer.format() == OutputWriter::eFormatBlocks ) ? &encoder : NULL;
+        size_t maxLength = m_plan.node( m_plan.root() ).maxLength;
+        char separator = m_writer.separator();
+        if( m_targets )
+        {
+            HashMatcher matcher( m_hashType, *m_targets, separator );
+            hash( cursor, matcher );
+            return;
+        }
+        vector< char > buffer( m_chunkWords * ( blocks ? BlockFormat::maxEntry( maxLength ) : maxLength + 1 ) + Cursor::BATCH_CHUNK );
+        for( ;; )
+        {
+            uint64_t chunk = m_nextChunk++;
+            if( chunk >= m_chunks || m_failed )
+                break;
+
+            uint64_t first = m_begin + chunk * m_chunkWords;
+            uint64_t end = first + min( (uint64_t)m_chunkWords, m_end - first );
+            char* out = buffer.data();
+            uint64_t words = 0;
+            encoder.reset( out );
+            if( m_permutation )
+            {
+                for( uint64_t position = first; position < end; ++position )
+                {
+                    uint64_t index = m_permutation->index( position );
+                    cursor.seek( &m_plan, index, index + 1 );
+                    if( cursor.atEnd() || cursor.index() != index )
+                        continue;   //a removed duplicate
+                    out = copyWord( cursor, out, separator, blocks );
+                    ++words;
+                }
+            }else
+            {
+                cursor.seek( &m_plan, first, end );
+                while( !cursor.atEnd() && cursor.index() < end )
+                {
+                    size_t bytes;
+                    size_t batch = blocks ? 0 : cursor.nextBatch( out, buffer.data() + buffer.size() - out,
+                        end - cursor.index(), &separator, bytes );
+                    if( batch )
+                    {
+                        out += bytes;
+                        words += batch;
+                        continue;
+                    }
+                    out = copyWord( cursor, out, separator, blocks );
+                    ++words;
+                    cursor.next();
+                }
+            }
+            if( blocks )
+                out = encoder.close( out );
+            emit( chunk, buffer.data(), out - buffer.data(), blocks );
+            if( m_progress && !m_failed )
+                m_progress->add( words, end - first );
+        }
+    }
+
+    //work() with targets: the chunks are hashed and only their matches written
+    void hash( Cursor& cursor, HashMatcher& matcher )
+    {
+        //the words of a batch, back to back
+        vector< char > batch( BATCH_BYTES + Cursor::BATCH_CHUNK );
+        for( ;; )
+        {
+            uint64_t chunk = m_nextChunk++;
+            if( chunk >= m_chunks || m_failed || m_targets->allFound() )
+                break;
+
+            uint64_t first = m_begin + chunk * m_chunkWords;
+            uint64_t end = first + min( (uint64_t)m_chunkWords, m_end - first );
+            uint64_t words = 0;
+            size_t length;
+            if( m_permutation )
+            {
+                for( uint64_t position = first; position < end; ++position )
+                {
+                    uint64_t index = m_permutation->index( position );
+                    cursor.seek( &m_plan, index, index + 1 );
+                    if( cursor.atEnd() || cursor.index() != index )
+                        continue;
+                    const char* word = cursor.word( length );
+                    matcher.add( word, length );
+                    ++words;
+                }
+            }else
+            {
+                cursor.seek( &m_plan, first, end );
+                while( !cursor.atEnd() && cursor.index() < end )
+                {
+                    size_t bytes;
+                    size_t count = cursor.nextBatch( batch.data(), batch.size(), end - cursor.index(), NULL, bytes );
+                    if( count )
+                    {
+                        length = bytes / count;
+                        for( size_t i = 0; i < count; ++i )
+                            matcher.add( batch.data() + i * length, length );
+                        words += count;
+                        continue;
+                    }
+                    const char* word = cursor.word( length );
+                    matcher.add( word, length );
+                    ++words;
+                    cursor.next();
+                }
+            }
+            matcher.flush();
+            emit( chunk, matcher.matches().data(), matcher.matches().size(), NULL );
+            matcher.matches().clear();
+            if( m_progress && !m_failed )
+                m_progress->add( words, end - first );
+        }
+    }
+
+    static inline char* copyWord( Cursor& cursor, char* out, char separator, BlockEncoder* blocks )
+    {
+        size_t length, shared;
+        const char* word = cursor.word( length, shared );
+        if( blocks )
+            return blocks->add( out, word, length, shared );
+        memcpy( out, word, length );
+        out += length;
+        *out++ = separator;
+        return out;
+    }
+
+    void emit( uint64_t chunk, const char* data, size_t length, const BlockEncoder* blocks )
+    {
+        unique_lock< mutex > lock( m_mutex );
+        if( m_ordered )
+        {
+            while( chunk != m_nextWrite && !m_failed )
+                m_written.wait( lock );
+        }
+        if( !m_failed && !( blocks ? m_writer.writeBlocks( data, length, blocks->blocks() ) :
+            m_writer.writeBlock( data, length ) ) )
+            m_failed = true;
+        if( m_checkpoint && m_ordered && !m_failed )
+        {
+            uint64_t next = min( m_end, m_begin + ( chunk + 1 ) * m_chunkWords );
+            if( m_checkpoint->due( next ) && !m_checkpoint->save( next, m_writer ) )
+                m_failed = true;
+        }
+        ++m_nextWrite;
+        m_written.notify_all();
+    }
+
+protected:
+    const Plan&         m_plan;
+    OutputWriter&       m_writer;
+    uint64_t            m_begin;
+    uint64_t            m_end;
+    size_t              m_chunkWords;
+    uint64_t            m_chunks;
+    atomic< uint64_t >  m_nextChunk;
+    uint64_t            m_nextWrite;
+    bool                m_ordered;
+    atomic< bool >      m_failed;
+    bool                m_startFailed;
+    Checkpoint*         m_checkpoint;
+    const Permutation*  m_permutation;
+    Progress*           m_progress;
+    Hasher::Type        m_hashType;
+    HashTargets*        m_targets;
+    mutex               m_mutex;
+    condition_variable  m_written;
+};
+
+//writes a C++ source file that generates the words of a plan without interpreting
+//it: every node becomes a function template calling its continuation k once per
+//word, a leaf loops over a constant table and a sequence nests the loops of its items.
+//the first item of a sequence changes fastest, so the words are built from their end
+//backwards and k gets the start of the part written so far. the compiler inlines the
+//whole grammar into nested loops ending in one copy to a preallocated buffer. the
+//program writes to stdout
+class CppEmitter{
+public:
+    static const size_t BUFFER_SIZE     = 1024*1024;    //1M, the output buffer of the program
+    static const size_t LINE_BYTES      = 64;           //terminal bytes per line of a table
+    static const size_t DEFAULT_DEPTH   = 900;          //template depth compilers allow by default
+
+    explicit CppEmitter( const Plan& plan ) : m_plan( plan ), m_file( NULL ), m_depth( 0 )
+    {
+    }
+
+    //false when the plan skips words while generating, with its filters or by
+    //removing duplicates at run time. the program has nested loops only
+    bool canEmit() const
+    {
+        if( m_plan.hasFilter() )
+            return false;
+        for( uint32_t i = 0; i < m_plan.nodeCount(); ++i )
+        {
+            if( m_plan.node( i ).deduplicate )
+                return false;
+        }
+        return true;
+    }
+
+    //rulesName: named in the comment at the top of the source
+    ErrorMan::ErrorCode emit( const char* fileName, const char* rulesName, char separator )
+    {
+        m_file = fopen( fileName, "w" );
+        if( m_file == NULL )
+            return ErrorMan::eCanNotOpenFile;
+        m_emitted.assign( m_plan.nodeCount(), false );
+        m_depth = m_plan.depth();
+
+        const Plan::Node& root = m_plan.node( m_plan.root() );
+        fprintf( m_file, "//generated by crunchx from %s, do not edit\n", rulesName );
+        if( root.words == Plan::WORDS_OVERFLOW )
+            fprintf( m_file, "//words: more than 2^64\n" );
+        else
+            fprintf( m_file, "//words: %llu\n", (unsigned long long)root.words );
+        fprintf( m_file, "//build: g++ -O3%s -o wordlist this.cpp\n\n", depthFlag().c_str() );
+        fprintf( m_file, "#include <stdio.h>\n#include <stdint.h>\n#include <string.h>\n" );
+        fprintf( m_file, "#ifdef _WIN32\n#include <io.h>\n#include <fcntl.h>\n#endif\n\n" );
+        fprintf( m_file, "namespace{\n\n" );
+        fprintf( m_file, "const size_t BUFFER_SIZE = %llu;\n", (unsigned long long)max( (size_t)BUFFER_SIZE, root.maxLength + 1 ) );
+        fprintf( m_file, "const size_t MAX_LENGTH = %llu;\n", (unsigned long long)root.maxLength );
+        fprintf( m_file, "const char SEPARATOR = %s;\n\n", separator ? "'\\n'" : "'\\0'" );
+        fprintf( m_file, "char g_word[ MAX_LENGTH + 1 ];\nchar g_buffer[ BUFFER_SIZE ];\nsize_t g_used = 0;\n"
+            "bool g_failed = false;\n\n" );
+        fprintf( m_file,
+            "void flush()\n"
+            "{\n"
+            "    if( g_used && fwrite( g_buffer, 1, g_used, stdout ) != g_used )\n"
+            "        g_failed = true;\n"
+            "    g_used = 0;\n"
+            "}\n\n"
+            "//the continuation of the whole word: appends it to the buffer\n"
+            "struct Emit{\n"
+            "    inline void operator()( const char* start ) const\n"
+            "    {\n"
+            "        size_t length = g_word + MAX_LENGTH - start;\n"
+            "        if( length >= BUFFER_SIZE - g_used )\n"
+            "            flush();\n"
+            "        memcpy( g_buffer + g_used, start, length );\n"
+            "        g_buffer[ g_used + length ] = SEPARATOR;\n"
+            "        g_used += length + 1;\n"
+            "    }\n"
+            "};\n\n" );
+        emitNode( m_plan.root() );
+        fprintf( m_file, "}\n\n" );
+        fprintf( m_file,
+            "int main()\n"
+            "{\n"
+            "#ifdef _WIN32\n"
+            "    _setmode( _fileno( stdout ), _O_BINARY );\n"
+            "#endif\n"
+            "    n%u( g_word + MAX_LENGTH, Emit() );\n"
+            "    flush();\n"
+            "    return ( g_failed || fflush( stdout ) != 0 ) ? 1 : 0;\n"
+            "}\n", m_plan.root() );
+        bool ok = ( ferror( m_file ) == 0 );
+        ok = ( fclose( m_file ) == 0 ) && ok;
+        m_file = NULL;
+        return ok ? ErrorMan::eOk : ErrorMan::eWriteFileErr;
+    }
+
+    //the option g++ and clang need for the nesting of the plan, empty when the default does
+    string depthFlag() const
+    {
+        if( m_depth < DEFAULT_DEPTH )
+            return string();
+        char flag[48];
+        snprintf( flag, sizeof( flag ), " -ftemplate-depth=%u", (unsigned)( m_depth + 100 ) );
+        return flag;
+    }
+
+protected:
+    //the children first, a template is declared before its callers. the nodes whose
+    //children are not all emitted yet wait on a stack with the next child to visit
+    void emitNode( uint32_t index )
+    {
+        vector< pair< uint32_t, uint32_t > > open;
+        m_emitted[ index ] = true;
+        open.push_back( make_pair( index, 0 ) );
+        while( !open.empty() )
+        {
+            uint32_t top = open.back().first;
+            const Plan::Node& n = m_plan.node( top );
+            if( n.type != Plan::eLeaf && open.back().second < n.count )
+            {
+                uint32_t c = m_plan.child( n, open.back().second++ );
+                if( !m_emitted[c] )
+                {
+                    m_emitted[c] = true;
+                    open.push_back( make_pair( c, 0 ) );
+                }
+                continue;
+            }
+            open.pop_back();
+            if( n.type == Plan::eLeaf )
+                emitLeaf( top, n );
+            else
+                emitTemplate( top, n );
+        }
+    }
+
+    void emitTemplate( uint32_t index, const Plan::Node& n )
+    {
+        fprintf( m_file, "template< class K > inline void n%u( char* p0, const K& k )\n{\n", index );
+        if( n.type == Plan::eAlternation )
+        {
+            for( uint32_t i = 0; i < n.count; ++i )
+                fprintf( m_file, "    n%u( p0, k );\n", m_plan.child( n, i ) );
+        }else if( n.count == 0 )
+            fprintf( m_file, "    k( p0 );\n" );
+        else
+        {
+            //n2( p0, [&]( char* p1 ){ n1( p1, [&]( char* p2 ){ n0( p2, k ); } ); } );
+            for( uint32_t i = 0; i + 1 < n.count; ++i )
+                fprintf( m_file, "%*sn%u( p%u, [&]( char* p%u ){\n", (int)( 4 + i * 4 ), "",
+                    m_plan.child( n, n.count - 1 - i ), i, i + 1 );
+            fprintf( m_file, "%*sn%u( p%u, k );\n", (int)( n.count * 4 ), "", m_plan.child( n, 0 ), n.count - 1 );
+            for( uint32_t i = n.count - 1; i > 0; --i )
+                fprintf( m_file, "%*s} );\n", (int)( i * 4 ), "" );
+        }
+        fprintf( m_file, "}\n\n" );
+    }
+
+    void emitLeaf( uint32_t index, const Plan::Node& n )
+    {
+        bool fixed = true;
+        for( uint32_t i = 1; i < n.count && fixed; ++i )
+            fixed = ( m_plan.terminalLength( n.first + i ) == m_plan.terminalLength( n.first ) );
+        uint32_t length = n.count ? m_plan.terminalLength( n.first ) : 0;
+
+        //the terminals back to back, with their offsets when their lengths differ
+        fprintf( m_file, "constexpr char t%u[] =", index );
+        size_t line = LINE_BYTES;
+        uint64_t total = 0;
+        for( uint32_t i = 0; i < n.count; ++i )
+        {
+            const char* text = m_plan.terminal( n.first + i );
+            for( uint32_t j = 0; j < m_plan.terminalLength( n.first + i ); ++j, ++line )
+            {
+                if( line >= LINE_BYTES )
+                {
+                    fprintf( m_file, "%s\n    \"", total || j ? "\"" : "" );
+                    line = 0;
+                }
+                putChar( text[j] );
+            }
+            total += m_plan.terminalLength( n.first + i );
+        }
+        fprintf( m_file, total ? "\";\n" : " \"\";\n" );
+        if( !fixed )
+        {
+            fprintf( m_file, "constexpr uint%u_t o%u[] = {", total > 0xffffffffULL ? 64 : 32, index );
+            uint64_t offset = 0;
+            for( uint32_t i = 0; i <= n.count; ++i )
+            {
+                fprintf( m_file, "%s%llu", i == 0 ? "\n    " : ( i % 16 ) ? "," : ",\n    ", (unsigned long long)offset );
+                if( i < n.count )
+                    offset += m_plan.terminalLength( n.first + i );
+            }
+            fprintf( m_file, " };\n" );
+        }
+
+        fprintf( m_file, "template< class K > inline void n%u( char* p, const K& k )\n{\n", index );
+        if( n.count == 0 )
+            fprintf( m_file, "    (void)p;\n    (void)k;\n" );
+        else if( n.count == 1 )
+            fprintf( m_file, "    memcpy( p - %u, t%u, %u );\n    k( p - %u );\n", length, index, length, length );
+        else if( fixed )
+        {
+            //a constant length lets the compiler turn the copy into a few moves
+            fprintf( m_file, "    for( size_t i = 0; i < %u; ++i )\n    {\n", n.count );
+            fprintf( m_file, "        memcpy( p - %u, t%u + i * %u, %u );\n        k( p - %u );\n    }\n", length, index, length,
+                length, length );
+        }else
+        {
+            fprintf( m_file, "    for( size_t i = 0; i < %u; ++i )\n    {\n", n.count );
+            fprintf( m_file, "        size_t length = o%u[ i + 1 ] - o%u[ i ];\n", index, index );
+            fprintf( m_file, "        memcpy( p - length, t%u + o%u[ i ], length );\n        k( p - length );\n    }\n", index, index );
         }
-        m_mainProductor = new ProducerReference( &(iter->second) );
-        return true;
+        fprintf( m_file, "}\n\n" );
     }
-private:
-    enum Status{ eIdle, eBuffIsSet, eRulesIsValid };
-    char*   m_rules;
-    size_t  m_rulesBuffSize;
-    size_t  m_rulesLength;
-    Status  m_status;
-    char*   m_rulesAnalysisIndex;
-    size_t  m_lineCount;
-    ProducerReference* m_mainProductor;
+
+    //one byte in a string literal, octal escapes always take three digits so a
+    //digit after one can not extend it
+    void putChar( char c )
+    {
+        unsigned char u = (unsigned char)c;
+        if( u == '"' || u == '\\' || u == '?' )
+            fprintf( m_file, "\\%c", c );
+        else if( u >= 0x20 && u < 0x7f )
+            fputc( c, m_file );
+        else
+            fprintf( m_file, "\\%03o", u );
+    }
+
+protected:
+    const Plan&     m_plan;
+    FILE*           m_file;
+    vector< bool >  m_emitted;
+    size_t          m_depth;
 };
 
 struct Argument{
     bool showHelp;
     bool creatDefaultRule;
+    bool useReference;
+    bool nulSeparator;
+    bool unordered;
+    bool count;
+    bool ambiguity;
+    bool dedup;
+    bool splice;
+    bool likely;
+    const char* minProb;
+    const char* likelyLimit;
+    const char* progress;
+    const char* summary;
+    const char* emitCpp;
+    bool dumpRules;
+    const char* hash;
+    const char* targets;
+    const char* threads;
+    const char* shuffle;
+    const char* sample;
+    const char* format;
+    const char* decode;
+    const char* shm;
+    const char* minLength;
+    const char* maxLength;
+    const char* policy;
+    const char* start;
+    const char* end;
+    const char* startWord;
+    const char* checkpoint;
+    const char* checkpointWords;
+    const char* checkpointSeconds;
+    const char* resume;
+    const char* shard;
+    const char* shardWeights;
+    const char* materialize;
     const char* ruleFile;
+    const char* outputFile;
     const char* unkonwArg;
     Argument()
     {
         showHelp = false;
         creatDefaultRule = false;
+        useReference = false;
+        nulSeparator = false;
+        unordered = false;
+        count = false;
+        ambiguity = false;
+        dedup = false;
+        threads = NULL;
+        start = NULL;
+        end = NULL;
+        startWord = NULL;
+        checkpoint = NULL;
+        checkpointWords = NULL;
+        checkpointSeconds = NULL;
+        resume = NULL;
+        shard = NULL;
+        shardWeights = NULL;
+        materialize = NULL;
+        shuffle = NULL;
+        sample = NULL;
+        format = NULL;
+        decode = NULL;
+        splice = false;
+        shm = NULL;
+        minLength = NULL;
+        maxLength = NULL;
+        policy = NULL;
+        likely = false;
+        minProb = NULL;
+        likelyLimit = NULL;
+        progress = NULL;
+        summary = NULL;
+        emitCpp = NULL;
+        dumpRules = false;
+        hash = NULL;
+        targets = NULL;
         ruleFile = NULL;
+        outputFile = NULL;
         unkonwArg = NULL;
     }
 };
@@ -855,35 +7161,275 @@ struct Argument{
 Argument getArgument( int argc, const char* argv[] )
 {
     Argument args;
-    bool toGetFileName = false;
+    const char** toGetValue = NULL;
     for( int i = 1; i < argc && args.unkonwArg == NULL; ++i )
     {
         const char* str = argv[i];
         int len = strlen( str );
-        if( len == 2 )
+        if( toGetValue )
         {
-            if( str[0] == '-' )
-            {
-                char c = str[1];
-                if( c == 'h' )
-                    args.showHelp = true;
-                else if( c == 'l' )
-                    args.creatDefaultRule = true;
-                else if( c == 'f' )
-                    toGetFileName = true;
-                else
-                    args.unkonwArg = str;
-            }else if( !toGetFileName )
-            {
+            *toGetValue = str;
+            toGetValue = NULL;
+        }else if( len == 2 && str[0] == '-' )
+        {
+            char c = str[1];
+            if( c == 'h' )
+                args.showHelp = true;
+            else if( c == 'l' )
+                args.creatDefaultRule = true;
+            else if( c == 'f' )
+                toGetValue = &args.ruleFile;
+            else if( c == 'o' )
+                toGetValue = &args.outputFile;
+            else if( c == 'r' )
+                args.useReference = true;
+            else if( c == 'z' )
+                args.nulSeparator = true;
+            else if( c == 't' )
+                toGetValue = &args.threads;
+            else if( c == 'u' )
+                args.unordered = true;
+            else
                 args.unkonwArg = str;
-            }else
+        }else if( len > 2 && str[0] == '-' && str[1] == '-' )
+        {
+            if( strcmp( str, "--count" ) == 0 )
+                args.count = true;
+            else if( strcmp( str, "--start" ) == 0 )
+                toGetValue = &args.start;
+            else if( strcmp( str, "--end" ) == 0 )
+                toGetValue = &args.end;
+            else if( strcmp( str, "--start-word" ) == 0 )
+                toGetValue = &args.startWord;
+            else if( strcmp( str, "--checkpoint" ) == 0 )
+                toGetValue = &args.checkpoint;
+            else if( strcmp( str, "--checkpoint-words" ) == 0 )
+                toGetValue = &args.checkpointWords;
+            else if( strcmp( str, "--checkpoint-seconds" ) == 0 )
+                toGetValue = &args.checkpointSeconds;
+            else if( strcmp( str, "--resume" ) == 0 )
+                toGetValue = &args.resume;
+            else if( strcmp( str, "--shard" ) == 0 )
+                toGetValue = &args.shard;
+            else if( strcmp( str, "--shard-weights" ) == 0 )
+                toGetValue = &args.shardWeights;
+            else if( strcmp( str, "--materialize" ) == 0 )
+                toGetValue = &args.materialize;
+            else if( strcmp( str, "--ambiguity" ) == 0 )
+                args.ambiguity = true;
+            else if( strcmp( str, "--dedup" ) == 0 )
+                args.dedup = true;
+            else if( strcmp( str, "--shuffle" ) == 0 )
+                toGetValue = &args.shuffle;
+            else if( strcmp( str, "--sample" ) == 0 )
+                toGetValue = &args.sample;
+            else if( strcmp( str, "--format" ) == 0 )
+                toGetValue = &args.format;
+            else if( strcmp( str, "--decode" ) == 0 )
+                toGetValue = &args.decode;
+            else if( strcmp( str, "--splice" ) == 0 )
+                args.splice = true;
+            else if( strcmp( str, "--shm" ) == 0 )
+                toGetValue = &args.shm;
+            else if( strcmp( str, "--min-len" ) == 0 )
+                toGetValue = &args.minLength;
+            else if( strcmp( str, "--max-len" ) == 0 )
+                toGetValue = &args.maxLength;
+            else if( strcmp( str, "--likely" ) == 0 )
+                args.likely = true;
+            else if( strcmp( str, "--min-prob" ) == 0 )
+                toGetValue = &args.minProb;
+            else if( strcmp( str, "--likely-limit" ) == 0 )
+                toGetValue = &args.likelyLimit;
+            else if( strcmp( str, "--policy" ) == 0 )
+                toGetValue = &args.policy;
+            else if( strcmp( str, "--progress" ) == 0 )
+                toGetValue = &args.progress;
+            else if( strcmp( str, "--summary" ) == 0 )
+                toGetValue = &args.summary;
+            else if( strcmp( str, "--emit-cpp" ) == 0 )
+                toGetValue = &args.emitCpp;
+            else if( strcmp( str, "--dump-rules" ) == 0 )
+                args.dumpRules = true;
+            else if( strcmp( str, "--hash" ) == 0 )
+                toGetValue = &args.hash;
+            else if( strcmp( str, "--targets" ) == 0 )
+                toGetValue = &args.targets;
+            else
+                args.unkonwArg = str;
+        }else
+            args.unkonwArg = str;
+    }
+    if( toGetValue )
+        args.unkonwArg = argv[ argc - 1 ];
+    return args;
+}
+
+#ifndef CRUNCHX_LIBRARY
+static bool parseIndex( const char* text, uint64_t& value )
+{
+    char* end = NULL;
+    errno = 0;
+    value = strtoull( text, &end, 10 );
+    return ( errno == 0 && end != text && *end == '\0' && text[0] != '-' );
+}
+
+//a * b / c rounded down, for b <= c < 2^32
+static uint64_t mulDiv( uint64_t a, uint64_t b, uint64_t c )
+{
+    return ( a / c ) * b + ( a % c ) * b / c;
+}
+
+//narrows [first, last) to the slice of shard "i/N", the slices are sized in
+//proportion to the weights when there are some
+static bool selectShard( const char* shard, const char* weights, uint64_t& first, uint64_t& last )
+{
+    unsigned int index = 0, count = 0;
+    char tail;
+    if( sscanf( shard, "%u/%u%c", &index, &count, &tail ) != 2 || index < 1 || index > count )
+        return false;
+
+    vector< uint64_t > bounds( 1, 0 );  //prefix sums of the weights
+    if( weights == NULL )
+    {
+        for( unsigned int i = 1; i <= count; ++i )
+            bounds.push_back( i );
+    }else
+    {
+        const char* p = weights;
+        while( *p )
+        {
+            char* end = NULL;
+            unsigned long weight = strtoul( p, &end, 10 );
+            if( end == p || ( *end != ',' && *end != '\0' ) )
+                return false;
+            bounds.push_back( bounds.back() + weight );
+            p = ( *end == ',' ) ? end + 1 : end;
+        }
+        if( bounds.size() != count + 1 || bounds.back() == 0 || bounds.back() > 0xffffffffULL )
+            return false;
+    }
+
+    uint64_t size = last - first;
+    last = first + mulDiv( size, bounds[ index ], bounds.back() );
+    first = first + mulDiv( size, bounds[ index - 1 ], bounds.back() );
+    return true;
+}
+
+//order: the producers in dependency order, the main producer last
+//minLength, maxLength: the length range of --min-len and --max-len
+static void printCount( const vector< Producer* >& order, size_t minLength, size_t maxLength )
+{
+    KeyspaceCounter counter;
+    //counting the dependencies first keeps the recursion of count shallow
+    for( size_t i = 0; i + 1 < order.size(); ++i )
+        counter.count( order[i] );
+    const KeyspaceCounter::Stats& total = counter.count( order.back() );
+
+    printf( "%-24s %-28s %-8s %s\n", "producer", "words", "min len", "max len" );
+    KeyspaceCounter::StatsMap::const_iterator iter = counter.stats().begin();
+    for( ; iter != counter.stats().end(); ++iter )
+    {
+        const KeyspaceCounter::Stats& stats = iter->second;
+        size_t shortest = 0;
+        while( shortest < stats.lengths.size() && stats.lengths[ shortest ].isZero() )
+            ++shortest;
+        printf( "%-24s %-28s %-8d %d\n", iter->first->name().c_str(), stats.words.toString().c_str(),
+            (int)shortest, (int)stats.lengths.size() - 1 );
+    }
+
+    printf( "\nwords:%s\n", total.words.toString().c_str() );
+    printf( "bytes:%s\n", KeyspaceCounter::bytes( total ).toString().c_str() );
+    if( minLength > 0 || maxLength != (size_t)-1 )
+    {
+        KeyspaceCounter::Stats inRange;
+        for( size_t i = minLength; i < total.lengths.size() && i <= maxLength; ++i )
+        {
+            inRange.lengths.resize( i + 1 );
+            inRange.lengths[i] = total.lengths[i];
+            inRange.words += total.lengths[i];
+        }
+        printf( "words in length range:%s\n", inRange.words.toString().c_str() );
+        printf( "bytes in length range:%s\n", KeyspaceCounter::bytes( inRange ).toString().c_str() );
+    }
+    printf( "length histogram:\n" );
+    for( size_t i = 0; i < total.lengths.size(); ++i )
+    {
+        if( !total.lengths[i].isZero() )
+            printf( "%8d %s\n", (int)i, total.lengths[i].toString().c_str() );
+    }
+}
+
+static void printAmbiguity( const Plan& plan )
+{
+    printf( "%-24s %-22s %s\n", "producer", "words", "check" );
+    list< Plan::Ambiguity >::const_iterator iter = plan.ambiguities().begin();
+    for( ; iter != plan.ambiguities().end(); ++iter )
+    {
+        char words[32];
+        if( iter->words == Plan::WORDS_OVERFLOW )
+            snprintf( words, sizeof( words ), ">=2^64" );
+        else
+            snprintf( words, sizeof( words ), "%llu", (unsigned long long)iter->words );
+
+        char check[64];
+        if( iter->unique && !iter->removed )
+            snprintf( check, sizeof( check ), iter->expanded ? "unique" : "unique, proven from the rules" );
+        else if( iter->expanded )
+            snprintf( check, sizeof( check ), "%llu duplicate%s%s", (unsigned long long)iter->duplicates,
+                iter->duplicates == 1 ? "" : "s",
+                iter->removed ? ", removed" : "" );
+        else
+            snprintf( check, sizeof( check ), "may repeat words%s", iter->runtime ? ", skipped while generating" : "" );
+        printf( "%-24s %-22s %s\n", iter->producer.c_str(), words, check );
+
+        list< string >::const_iterator overlap = iter->overlaps.begin();
+        for( ; overlap != iter->overlaps.end(); ++overlap )
+            printf( "    %s\n", overlap->c_str() );
+    }
+}
+
+//stops the progress of a run and writes its summary, false when it can not be written
+static bool finishProgress( Progress& progress, const char* summary, bool completed )
+{
+    progress.stop( completed );
+    if( summary && !progress.writeSummary( summary ) )
+    {
+        fprintf( stderr, "error:can not write summary:%s\n", summary );
+        return false;
+    }
+    return true;
+}
+
+//prints the producers in dependency order as rules, the way the optimizer left them
+static void printRules( const vector< Producer* >& order )
+{
+    for( size_t i = 0; i < order.size(); ++i )
+    {
+        const Producer* producer = order[i];
+        if( producer->isWordFile() )
+            continue;
+        printf( "%s:", producer->name().c_str() );
+        for( size_t r = 0; r < producer->ruleCount(); ++r )
+        {
+            ProductRule rule = producer->rule( r );
+            for( const Token* t = rule.begin(); t != rule.end(); ++t )
             {
-                toGetFileName = false;
-                args.ruleFile = str;
+                if( t != rule.begin() )
+                    printf( " " );
+                if( t->type() == Token::eProductor )
+                {
+                    printf( "%s", t->producer()->name().c_str() );
+                    continue;
+                }
+                char quote = memchr( t->data(), '\'', t->length() ) ? '"' : '\'';
+                printf( "%c%.*s%c", quote, (int)t->length(), t->data(), quote );
             }
+            if( producer->hasWeights() )
+                printf( " @%g", producer->ruleWeight( r ) );
+            printf( r + 1 < producer->ruleCount() ? "," : "\n" );
         }
     }
-    return args;
 }
 
 int main( int argc, const char* argv[] )
@@ -894,7 +7440,7 @@ int main( int argc, const char* argv[] )
 
     if( args.unkonwArg != NULL )
     {
-        printf( "ERROR:unknown argument:%s\n", args.unkonwArg );
+        fprintf( stderr, "error:unknown argument:%s\n", args.unkonwArg );
         args.showHelp = true;
     }
 
@@ -905,6 +7451,40 @@ int main( int argc, const char* argv[] )
     }
 
     ErrorMan::ErrorCode err = ErrorMan::eOk;
+    if( args.decode )
+    {
+        BlockReader reader;
+        err = reader.open( args.decode );
+        if( err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:%s:%s\n", reader.error().errorMessage().c_str(), args.decode );
+            return -err;
+        }
+        uint64_t first = 0, last = Plan::WORDS_OVERFLOW;
+        if( ( args.start && !parseIndex( args.start, first ) ) || ( args.end && !parseIndex( args.end, last ) ) )
+        {
+            fprintf( stderr, "error:invalid word index\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        OutputWriter writer;
+        writer.setSplice( args.splice );
+        err = writer.open( args.outputFile );
+        if( err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not open file:%s\n", args.outputFile ? args.outputFile : "stdout" );
+            return -err;
+        }
+        if( args.nulSeparator )
+            writer.setSeparator( '\0' );
+        err = reader.decode( first, last, writer );
+        ErrorMan::ErrorCode closeErr = writer.close();
+        if( err != ErrorMan::eOk )
+            fprintf( stderr, "error:%s:%s\n", reader.error().errorMessage().c_str(), args.decode );
+        else if( closeErr != ErrorMan::eOk )
+            fprintf( stderr, "error:can not write output\n" );
+        return err != ErrorMan::eOk ? -err : -closeErr;
+    }
+
     if( args.creatDefaultRule )
     {
         err = crunchx.setRules( DEFAULT_RULES, strlen( DEFAULT_RULES ) );
@@ -918,7 +7498,7 @@ int main( int argc, const char* argv[] )
         err = crunchx.openRulesFile( args.ruleFile );
         if( err != ErrorMan::eOk )
         {
-            printf( "error:can not open file:%s\n", args.ruleFile );
+            fprintf( stderr, "error:can not open file:%s\n", args.ruleFile );
             return -err;
         }
     }else
@@ -931,24 +7511,485 @@ int main( int argc, const char* argv[] )
         }
     }
 
+    crunchx.setUseReference( args.useReference );
+    if( args.materialize )
+    {
+        uint64_t bytes;
+        if( !parseIndex( args.materialize, bytes ) )
+        {
+            fprintf( stderr, "error:invalid materialize size:%s\n", args.materialize );
+            return -ErrorMan::eInvalidParam;
+        }
+        crunchx.setMaterializeBytes( (size_t)bytes );
+    }
+    if( args.dedup && args.useReference )
+    {
+        fprintf( stderr, "error:--dedup needs the compiled plan\n" );
+        return -ErrorMan::eInvalidParam;
+    }
+    if( args.minLength || args.maxLength )
+    {
+        uint64_t minLength = 0, maxLength = (size_t)-1;
+        if( ( args.minLength && !parseIndex( args.minLength, minLength ) ) ||
+            ( args.maxLength && !parseIndex( args.maxLength, maxLength ) ) || minLength > maxLength )
+        {
+            fprintf( stderr, "error:invalid word length range\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( args.useReference )
+        {
+            fprintf( stderr, "error:--min-len and --max-len need the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        crunchx.setLengthRange( (size_t)minLength, (size_t)maxLength );
+    }
+    if( args.policy )
+    {
+        if( args.useReference )
+        {
+            fprintf( stderr, "error:--policy needs the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( !crunchx.setPolicy( args.policy ) )
+        {
+            fprintf( stderr, "error:%s\n", crunchx.error().errorMessage().c_str() );
+            return -ErrorMan::eInvalidParam;
+        }
+    }
+    int threads = 1;
+    if( args.threads )
+    {
+        uint64_t count = 0;
+        uint64_t maxThreads = max( 1u, thread::hardware_concurrency() ) * 4;
+        if( !parseIndex( args.threads, count ) || count < 1 || count > maxThreads )
+        {
+            fprintf( stderr, "error:invalid thread count:%s, from 1 to %llu\n", args.threads, (unsigned long long)maxThreads );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( args.useReference )
+        {
+            fprintf( stderr, "error:-t needs the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        threads = (int)count;
+    }
+    //the words of --likely, most likely first
+    double minLogProb = -HUGE_VAL;
+    uint64_t likelyLimit = LikelyCursor::DEFAULT_MAX_ENTRIES;
+    if( args.likely || args.minProb || args.likelyLimit )
+    {
+        if( !args.likely || args.useReference || args.dedup || args.start || args.end || args.startWord ||
+            args.shuffle || args.sample || args.shard || args.checkpoint || args.resume ||
+            threads > 1 )
+        {
+            fprintf( stderr, "error:--min-prob and --likely-limit need --likely, which can not be used with -r, -t,"
+                " --dedup, --start, --end, --shuffle, --sample, --shard and checkpoints\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( args.minProb )
+        {
+            char* last;
+            double minProb = strtod( args.minProb, &last );
+            if( *last || !( minProb > 0 && minProb <= 1 ) )
+            {
+                fprintf( stderr, "error:invalid probability:%s\n", args.minProb );
+                return -ErrorMan::eInvalidParam;
+            }
+            minLogProb = log( minProb );
+        }
+        if( args.likelyLimit && ( !parseIndex( args.likelyLimit, likelyLimit ) || likelyLimit == 0 ) )
+        {
+            fprintf( stderr, "error:invalid limit:%s\n", args.likelyLimit );
+            return -ErrorMan::eInvalidParam;
+        }
+        crunchx.setProbabilities( true );
+    }
+    if( args.dedup )
+        crunchx.setAmbiguityMode( Plan::eAmbiguityRemove );
+    else if( args.ambiguity )
+        crunchx.setAmbiguityMode( Plan::eAmbiguityReport );
+    //the ambiguity report and --count name the producers and rules as they are written,
+    //-r generates from them so that it can check the optimizer
+    if( args.ambiguity || args.count || args.useReference )
+        crunchx.setOptimizeRules( false );
     if ( !crunchx.analysis() )
     {
-        printf("ERROR:%s", ErrorMan::errorMessage().c_str() );
-        return ErrorMan::errorCode();
+        fprintf( stderr, "error:%s\n", crunchx.error().errorMessage().c_str() );
+        return crunchx.error().errorCode();
+    }
+
+    if( args.dumpRules )
+    {
+        printRules( crunchx.order() );
+        return 0;
+    }
+
+    if( args.count )
+    {
+        printCount( crunchx.order(), crunchx.plan().minWordLength(), crunchx.plan().maxWordLength() );
+        return 0;
+    }
+
+    if( args.ambiguity )
+    {
+        printAmbiguity( crunchx.plan() );
+        return 0;
+    }
+
+    if( args.likely && crunchx.plan().depth() > LikelyCursor::MAX_DEPTH )
+    {
+        fprintf( stderr, "error:the rules nest %llu levels deep, --likely generates up to %llu\n",
+            (unsigned long long)crunchx.plan().depth(), (unsigned long long)LikelyCursor::MAX_DEPTH );
+        return -ErrorMan::eInvalidGrammar;
     }
 
-    string str;
-    while ( !crunchx.atEnd() )
+    if( args.emitCpp )
     {
-        if( crunchx.product( str ) )
+        CppEmitter emitter( crunchx.plan() );
+        if( args.useReference || !emitter.canEmit() || args.likely || args.start || args.end || args.startWord ||
+            args.shuffle || args.sample || args.shard || args.resume )
         {
-            printf( "%s\n", str.c_str() );
-            crunchx.makeNextProduct();
+            fprintf( stderr, "error:--emit-cpp generates all the words in order, it can not be used with -r, --min-len,"
+                " --max-len, --policy, --likely, a range, --shuffle, --sample, --shard, --resume or duplicates"
+                " removed while generating\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        err = emitter.emit( args.emitCpp, args.ruleFile ? args.ruleFile : DEFAULT_RULES_FILE_NAME,
+            args.nulSeparator ? '\0' : '\n' );
+        if( err != ErrorMan::eOk )
+            fprintf( stderr, "error:can not write file:%s\n", args.emitCpp );
+        return -err;
+    }
+
+    Hasher::Type hashType = Hasher::eMd5;
+    HashTargets targets;
+    if( args.hash || args.targets )
+    {
+        if( !args.hash || !args.targets || args.useReference || args.likely ||
+            ( args.format && strcmp( args.format, "text" ) != 0 ) )
+        {
+            fprintf( stderr, "error:--hash and --targets go together, they can not be used with -r, --likely"
+                " or --format blocks\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( !Hasher::parseType( args.hash, hashType ) )
+        {
+            fprintf( stderr, "error:unknown hash:%s\n", args.hash );
+            return -ErrorMan::eInvalidParam;
+        }
+        size_t badLine;
+        err = targets.load( args.targets, Hasher::digestSize( hashType ), badLine );
+        if( err == ErrorMan::eInvalidParam )
+        {
+            fprintf( stderr, "error:not a %s digest in line %llu of %s\n", args.hash, (unsigned long long)badLine, args.targets );
+            return -err;
+        }
+        if( err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not read targets:%s\n", args.targets );
+            return -err;
+        }
+    }
+
+    //the range of word indexes to generate
+    uint64_t first = 0;
+    uint64_t last = crunchx.plan().words();
+    if( args.start || args.end || args.startWord )
+    {
+        if( args.useReference || last == Plan::WORDS_OVERFLOW )
+        {
+            fprintf( stderr, "error:--start and --end need a keyspace below 2^64 words and the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        uint64_t end = last;
+        if( ( args.start && !parseIndex( args.start, first ) ) || ( args.end && !parseIndex( args.end, end ) ) )
+        {
+            fprintf( stderr, "error:invalid word index\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( args.startWord && !crunchx.plan().rank( args.startWord, first ) )
+        {
+            fprintf( stderr, "error:the rules can not produce the word:%s\n", args.startWord );
+            return -ErrorMan::eInvalidParam;
+        }
+        last = min( last, end );
+        first = min( first, last );
+    }
+    //from here on [first, last) are positions of the permutation when shuffling
+    Permutation permutation;
+    if( args.shuffle || args.sample )
+    {
+        if( args.useReference || last == Plan::WORDS_OVERFLOW )
+        {
+            fprintf( stderr, "error:--shuffle and --sample need a keyspace below 2^64 words and the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        uint64_t seed = 0;
+        uint64_t sample = last - first;
+        if( ( args.shuffle && !parseIndex( args.shuffle, seed ) ) || ( args.sample && !parseIndex( args.sample, sample ) ) )
+        {
+            fprintf( stderr, "error:invalid shuffle seed or sample size\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        permutation.init( seed, first, last - first );
+        last = min( sample, last - first );
+        first = 0;
+    }
+    if( args.shard )
+    {
+        if( args.useReference || last == Plan::WORDS_OVERFLOW )
+        {
+            fprintf( stderr, "error:--shard needs a keyspace below 2^64 words and the compiled plan\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( !selectShard( args.shard, args.shardWeights, first, last ) )
+        {
+            fprintf( stderr, "error:invalid shard:%s\n", args.shard );
+            return -ErrorMan::eInvalidParam;
+        }
+    }
+
+    Checkpoint checkpoint;
+    if( args.resume )
+    {
+        if( !checkpoint.load( args.resume ) )
+        {
+            fprintf( stderr, "error:can not read checkpoint:%s\n", args.resume );
+            return -ErrorMan::eReadFileErr;
+        }
+        if( checkpoint.rulesHash() != crunchx.rulesHash() )
+        {
+            fprintf( stderr, "error:the rules changed since the checkpoint was saved\n" );
+            return -ErrorMan::eInvalidRules;
+        }
+        first = checkpoint.next();
+        last = checkpoint.end();
+        permutation = Permutation();
+        if( checkpoint.shuffled() )
+            permutation.init( checkpoint.seed(), checkpoint.base(), checkpoint.size() );
+    }
+    if( args.checkpoint || args.resume )
+    {
+        uint64_t words = 0;
+        uint64_t seconds = 60;
+        if( ( args.checkpointWords && !parseIndex( args.checkpointWords, words ) ) ||
+            ( args.checkpointSeconds && !parseIndex( args.checkpointSeconds, seconds ) ) )
+        {
+            fprintf( stderr, "error:invalid checkpoint interval\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        if( args.useReference || last == Plan::WORDS_OVERFLOW || first > last || last > crunchx.plan().words() ||
+            ( args.unordered && threads > 1 ) )
+        {
+            fprintf( stderr, "error:checkpoints need ordered output, the compiled plan and a keyspace below 2^64 words\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        checkpoint.setFile( args.checkpoint ? args.checkpoint : args.resume );
+        checkpoint.setInterval( words, seconds );
+        checkpoint.setRange( crunchx.rulesHash(), first, last );
+        if( permutation.isActive() )
+            checkpoint.setShuffle( permutation.seed(), permutation.base(), permutation.size() );
+    }
+
+    uint64_t progressSeconds = 0;
+    if( args.progress && !parseIndex( args.progress, progressSeconds ) )
+    {
+        fprintf( stderr, "error:invalid progress interval:%s\n", args.progress );
+        return -ErrorMan::eInvalidParam;
+    }
+
+    OutputWriter writer;
+    if( args.format && strcmp( args.format, "blocks" ) == 0 )
+        writer.setFormat( OutputWriter::eFormatBlocks );
+    else if( args.format && strcmp( args.format, "text" ) != 0 )
+    {
+        fprintf( stderr, "error:unknown output format:%s\n", args.format );
+        return -ErrorMan::eInvalidParam;
+    }
+    writer.setSplice( args.splice );
+    if( args.nulSeparator )
+        writer.setSeparator( '\0' );
+    if( args.resume && !checkpoint.sameOutput( writer.format(), writer.separator() ) )
+    {
+        fprintf( stderr, "error:the run of the checkpoint was written with another --format or separator\n" );
+        return -ErrorMan::eInvalidParam;
+    }
+    if( checkpoint.isActive() )
+        checkpoint.setOutput( writer.format(), writer.separator() );
+    if( args.shm )
+    {
+#ifdef _WIN32
+        fprintf( stderr, "error:--shm is not supported on this system\n" );
+        return -ErrorMan::eInvalidParam;
+#else
+        if( args.outputFile || args.resume )
+        {
+            fprintf( stderr, "error:--shm can not be used with -o or --resume\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        err = writer.openShm( args.shm );
+        if( err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not create shared memory:%s\n", args.shm );
+            return -err;
+        }
+#endif
+    }else
+    {
+        if( args.resume )
+            err = writer.resume( args.outputFile, checkpoint.output() );
+        else
+            err = writer.open( args.outputFile );
+        if( err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not open file:%s\n", args.outputFile ? args.outputFile : "stdout" );
+            return -err;
+        }
+    }
+    Progress progress;
+    progress.setInterval( progressSeconds );
+
+    if( args.likely )
+    {
+        LikelyCursor cursor;
+        cursor.reset( &crunchx.plan(), minLogProb, (size_t)likelyLimit );
+        progress.start( writer );
+        bool ok = true;
+        uint64_t written = 0;
+        double lastLogProb = 0;
+        for( ; ok && !cursor.atEnd(); cursor.next() )
+        {
+            size_t length;
+            const char* word = cursor.word( length );
+            ok = writer.write( word, length, 0 );
+            lastLogProb = cursor.logProbability();
+            if( ++written % Progress::PUBLISH_INTERVAL == 0 )
+                progress.set( written, 0 );
+        }
+        progress.set( written, 0 );
+        err = writer.close();
+        ok = finishProgress( progress, args.summary, ok && err == ErrorMan::eOk ) && ok;
+        if( !ok || err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not write output\n" );
+            return -ErrorMan::eWriteFileErr;
+        }
+        if( cursor.stoppedAtLimit() && written == 0 )
+            fprintf( stderr, "note:stopped before the first word, --likely-limit is too small for the rules\n" );
+        else if( cursor.stoppedAtLimit() )
+            fprintf( stderr, "note:stopped, --likely-limit is too small for the rules, the words less likely than"
+                " the last one written, of probability %g, may be missing\n", exp( lastLogProb ) );
+        else if( cursor.truncated() )
+            fprintf( stderr, "note:stopped at the limit of --likely-limit, the words of probability %g and less may be missing\n",
+                cursor.droppedBelow() );
+        return 0;
+    }
+
+    if( ( threads > 1 || permutation.isActive() || args.hash ) && !args.useReference )
+    {
+        if( last == Plan::WORDS_OVERFLOW )
+        {
+            fprintf( stderr, "error:the keyspace is too large to be split between threads or hashed\n" );
+            return -ErrorMan::eInvalidParam;
+        }
+        ParallelGenerator generator( crunchx.plan(), writer );
+        generator.setOrdered( !args.unordered );
+        if( permutation.isActive() )
+            generator.setPermutation( &permutation );
+        if( checkpoint.isActive() )
+            generator.setCheckpoint( &checkpoint );
+        if( args.hash )
+            generator.setTargets( hashType, &targets );
+        generator.setProgress( &progress );
+        progress.setRange( first, last - first );
+        progress.setThreads( threads );
+        progress.start( writer );
+        bool ok = generator.run( first, last, threads );
+        if( ok && checkpoint.isActive() )
+            ok = checkpoint.save( last, writer );
+        err = writer.close();
+        ok = finishProgress( progress, args.summary, ok && err == ErrorMan::eOk ) && ok;
+        if( generator.startFailed() )
+        {
+            fprintf( stderr, "error:can not start %d threads\n", threads );
+            return -ErrorMan::eMisc;
+        }
+        if( !ok || err != ErrorMan::eOk )
+        {
+            fprintf( stderr, "error:can not write output\n" );
+            return -ErrorMan::eWriteFileErr;
+        }
+        if( args.hash )
+            fprintf( stderr, "hash:%llu words in %.2f s, %.0f words/s, %llu of %llu targets found\n",
+                (unsigned long long)progress.words(), progress.seconds(),
+                progress.seconds() > 0 ? progress.words() / progress.seconds() : 0.0, (unsigned long long)targets.found(),
+                (unsigned long long)targets.size() );
+        return 0;
+    }
+
+    bool ok = true;
+    bool empty = ( ( first != 0 || last < crunchx.plan().words() ) && !crunchx.seek( first, last ) );
+    bool batches = ( writer.format() == OutputWriter::eFormatText );
+    char separator = writer.separator();
+    uint64_t written = 0;
+    uint64_t published = 0;
+    uint64_t checked = 0;
+    progress.setRange( first, last == Plan::WORDS_OVERFLOW ? 0 : last - first );
+    progress.start( writer );
+    while ( !empty && !crunchx.atEnd() && crunchx.index() < last )
+    {
+        size_t room, bytes;
+        char* out = batches ? writer.reserve( room ) : NULL;
+        size_t words = batches ? crunchx.nextBatch( out, room, last - crunchx.index(), &separator, bytes ) : 0;
+        if( words )
+        {
+            writer.commit( bytes );
+            written += words;
         }else
         {
-            printf("ERROR:%s", ErrorMan::errorMessage().c_str() );
-            return ErrorMan::errorCode();
+            size_t length;
+            size_t shared;
+            const char* word = crunchx.word( length, shared );
+            if( word == NULL )
+            {
+                fprintf( stderr, "error:%s\n", crunchx.error().errorMessage().c_str() );
+                return crunchx.error().errorCode();
+            }
+            if( !writer.write( word, length, shared ) )
+            {
+                ok = false;
+                break;
+            }
+            crunchx.makeNextProduct();
+            ++written;
+        }
+        if( written - published < Progress::PUBLISH_INTERVAL )
+            continue;
+        published = written;
+        progress.set( written, crunchx.index() - first );
+        if( checkpoint.isActive() && written - checked >= Checkpoint::CHECK_INTERVAL )
+        {
+            checked = written;
+            uint64_t index = crunchx.atEnd() ? last : min( crunchx.index(), last );
+            if( checkpoint.due( index ) && !checkpoint.save( index, writer ) )
+            {
+                ok = false;
+                break;
+            }
         }
     }
+    if( ok && checkpoint.isActive() )
+        ok = checkpoint.save( last, writer );
+    if( ok )
+        progress.set( written, last - first );
+    err = writer.close();
+    if( !finishProgress( progress, args.summary, ok && err == ErrorMan::eOk ) || !ok )
+        err = ErrorMan::eWriteFileErr;
+    if( err != ErrorMan::eOk )
+    {
+        fprintf( stderr, "error:can not write output\n" );
+        return -err;
+    }
     return 0;
 }
+#endif
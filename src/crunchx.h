@@ -0,0 +1,99 @@
+//============================================================================
+// Name        : crunchx.h
+// Author      : vincent
+// Version     :
+// Copyright   : all right reserved
+// Description : the library interface of crunchx, build crunchx.cpp with
+//               CRUNCHX_LIBRARY defined to leave out the command line tool
+//============================================================================
+
+#ifndef CRUNCHX_H
+#define CRUNCHX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <atomic>
+
+class Crunchx;
+
+//generates the words of one grammar. a generator owns its rules, its state and its
+//errors, so any number of them can be used in one process, every one by one thread
+//at a time
+class Generator{
+public:
+    static const uint64_t WORDS_OVERFLOW = 0xffffffffffffffffULL;
+
+    Generator();
+    ~Generator();
+
+    //produce every word only once, call it before the rules are set
+    void setDeduplicate( bool deduplicate );
+
+    //produce only the words of this length range, call it before the rules are set.
+    //the word indexes still count the words out of the range
+    void setLengthRange( size_t minLength, size_t maxLength );
+
+    //produce only the words satisfying a policy, the syntax of --policy. call it
+    //before the rules are set, false with errorMessage set when it is invalid
+    bool setPolicy( const char* spec );
+
+    //parse the rules, false with errorMessage set when they are invalid. setting
+    //rules again replaces the previous ones and their error
+    bool setRules( const char* rules, size_t length );
+    bool openRules( const char* fileName );
+
+    const std::string& errorMessage() const;
+    int errorCode() const;
+
+    //number of words of the rules, WORDS_OVERFLOW when it exceeds 64 bits
+    uint64_t words() const;
+
+    //length of the longest word, a buffer of this size always takes the next word
+    size_t maxLength() const;
+
+    //continue with the word of the given index, false when there is no such word
+    bool seek( uint64_t index );
+
+    //index of the next word
+    uint64_t index() const;
+
+    bool atEnd() const;
+
+    //copies as many of the next words as fit into buffer, back to back without
+    //separators. word i takes the bytes from offsets[i] to offsets[i + 1], so
+    //offsets needs room for maxWords + 1 entries. returns the number of words,
+    //0 at the end or when the next word is longer than size
+    size_t next( char* buffer, size_t size, size_t* offsets, size_t maxWords );
+
+private:
+    Generator( const Generator& );
+    Generator& operator = ( const Generator& );
+
+    Crunchx*    m_crunchx;
+    bool        m_ready;
+};
+
+//the shared memory ring of --shm name: this header, then capacity bytes of words
+//from DATA_OFFSET on. head and tail count the bytes written and read since the
+//start, byte n is at DATA_OFFSET + n % capacity.
+//a reader waits until state leaves eRingSetup, reads the bytes before head and
+//then stores the new tail. the producer waits while head - tail is capacity. the
+//output is complete when state is eRingClosed and tail reached head. a reader that
+//stops early sets eRingAborted and the producer fails with a write error.
+//the reader removes the shared memory with shm_unlink after reading the complete
+//output, the producer removes it only when the reader aborted
+struct RingHeader{
+    enum State{ eRingSetup, eRingRunning, eRingClosed, eRingAborted };
+    static const size_t DATA_OFFSET = 4096;
+
+    char        magic[8];   //"CRUNCHXR"
+    uint32_t    version;
+    uint32_t    reserved;
+    uint64_t    capacity;
+    std::atomic< uint32_t > state;
+    alignas( 64 ) std::atomic< uint64_t > head;
+    alignas( 64 ) std::atomic< uint64_t > tail;
+};
+
+#endif
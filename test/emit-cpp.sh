@@ -0,0 +1,70 @@
+#!/bin/sh
+# checks that the programs written by --emit-cpp generate the same words as crunchx.
+# usage: test/emit-cpp.sh [crunchx binary], CXX selects the compiler, g++ by default.
+# exits with 1 when any output differs
+CRUNCHX=${1:-./src/crunchx}
+CXX=${CXX:-g++}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+case $CRUNCHX in
+    /*) ;;
+    *) CRUNCHX=$(pwd)/$CRUNCHX ;;
+esac
+if [ ! -x "$CRUNCHX" ]; then
+    echo "crunchx binary not found:$CRUNCHX" >&2
+    exit 2
+fi
+
+cd "$WORK"
+printf 'alpha\nbeta\n\ngamma\r\ndelta\n' > words.txt
+cat > lengths.rul <<'RULES'
+# alternatives of different lengths at every position, the empty one is dropped
+A:'x','yy','zzz',""
+B:'1','22'
+PRODUCER:A B A 'end'
+RULES
+cat > nested.rul <<'RULES'
+D:'0','1','2','3','4','5','6','7','8','9'
+PAIR:D D
+Y:'19' PAIR,'20' PAIR,'x'
+PRODUCER:Y '-' PAIR,PAIR
+RULES
+cat > wordfile.rul <<'RULES'
+SEP:'_','.'
+PRODUCER:@file("words.txt") SEP @file("words.txt"),@file("words.txt")
+RULES
+cat > weights.rul <<'RULES'
+C:'a' @0.5,'bb' @2
+PRODUCER:C C C @0.1,'w' C
+RULES
+cat > single.rul <<'RULES'
+PRODUCER:'only'
+RULES
+
+failed=0
+check()
+{
+    name=$1
+    shift
+    if ! "$CRUNCHX" -f "$RULES" "$@" > expected ||
+        ! "$CRUNCHX" -f "$RULES" "$@" --emit-cpp gen.cpp ||
+        ! $CXX -O1 -o gen gen.cpp ||
+        ! ./gen > actual; then
+        echo "FAIL $name: can not generate" >&2
+        failed=1
+    elif ! cmp -s expected actual; then
+        echo "FAIL $name: the outputs differ" >&2
+        failed=1
+    else
+        echo "ok   $name"
+    fi
+}
+
+for RULES in "$ROOT/examples/crunchx.rul" lengths.rul nested.rul wordfile.rul weights.rul single.rul; do
+    base=$(basename "$RULES" .rul)
+    check "$base"
+    check "$base -z" -z
+    check "$base --materialize 0" --materialize 0
+done
+exit $failed